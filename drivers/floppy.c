@@ -5,6 +5,8 @@
 #include "matrix/matrix.h"
 #include "hal/hal.h"
 #include "hal/isr.h"
+#include "softirq.h"
+#include "waitqueue.h"
 #include "fs.h"
 #include "device.h"
 #include "devfs.h"
@@ -90,9 +92,17 @@ struct drive_param _dft_drive_params[] = {
 	{6,15,  400*MS, 3000*MS, 20*MS, 3000*MS, {7, 8, 4,25,28,22,31,21}, 8, "3.5\" ED, 2880 KiB"}
 };
 
+/* Time to wait for the controller to raise its interrupt */
+#define FDC_IRQ_TIMEOUT	(3000*MS)
+
 static volatile boolean_t _irq_signaled = FALSE;
 static volatile boolean_t _busy = FALSE;
 
+/* Lock protecting the two flags above, and the waiters for them */
+static struct spinlock _flpy_lock;
+static struct wait_queue _irq_wait;
+static struct wait_queue _busy_wait;
+
 static uint32_t dma_addr;	// Physical address of DMA buffer
 
 /* Primary floppy control */
@@ -165,10 +175,11 @@ static int fdc_in(u_long base_port)
 
 static int wait_fdc(struct fdd *d)
 {
-	volatile boolean_t irq_timeout;
+	boolean_t irq_timeout;
 
 	/* Wait for the interrupt handler to signal command finished */
-	// ...
+	irq_timeout = wait_event(&_irq_wait, &_flpy_lock, _irq_signaled,
+				 FDC_IRQ_TIMEOUT, 0) != 0;
 	
 	/* Read in command result bytes while controller is busy */
 	d->fdc->result_size = 0;
@@ -284,10 +295,38 @@ static void stop_motor(struct fdd *f)
 	}
 }
 
+/* Bottom half of the floppy interrupt, wakes up the command waiters */
+static void flpy_softirq()
+{
+	spinlock_acquire(&_flpy_lock);
+	wait_queue_wake_all(&_irq_wait);
+	spinlock_release(&_flpy_lock);
+}
+
+/* Wait until the controller is not used by anybody else and claim it */
+static void flpy_get()
+{
+	spinlock_acquire(&_flpy_lock);
+	while (_busy) {
+		wait_queue_sleep(&_busy_wait, &_flpy_lock, -1, WAIT_EXCLUSIVE);
+		spinlock_acquire(&_flpy_lock);
+	}
+	_busy = TRUE;
+	spinlock_release(&_flpy_lock);
+}
+
+static void flpy_put()
+{
+	spinlock_acquire(&_flpy_lock);
+	_busy = FALSE;
+	wait_queue_wake_one(&_busy_wait);
+	spinlock_release(&_flpy_lock);
+}
+
 static void flpy_callback(struct registers *regs)
 {
 	_irq_signaled = TRUE;
-	kprintf("flpy_callback: interrupt received!\n");
+	softirq_raise(SOFTIRQ_BLOCK);
 }
 
 int flpy_seek(struct fdd *d, uint32_t track)
@@ -329,8 +368,7 @@ int flpy_read(struct fdd *d, uint32_t lba, uint8_t *buf, uint32_t nr_sectors)
 
 	if (d->param->cmos_type == 0) return -1;
 
-	while (_busy) ;	/* Wait while the floppy driver is already busy. BUSY WAIT! */
-	_busy = TRUE;
+	flpy_get();
 
 	start_motor(d);
 
@@ -360,7 +398,7 @@ int flpy_read(struct fdd *d, uint32_t lba, uint8_t *buf, uint32_t nr_sectors)
 
  errorout:
 	stop_motor(d);
-	_busy = FALSE;
+	flpy_put();
 
 	return rc;
 }
@@ -373,8 +411,7 @@ int flpy_write(struct fdd *d, uint32_t lba, const uint8_t buf, uint32_t nr_secto
 
 	if (d->param->cmos_type == 0) return -1;
 	
-	while (_busy) ;	// The BUSY WAIT!
-	_busy = TRUE;
+	flpy_get();
 
 	start_motor(d);
 
@@ -398,7 +435,7 @@ int flpy_write(struct fdd *d, uint32_t lba, const uint8_t buf, uint32_t nr_secto
 	}
 
 	stop_motor(d);
-	_busy = FALSE;
+	flpy_put();
 
 	return rc;
 }
@@ -426,7 +463,12 @@ int floppy_init(void)
 		goto out;
 	}
 
-	/* Setup the interrupt handler */
+	spinlock_init(&_flpy_lock, "flpy-lock");
+	wait_queue_init(&_irq_wait, "flpy-irq", 0);
+	wait_queue_init(&_busy_wait, "flpy-busy", 0);
+
+	/* Setup the interrupt handler and its bottom half */
+	softirq_register(SOFTIRQ_BLOCK, flpy_softirq);
 	register_IRQ(IRQ6, flpy_callback);
 
 	/* Reset primary controller */
@@ -7,6 +7,7 @@
 #include "debug.h"
 #include "util.h"
 #include "timer.h"
+#include "softirq.h"
 #include "fs.h"
 #include "device.h"
 #include "devfs.h"
@@ -624,6 +625,12 @@ void postprocess()
 	}
 }
 
+/* Bottom half of the keyboard interrupt, decodes the queued scan codes */
+static void kbd_softirq()
+{
+	postprocess();
+}
+
 static void kbd_callback(struct registers *regs)
 {
 	u_char scan_code;
@@ -633,10 +640,11 @@ static void kbd_callback(struct registers *regs)
 	 */
 	scan_code = inportb(KBD_DATA_PORT);
 
-	/* We don't check the error code here */
+	/* We don't check the error code here, decoding is left to the bottom
+	 * half.
+	 */
 	if (!preprocess(scan_code)) {
-		local_irq_enable();	// Reenable interrupts
-		postprocess();	// Do post process
+		softirq_raise(SOFTIRQ_KBD);
 	}
 }
 
@@ -683,7 +691,8 @@ int keyboard_init(void)
 	/* Reset keyboard status */
 	kbd_state_reset();
 
-	/* Register the interrupt handler */
+	/* Register the interrupt handler and its bottom half */
+	softirq_register(SOFTIRQ_KBD, kbd_softirq);
 	register_IRQ(IRQ1, kbd_callback);
 
 	/* Clear the keyboard queue */
@@ -5,6 +5,8 @@
 #include "mm/malloc.h"
 #include "mm/slab.h"
 #include "mutex.h"
+#include "rcu.h"
+#include "proc/thread.h"
 #include "proc/process.h"
 #include "rtl/fsrtl.h"
 #include "fs.h"
@@ -50,6 +52,10 @@ struct vfs_node *vfs_node_alloc(struct vfs_mount *mnt, uint32_t type,
 	return n;
 }
 
+/**
+ * Free a node. A node in the node cache of a mount must be freed with the
+ * lock of the mount held for writing, so no lookup can find it meanwhile.
+ */
 void vfs_node_free(struct vfs_node *node)
 {
 	ASSERT(node->ref_count == 0);
@@ -58,6 +64,7 @@ void vfs_node_free(struct vfs_node *node)
 
 	/* If the node has a mount, remove it from the node cache */
 	if (node->mount) {
+		ASSERT(rwlock_write_held(&node->mount->lock));
 		avl_tree_remove(&node->mount->nodes, node->ino);
 	}
 	
@@ -68,13 +75,12 @@ int vfs_node_refer(struct vfs_node *node)
 {
 	int ref_count;
 
-	ref_count = node->ref_count;
+	ref_count = atomic_inc(&node->ref_count);
 	if (ref_count < 0) {
 		DEBUG(DL_ERR, ("node(%s:%d) %p corrupted.\n",
 			       node->name, node->ino, node));
 		PANIC("vfs_node_refer: ref_count is corrupted!");
 	}
-	node->ref_count++;
 	
 	return ref_count;
 }
@@ -82,18 +88,39 @@ int vfs_node_refer(struct vfs_node *node)
 int vfs_node_deref(struct vfs_node *node)
 {
 	int ref_count;
+	struct vfs_mount *m;
 
-	ref_count = node->ref_count;
+	/* Drop a reference that is not the last one without locking */
+	while ((ref_count = node->ref_count) > 1) {
+		if (atomic_tas(&node->ref_count, ref_count, ref_count - 1)) {
+			return ref_count;
+		}
+	}
+
+	/* This may be the last reference. Lookups take their reference from
+	 * the node cache with the lock of the mount held, so drop it with the
+	 * lock held for writing. A lookup may have taken a new reference by
+	 * the time we hold the lock.
+	 */
+	m = node->mount;
+	if (m) {
+		rwlock_write_acquire(&m->lock);
+	}
+
+	ref_count = atomic_dec(&node->ref_count);
 	if (ref_count <= 0) {
 		DEBUG(DL_ERR, ("node(%s:%d) %p corrupted.\n",
 			       node->name, node->ino, node));
 		PANIC("vfs_node_deref: ref_count is corrupted!");
 	}
-	node->ref_count--;
-	if (!node->ref_count) {
+	if (ref_count == 1) {
 		vfs_node_free(node);
 	}
 
+	if (m) {
+		rwlock_write_release(&m->lock);
+	}
+
 	return ref_count;
 }
 
@@ -302,6 +329,30 @@ int vfs_finddir(struct vfs_node *node, const char *name, ino_t *id)
 	return rc;
 }
 
+/**
+ * Look up a node in the node cache of a mount and reference it, following
+ * mount points. Must be called with the mount's lock held.
+ */
+static struct vfs_node *vfs_cache_lookup(struct vfs_mount *m, ino_t ino)
+{
+	struct vfs_node *n;
+
+	n = avl_tree_lookup(&m->nodes, ino);
+	if (n) {
+		ASSERT((n->mount == m) && (n->ino == ino));
+		DEBUG(DL_DBG, ("VFS node cache name(%s).\n", n->name));
+		if (n->mounted) {
+			DEBUG(DL_DBG, ("node(%s) is mountpoint, root(%s).\n",
+				       n->name, n->mounted->root->name));
+			n = n->mounted->root;
+			ASSERT(n->type == VFS_DIRECTORY);
+		}
+		vfs_node_refer(n);
+	}
+
+	return n;
+}
+
 static struct vfs_node *vfs_lookup_internal(struct vfs_node *n, char *path)
 {
 	int rc = -1;
@@ -378,34 +429,32 @@ static struct vfs_node *vfs_lookup_internal(struct vfs_node *n, char *path)
 		}
 
 		m = n->mount;
-		mutex_acquire(&m->lock);
 		v = n;
 
 		DEBUG(DL_DBG, ("looking for (%s) in node(%s) ino(%d).\n", tok, n->name, ino));
 		
-		/* Lookup the node in cached tree first */
-		n = avl_tree_lookup(&m->nodes, ino);
-		if (n) {
-			ASSERT((n->mount == m) && (n->ino == ino));
-			DEBUG(DL_DBG, ("VFS node cache name(%s) tok(%s).\n",
-				       n->name, tok));
-			if (n->mounted) {
-				DEBUG(DL_DBG, ("node(%s) is mountpoint, root(%s).\n",
-					       n->name, n->mounted->root->name));
-				n = n->mounted->root;
-				ASSERT(n->type == VFS_DIRECTORY);
-				vfs_node_refer(n);
-			} else {
-				vfs_node_refer(n);
-			}
-		} else {
+		/* Lookup the node in cached tree first, concurrent lookups
+		 * only need to read it.
+		 */
+		rwlock_read_acquire(&m->lock);
+		n = vfs_cache_lookup(m, ino);
+		rwlock_read_release(&m->lock);
+
+		if (!n) {
 			/* The node is not in the cache tree. Load it from the
-			 * file system
+			 * file system, someone may have done so since we looked.
 			 */
+			rwlock_write_acquire(&m->lock);
+
+			n = vfs_cache_lookup(m, ino);
+			if (n) {
+				goto loaded;
+			}
+
 			if (!m->ops->read_node) {
 				DEBUG(DL_DBG, ("no read_node on mount(%s).\n",
 					       m->type->name));
-				mutex_release(&m->lock);
+				rwlock_write_release(&m->lock);
 				vfs_node_deref(v);
 				return NULL;
 			}
@@ -413,7 +462,7 @@ static struct vfs_node *vfs_lookup_internal(struct vfs_node *n, char *path)
 			rc = m->ops->read_node(m, ino, &n);
 			if (rc != 0) {
 				DEBUG(DL_INF, ("read_node failed, mount(%s).\n", m->type->name));
-				mutex_release(&m->lock);
+				rwlock_write_release(&m->lock);
 				vfs_node_deref(v);
 				return NULL;
 			}
@@ -425,9 +474,10 @@ static struct vfs_node *vfs_lookup_internal(struct vfs_node *n, char *path)
 
 			DEBUG(DL_DBG, ("vfs node(%s:%d) miss, ref_count(%d).\n",
 				       n->name, n->ino, n->ref_count));
+		loaded:
+			rwlock_write_release(&m->lock);
 		}
 
-		mutex_release(&m->lock);
 		ASSERT(v != NULL);
 		vfs_node_deref(v);
 	}
@@ -484,7 +534,7 @@ static struct vfs_type *vfs_type_lookup_internal(const char *name)
 	struct list *l;
 	struct vfs_type *type;
 	
-	LIST_FOR_EACH(l, &_fs_list) {
+	LIST_FOR_EACH_RCU(l, &_fs_list) {
 		type = LIST_ENTRY(l, struct vfs_type, link);
 		if (strcmp(type->name, name) == 0) {
 			return type;
@@ -498,14 +548,14 @@ static struct vfs_type *vfs_type_lookup(const char *name)
 {
 	struct vfs_type *type;
 
-	mutex_acquire(&_fs_list_lock);
+	rcu_read_lock();
 
 	type = vfs_type_lookup_internal(name);
 	if (type) {
 		atomic_inc(&type->ref_count);
 	}
 
-	mutex_release(&_fs_list_lock);
+	rcu_read_unlock();
 
 	return type;
 }
@@ -528,7 +578,7 @@ int vfs_type_register(struct vfs_type *type)
 	}
 	
 	type->ref_count = 0;
-	list_add_tail(&type->link, &_fs_list);
+	list_add_tail_rcu(&type->link, &_fs_list);
 
 	rc = 0;
 	
@@ -551,9 +601,16 @@ int vfs_type_unregister(struct vfs_type *type)
 	} else if (type->ref_count > 0) {
 		;
 	} else {
-		ASSERT(type->ref_count == 0);
-		list_del(&type->link);
-		rc = 0;
+		/* Unpublish the type first, a lookup could still take a
+		 * reference until the readers in progress are done.
+		 */
+		list_del_rcu(&type->link);
+		synchronize_rcu();
+		if (type->ref_count > 0) {
+			list_add_tail_rcu(&type->link, &_fs_list);
+		} else {
+			rc = 0;
+		}
 	}
 
 	mutex_release(&_fs_list_lock);
@@ -607,7 +664,7 @@ int vfs_mount(const char *dev, const char *path, const char *type, const void *d
 		goto out;
 	}
 	LIST_INIT(&mnt->link);
-	mutex_init(&mnt->lock, "fs-mnt-mutex", 0);
+	rwlock_init(&mnt->lock, "fs-mnt-rwlock");
 	avl_tree_init(&mnt->nodes);
 	mnt->flags = flags;
 	mnt->mnt_point = n;
@@ -646,7 +703,7 @@ int vfs_mount(const char *dev, const char *path, const char *type, const void *d
 	}
 
 	/* Append the mount to the mount list */
-	list_add_tail(&mnt->link, &_mount_list);
+	list_add_tail_rcu(&mnt->link, &_mount_list);
 	if (!_root_mount) {
 		/* The first mount is the root mount */
 		_root_mount = mnt;
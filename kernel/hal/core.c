@@ -3,7 +3,10 @@
 #include "hal/hal.h"
 #include "hal/lapic.h"
 #include "hal/core.h"
+#include "hal/fpu.h"
 #include "pit.h"
+#include "timer.h"
+#include "hrtimer.h"
 #include "debug.h"
 #include "mm/mlayout.h"
 #include "mm/page.h"
@@ -33,6 +36,15 @@ struct list _running_cores = {
 	.next = &_running_cores,
 };
 
+/* Lock to serialize the COREs adding themselves to the running list. The
+ * list is walked without it, a CORE shows up fully linked or not at all.
+ */
+static struct spinlock _running_cores_lock = {
+	.value = 1,
+	.state = FALSE,
+	.name = "running-cores-lock"
+};
+
 struct core **_cores = NULL;
 
 /* Double fault handler stack for the boot CORE */
@@ -65,8 +77,15 @@ static void core_ctor(struct core *c, core_id_t id, int state)
 	c->state = state;
 
 	/* Initialize timer information */
-	spinlock_init(&c->timer_lock, "tmr-lock");
-	LIST_INIT(&c->timers);
+	spinlock_init_type(&c->timer_lock, "tmr-lock", SPINLOCK_TICKET);
+	timer_wheel_init(&c->timers);
+	rcu_core_init(&c->rcu);
+	softirq_core_init(&c->softirq);
+	work_pool_init(&c->works, c);
+	LIST_INIT(&c->free_threads);
+	c->nr_free_threads = 0;
+	c->calls = NULL;
+	hrtimer_queue_init(&c->hrtimers);
 }
 
 void dump_core(struct core *c)
@@ -111,6 +130,10 @@ static void detect_core_features(struct core *c, struct core_features *f)
 			c->arch.max_phys_bits = eax & 0xFF;
 			c->arch.max_virt_bits = (eax >> 8) & 0xFF;
 		}
+
+		if (f->highest_extended >= X86_COREID_ADVANCED_PM) {
+			x86_coreid(X86_COREID_ADVANCED_PM, &eax, &ebx, &ecx, &f->power_edx);
+		}
 	} else {
 		f->highest_extended = 0;
 	}
@@ -169,8 +192,8 @@ static void arch_preinit_core_percore(struct core *c)
 		 */
 		if (features.highest_standard < X86_COREID_FEATURE_INFO) {
 			PANIC("COREID feature information not supported");
-		} else if (!_core_features.fpu || !_core_features.fxsr) {
-			PANIC("CORE does not support FPU/FXSR");
+		} else if (!_core_features.fpu) {
+			PANIC("CORE does not support FPU");
 		} else if (!_core_features.tsc) {
 			PANIC("CORE does not support TSC");
 		} else if (!_core_features.pge) {
@@ -182,7 +205,8 @@ static void arch_preinit_core_percore(struct core *c)
 		    (_core_features.standard_edx != features.standard_edx) ||
 		    (_core_features.standard_ecx != features.standard_ecx) ||
 		    (_core_features.extended_edx != features.extended_edx) ||
-		    (_core_features.extended_ecx != features.extended_ecx)) {
+		    (_core_features.extended_ecx != features.extended_ecx) ||
+		    (_core_features.power_edx != features.power_edx)) {
 			PANIC("CORE has different feature set to boot CORE");
 		}
 	}
@@ -206,6 +230,9 @@ static void arch_preinit_core_percore(struct core *c)
 	/* Set NE/MP in CR0 (Numeric Error, Monitor Coprocessor) and clear EM (Emulation). */
 	x86_write_cr0((x86_read_cr0() | X86_CR0_NE | X86_CR0_MP) & ~X86_CR0_EM);
 
+	/* Enable SSE and make the first FPU use of a thread trap */
+	init_fpu_percore();
+
 	/* Configure the TSC offset for sys_time() */
 	tsc_init_target();
 }
@@ -213,6 +240,9 @@ static void arch_preinit_core_percore(struct core *c)
 static void arch_init_core_percore()
 {
 	init_lapic();
+
+	/* Start the timer event of this CORE */
+	init_hrtimer_percore();
 }
 
 uint64_t calculate_core_freq()
@@ -298,6 +328,8 @@ struct core *core_register(core_id_t id, int state)
 		memset(cores, 0, s);
 		s = sizeof(struct core *) * (_highest_core_id + 1);
 		memcpy(cores, _cores, s);
+		kfree(_cores);
+		_cores = cores;
 		
 		_highest_core_id = id;
 	}
@@ -314,7 +346,9 @@ void preinit_core_percore(struct core *c)
 	arch_preinit_core_percore(c);
 
 	/* Add the core to the running CORE list */
-	list_add_tail(&CURR_CORE->link, &_running_cores);
+	spinlock_acquire(&_running_cores_lock);
+	list_add_tail_rcu(&CURR_CORE->link, &_running_cores);
+	spinlock_release(&_running_cores_lock);
 }
 
 void preinit_core()
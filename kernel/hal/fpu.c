@@ -0,0 +1,144 @@
+/*
+ * fpu.c
+ */
+
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include "hal/core.h"
+#include "hal/fpu.h"
+#include "mm/malloc.h"
+#include "proc/thread.h"
+#include "debug.h"
+
+/* Default value of MXCSR, all SIMD exceptions masked */
+#define MXCSR_DEFAULT	0x1F80
+
+/* The FXSAVE area is allocated with some slack to align it */
+#define FPU_AREA(t)	\
+	((void *)(((uint32_t)(t)->arch.fpu + FPU_STATE_ALIGN - 1) & \
+		  ~(FPU_STATE_ALIGN - 1)))
+
+/* A CORE without FXSR only has the x87 state, saved with FSAVE/FRSTOR
+ * into the start of the same area.
+ */
+static INLINE void fpu_save(void *area)
+{
+	if (_core_features.fxsr) {
+		asm volatile("fxsave (%0)" :: "r"(area) : "memory");
+	} else {
+		asm volatile("fnsave (%0)" :: "r"(area) : "memory");
+	}
+}
+
+static INLINE void fpu_restore(void *area)
+{
+	if (_core_features.fxsr) {
+		asm volatile("fxrstor (%0)" :: "r"(area) : "memory");
+	} else {
+		asm volatile("frstor (%0)" :: "r"(area) : "memory");
+	}
+}
+
+static INLINE void fpu_init_state()
+{
+	uint32_t mxcsr = MXCSR_DEFAULT;
+
+	asm volatile("fninit");
+	if (_core_features.sse) {
+		asm volatile("ldmxcsr %0" :: "m"(mxcsr));
+	}
+}
+
+/**
+ * Called when switching away from a thread. If the thread used the FPU in
+ * this time slice its state is still live in the registers, save it and
+ * set CR0.TS so that the next user of the FPU traps. Threads that did not
+ * touch the FPU leave the CORE untouched.
+ */
+void fpu_switch(struct thread *prev)
+{
+	struct core *c = CURR_CORE;
+
+	if (!c->fpu_owner) {
+		return;
+	}
+
+	ASSERT(c->fpu_owner == prev);
+
+	fpu_save(FPU_AREA(prev));
+	c->fpu_owner = NULL;
+	x86_write_cr0(x86_read_cr0() | X86_CR0_TS);
+}
+
+/**
+ * Handle the device not available trap raised by the first FPU/SSE
+ * instruction of a thread in its time slice. The thread's state is loaded
+ * into the registers, or a clean state on its first use of the FPU.
+ */
+boolean_t fpu_trap()
+{
+	struct core *c = CURR_CORE;
+	struct thread *t = CURR_THREAD;
+
+	if (!t || !(x86_read_cr0() & X86_CR0_TS)) {
+		return FALSE;
+	}
+
+	ASSERT(c->fpu_owner == NULL);
+
+	/* Clear CR0.TS so the FPU instructions below don't trap again */
+	asm volatile("clts");
+
+	/* The area comes with the thread, we can't allocate in a trap */
+	ASSERT(t->arch.fpu != NULL);
+
+	if (!t->arch.fpu_used) {
+		/* Start the thread with a clean FPU state */
+		fpu_init_state();
+		t->arch.fpu_used = TRUE;
+	} else {
+		fpu_restore(FPU_AREA(t));
+	}
+
+	c->fpu_owner = t;
+
+	return TRUE;
+}
+
+/**
+ * Allocate the FPU save area of a new thread structure. The area stays with
+ * the structure while it is cached for reuse.
+ */
+int fpu_alloc(struct thread *t)
+{
+	t->arch.fpu = kmalloc(FPU_STATE_SIZE + FPU_STATE_ALIGN - 1, 0);
+	if (!t->arch.fpu) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void fpu_free(struct thread *t)
+{
+	if (t->arch.fpu) {
+		kfree(t->arch.fpu);
+		t->arch.fpu = NULL;
+	}
+}
+
+void init_fpu_percore()
+{
+	/* Enable FXSAVE/FXRSTOR and SSE instructions if the CORE has them,
+	 * the FPU state is switched with FSAVE/FRSTOR otherwise.
+	 */
+	if (_core_features.fxsr) {
+		x86_write_cr4(x86_read_cr4() | X86_CR4_OSFXSR |
+			      X86_CR4_OSXMMEXCPT);
+	}
+
+	/* Nobody owns the FPU yet, trap on the first use */
+	CURR_CORE->fpu_owner = NULL;
+	x86_write_cr0(x86_read_cr0() | X86_CR0_TS);
+}
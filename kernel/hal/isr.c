@@ -9,6 +9,9 @@
 #include "hal/hal.h"
 #include "hal/spinlock.h"
 #include "hal/core.h"
+#include "hal/fpu.h"
+#include "proc/sched.h"
+#include "softirq.h"
 #include "util.h"
 #include "debug.h"
 
@@ -66,6 +69,12 @@ void irq_handler(struct registers regs)
 	 * IRQs now
 	 */
 	local_irq_done(int_no);
+
+	/* Run the bottom halves the handler deferred */
+	softirq_run();
+
+	/* The interrupt may have readied a more important thread */
+	sched_preempt();
 }
 
 void register_IRQ(uint8_t irq, isr_t handler)
@@ -139,6 +148,11 @@ void invalid_opcode_fault(struct registers *regs)
 
 void no_device_fault(struct registers *regs)
 {
+	/* Load the FPU state of the current thread on its first use */
+	if (fpu_trap()) {
+		return;
+	}
+
 	dump_registers(regs);
 	PANIC("Device not found");
 }
@@ -8,10 +8,11 @@
 #include "mm/page.h"
 #include "mm/phys.h"
 #include "smp.h"
+#include "hrtimer.h"
 
-#define LAPIC_TIMER_PERIODIC	0x20000
-
-extern void timer_tick();
+#define LAPIC_TIMER_ONESHOT		0x00000
+#define LAPIC_TIMER_PERIODIC		0x20000
+#define LAPIC_TIMER_TSC_DEADLINE	0x40000
 
 /* Local APIC mapping. NULL if LAPIC is not present */
 static volatile uint8_t *_lapic_mapping = NULL;
@@ -19,6 +20,9 @@ static volatile uint8_t *_lapic_mapping = NULL;
 /* Local APIC base address */
 static phys_addr_t _lapic_base = 0;
 
+/* Whether the LAPIC timer runs in TSC-deadline mode */
+static boolean_t _lapic_tsc_deadline = FALSE;
+
 static INLINE uint32_t lapic_read(uint32_t reg)
 {
 	return *((uint32_t *)(_lapic_mapping + reg));
@@ -42,6 +46,37 @@ void lapic_timer_prepare(useconds_t us)
 	lapic_write(LAPIC_REG_TIMER_INITIAL, (cnt == 0 && us != 0) ? 1 : cnt);
 }
 
+/**
+ * Arm the LAPIC timer to fire once at the specified TSC value. In TSC-deadline
+ * mode the deadline is written as is, otherwise it is converted to a count
+ * for the one-shot mode.
+ */
+void lapic_timer_program(uint64_t deadline)
+{
+	uint64_t now, delta;
+	uint32_t cnt;
+
+	if (!_lapic_mapping) {
+		return;
+	}
+
+	if (_lapic_tsc_deadline) {
+		x86_write_msr(X86_MSR_TSC_DEADLINE, deadline);
+		return;
+	}
+
+	now = x86_rdtsc();
+	delta = (deadline > now) ? (deadline - now) : 0;
+
+	/* Keep the product below in 64 bits */
+	if (delta > 0xFFFFFFFF) {
+		delta = 0xFFFFFFFF;
+	}
+
+	cnt = (uint32_t)((delta * CURR_CORE->arch.lapic_tsc_cv) >> 32);
+	lapic_write(LAPIC_REG_TIMER_INITIAL, cnt ? cnt : 1);
+}
+
 void lapic_spurious_handler(struct registers *regs)
 {
 	kprintf("lapic received spurious interrupt!\n");
@@ -50,7 +85,7 @@ void lapic_spurious_handler(struct registers *regs)
 void lapic_timer_handler(struct registers * regs)
 {
 	lapic_eoi();
-	timer_tick();
+	hrtimer_interrupt();
 }
 
 void lapic_ipi_handler(struct registers *regs)
@@ -102,6 +137,7 @@ void init_lapic()
 {
 	uint64_t base;
 	uint64_t lapic_tmr_cv;
+	uint64_t lapic_tsc_cv;
 
 	/* Don't do anything if we don't support LAPIC */
 	if (!_core_features.apic) {
@@ -171,22 +207,37 @@ void init_lapic()
 	kprintf("lapic: timer conversion factor for CORE %d is %lld\n",
 		CURR_CORE->id, CURR_CORE->arch.lapic_tmr_cv);
 
+	/* Figure out the LAPIC timer counts per TSC cycle for one-shot mode */
+	lapic_tsc_cv = CURR_CORE->arch.lapic_freq;
+	do_div(lapic_tsc_cv, 8);
+	lapic_tsc_cv <<= 32;
+	do_div(lapic_tsc_cv, CURR_CORE->arch.core_freq);
+	CURR_CORE->arch.lapic_tsc_cv = lapic_tsc_cv;
+
 	/* Enable the local APIC (bit 8) and set spurious interrupt handler
 	 * in the Spurious Interrupt Vector Register.
 	 */
 	lapic_write(LAPIC_REG_SPURIOUS, LAPIC_VECT_SPURIOUS | (1<<8));
 
-	/* Set the initial count, it's a magic number. I just get it by several
-	 * tests and it works.
-	 */
-	lapic_write(LAPIC_REG_TIMER_INITIAL, 10240);
-	
-	/* Map APIC timer to an interrupt vector, we are setting it in periodic
-	 * mode. For effiency we should use one-shot mode.
-	 */
-	lapic_write(LAPIC_REG_LVT_TIMER,
-		    LAPIC_VECT_TIMER | LAPIC_TIMER_PERIODIC);
-
 	/* Setup divider to 8 */
 	lapic_write(LAPIC_REG_TIMER_DIVIDER, LAPIC_TIMER_DIV8);
+
+	/* Map APIC timer to an interrupt vector. The timer is armed for each
+	 * event by lapic_timer_program(), prefer TSC-deadline mode which
+	 * avoids the conversion to LAPIC counts.
+	 */
+	if (_core_features.tscd) {
+		_lapic_tsc_deadline = TRUE;
+		lapic_write(LAPIC_REG_LVT_TIMER,
+			    LAPIC_VECT_TIMER | LAPIC_TIMER_TSC_DEADLINE);
+
+		/* Make sure the mode switch is done before the MSR write */
+		asm volatile("mfence" ::: "memory");
+	} else {
+		lapic_write(LAPIC_REG_LVT_TIMER,
+			    LAPIC_VECT_TIMER | LAPIC_TIMER_ONESHOT);
+	}
+
+	kprintf("lapic: CORE %d timer in %s mode\n", CURR_CORE->id,
+		_lapic_tsc_deadline ? "TSC-deadline" : "one-shot");
 }
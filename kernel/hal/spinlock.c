@@ -5,9 +5,10 @@
 #include "hal/hal.h"
 #include "hal/core.h"
 #include "hal/spinlock.h"
+#include "lockstat.h"
 #include "debug.h"
 
-static INLINE void spinlock_lock_internal(struct spinlock *lock)
+static INLINE boolean_t spinlock_tas_lock(struct spinlock *lock)
 {
 	/* Attempt to take the lock. */
 	if (atomic_dec(&lock->value) != 1) {
@@ -29,6 +30,136 @@ static INLINE void spinlock_lock_internal(struct spinlock *lock)
 		} else {
 			PANIC("spinlock_lock_internal: lock value invalid.");
 		}
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Take a ticket and wait for it to be served */
+static INLINE boolean_t spinlock_ticket_lock(struct spinlock *lock)
+{
+	int32_t ticket;
+
+	ticket = atomic_inc(&lock->value);
+	if (lock->ticket != ticket) {
+		if (_nr_cores > 1) {
+			while (lock->ticket != ticket) {
+				core_spin_hint();
+			}
+		} else {
+			PANIC("spinlock_lock_internal: lock value invalid.");
+		}
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Get a free MCS node of the current CORE, interrupts must be disabled */
+static INLINE struct mcs_node *spinlock_mcs_node()
+{
+	struct mcs_node *node;
+	int i;
+
+	node = CURR_CORE->mcs_nodes;
+	for (i = 0; i < NR_MCS_NODES; i++, node++) {
+		if (!node->busy) {
+			node->busy = TRUE;
+			return node;
+		}
+	}
+
+	PANIC("spinlock_mcs_node: MCS locks nested too deep.");
+	return NULL;
+}
+
+/* Queue up behind the tail and spin on our own node until handed the lock */
+static INLINE boolean_t spinlock_mcs_lock(struct spinlock *lock)
+{
+	struct mcs_node *node, *prev;
+
+	node = spinlock_mcs_node();
+	node->next = NULL;
+	node->locked = TRUE;
+
+	prev = (struct mcs_node *)atomic_xchg(&lock->value, (int32_t)node);
+	if (prev) {
+		if (_nr_cores > 1) {
+			prev->next = node;
+			while (node->locked) {
+				core_spin_hint();
+			}
+		} else {
+			PANIC("spinlock_lock_internal: lock value invalid.");
+		}
+	}
+
+	lock->node = node;
+
+	return prev != NULL;
+}
+
+static INLINE void spinlock_mcs_unlock(struct spinlock *lock)
+{
+	struct mcs_node *node;
+
+	node = lock->node;
+	if (!node->next) {
+		/* No one queued behind us, try to mark the lock free */
+		if (atomic_tas(&lock->value, (int32_t)node, 0)) {
+			goto out;
+		}
+
+		/* A waiter swapped the tail but has not linked itself yet */
+		while (!node->next) {
+			core_spin_hint();
+		}
+	}
+
+	node->next->locked = FALSE;
+
+ out:
+	node->busy = FALSE;
+}
+
+static INLINE void spinlock_lock_internal(struct spinlock *lock)
+{
+	uint64_t start;
+	boolean_t contended;
+
+	start = LOCKSTAT_NOW();
+
+	switch (lock->type) {
+	case SPINLOCK_TICKET:
+		contended = spinlock_ticket_lock(lock);
+		break;
+	case SPINLOCK_MCS:
+		contended = spinlock_mcs_lock(lock);
+		break;
+	default:
+		contended = spinlock_tas_lock(lock);
+		break;
+	}
+
+	LOCKSTAT_ACQUIRED(lock, start,
+			  contended ? LOCKSTAT_SPUN : LOCKSTAT_FREE);
+}
+
+static INLINE void spinlock_unlock_internal(struct spinlock *lock)
+{
+	LOCKSTAT_RELEASED(lock);
+
+	switch (lock->type) {
+	case SPINLOCK_TICKET:
+		lock->ticket++;
+		break;
+	case SPINLOCK_MCS:
+		spinlock_mcs_unlock(lock);
+		break;
+	default:
+		lock->value = 1;
+		break;
 	}
 }
 
@@ -66,7 +197,7 @@ void spinlock_release(struct spinlock *lock)
 	state = lock->state;
 
 	leave_cs_barrier();
-	lock->value = 1;
+	spinlock_unlock_internal(lock);
 	local_irq_restore(state);
 }
 
@@ -86,7 +217,7 @@ void spinlock_release_noirq(struct spinlock *lock)
 	}
 
 	leave_cs_barrier();
-	lock->value = 1;
+	spinlock_unlock_internal(lock);
 }
 
 /**
@@ -94,7 +225,24 @@ void spinlock_release_noirq(struct spinlock *lock)
  */
 void spinlock_init(struct spinlock *lock, const char *name)
 {
-	lock->value = 1;
+	spinlock_init_type(lock, name, SPINLOCK_TAS);
+}
+
+/**
+ * Initialize a spinlock of the specified type. Ticket locks hand the lock
+ * out in FIFO order, MCS locks additionally let every waiter spin on its
+ * own cache line and suit the most contended locks.
+ */
+void spinlock_init_type(struct spinlock *lock, const char *name, int type)
+{
+	lock->value = (type == SPINLOCK_TAS) ? 1 : 0;
 	lock->name = name;
 	lock->state = FALSE;
+	lock->type = type;
+	lock->ticket = 0;
+	lock->node = NULL;
+#ifdef _LOCKSTAT
+	lock->stats = NULL;
+	lock->acquire_stamp = 0;
+#endif	/* _LOCKSTAT */
 }
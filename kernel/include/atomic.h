@@ -31,6 +31,12 @@ static INLINE int32_t atomic_dec(atomic_t *var)
 	return atomic_sub(var, 1);
 }
 
+static INLINE int32_t atomic_xchg(atomic_t *var, int32_t val)
+{
+	asm volatile("xchgl %0, %1" : "+r"(val), "+m"(*var) :: "memory");
+	return val;
+}
+
 static INLINE int atomic_tas(atomic_t *var, int32_t test, int32_t val)
 {
 	int res;
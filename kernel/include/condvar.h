@@ -0,0 +1,24 @@
+#ifndef __CONDVAR_H__
+#define __CONDVAR_H__
+
+#include "hal/spinlock.h"
+#include "waitqueue.h"
+
+struct mutex;
+
+/* Condition variable, waited on with a mutex protecting the condition */
+struct condvar {
+	struct spinlock lock;		// Lock to protect the wait queue
+	struct wait_queue wait;		// Threads waiting for a signal
+	const char *name;		// Name of the condition variable
+};
+typedef struct condvar condvar_t;
+
+extern int condvar_wait_timeout(struct condvar *cv, struct mutex *m,
+				useconds_t timeout);
+extern void condvar_wait(struct condvar *cv, struct mutex *m);
+extern void condvar_signal(struct condvar *cv);
+extern void condvar_broadcast(struct condvar *cv);
+extern void condvar_init(struct condvar *cv, const char *name);
+
+#endif	/* __CONDVAR_H__ */
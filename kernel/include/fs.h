@@ -3,6 +3,7 @@
 
 #include <types.h>
 #include "mutex.h"
+#include "rwlock.h"
 #include "dirent.h"
 #include "rtl/avltree.h"
 
@@ -30,7 +31,7 @@ struct vfs_mount_ops {
 /* Structure contains detail of a mounted File System */
 struct vfs_mount {
 	struct list link;
-	struct mutex lock;
+	struct rwlock lock;		// Protects the node cache
 
 	struct avl_tree nodes;		// Tree mapping node IDs to node structure
 
@@ -57,7 +58,7 @@ struct vfs_node_ops {
 /* Structure contains detail of a File System node */
 struct vfs_node {
 	char name[128];
-	int ref_count;
+	atomic_t ref_count;
 	uint32_t type;
 	uint32_t mask;
 	uint32_t uid;
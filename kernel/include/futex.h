@@ -0,0 +1,9 @@
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include "sys/futex.h"
+
+extern int sys_futex(int *uaddr, int op, int val, void *arg, int val2);
+extern void init_futex();
+
+#endif	/* __FUTEX_H__ */
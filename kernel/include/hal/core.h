@@ -7,10 +7,16 @@
 #include "list.h"
 #include "debug.h"
 #include "hal/hal.h"
+#include "timer.h"
+#include "hrtimer.h"
+#include "rcu.h"
+#include "softirq.h"
+#include "workqueue.h"
 
 /* Model Specific Register */
 #define X86_MSR_TSC		0x10		// Time Stamp Counter (TSC)
 #define X86_MSR_APIC_BASE	0x1B		// LAPIC base address
+#define X86_MSR_TSC_DEADLINE	0x6E0		// TSC deadline for the LAPIC timer
 #define X86_MSR_MTRR_BASE0	0x200		// Base of the variable length MTRR base register
 #define X86_MSR_MTRR_MASK0	0x201		// Base of the variable length MTRR mask register
 #define X86_MSR_CR_PAT		0x277		// PAT
@@ -33,6 +39,10 @@
 #define X86_CR0_WP		(1<<16)		// Write Protect
 #define X86_CR0_PG		(1<<31)		// Paging Enabled
 
+/* Flags in CR4 */
+#define X86_CR4_OSFXSR		(1<<9)		// OS supports FXSAVE/FXRSTOR
+#define X86_CR4_OSXMMEXCPT	(1<<10)		// OS supports unmasked SIMD exceptions
+
 /* Flags in DR6 (Debug Status Register) */
 #define X86_DR6_B0		(1<<0)		// Breakpoint 0 condition detected
 #define X86_DR6_B1		(1<<1)		// Breakpoint 1 condition detected
@@ -167,6 +177,16 @@ struct core_features {
 		};
 		uint32_t extended_ecx;
 	};
+
+	/* Advanced power management features (EDX) */
+	union {
+		struct {
+			unsigned :8;
+			unsigned invariant_tsc:1;
+			unsigned :23;
+		};
+		uint32_t power_edx;
+	};
 };
 typedef struct core_features core_features_t;
 
@@ -185,6 +205,7 @@ struct arch_core {
 
 	/* Time conversion factors */
 	uint64_t lapic_tmr_cv;		// LAPIC timer conversion factor
+	uint64_t lapic_tsc_cv;		// LAPIC timer counts per TSC cycle (32.32)
 	uint64_t cycles_per_us;		// CORE cycles per us
 	int64_t sys_time_offset;	// Value to subtract from TSC value for sys_time()
 	
@@ -204,6 +225,7 @@ typedef uint32_t core_id_t;
 struct va_space;
 struct thread;
 struct sched_core;
+struct smp_call;
 
 struct core {
 	struct list link;		// Link to running COREs list
@@ -221,8 +243,17 @@ struct core {
 	struct sched_core *sched;	// Scheduler run queues/timers
 	struct thread *thread;		// Currently executing thread
 	struct va_space *aspace;	// Address space currently in use
-	struct spinlock timer_lock;	// Lock to protect timers list
-	struct list timers;		// List of active timers
+	struct thread *fpu_owner;	// Thread whose FPU state is loaded
+	struct spinlock timer_lock;	// Lock to protect the timer queues
+	struct timer_wheel timers;	// Wheel of active timers
+	struct hrtimer_queue hrtimers;	// Queue of high resolution timers
+	struct mcs_node mcs_nodes[NR_MCS_NODES];// Nodes for MCS lock waits
+	struct rcu_core rcu;		// RCU callbacks queued on this CORE
+	struct softirq_core softirq;	// Bottom halves pending on this CORE
+	struct work_pool works;		// Worker threads of this CORE
+	struct list free_threads;	// Released threads kept with their stacks
+	size_t nr_free_threads;		// Number of threads in free_threads
+	struct smp_call *volatile calls;// Lock-free stack of calls to run here
 };
 typedef struct core core_t;
 
@@ -355,6 +386,21 @@ static INLINE void x86_write_cr3(uint32_t val)
 	asm volatile("mov %0, %%cr3" :: "r"(val));
 }
 
+/* Read CR4 */
+static INLINE uint32_t x86_read_cr4()
+{
+	uint32_t r;
+
+	asm volatile("mov %%cr4, %0" : "=r"(r));
+	return r;
+}
+
+/* Write CR4 */
+static INLINE void x86_write_cr4(uint32_t val)
+{
+	asm volatile("mov %0, %%cr4" :: "r"(val));
+}
+
 /* Read an MSR */
 static INLINE uint64_t x86_read_msr(uint32_t msr)
 {
@@ -399,7 +445,6 @@ static INLINE struct core *core_get_pointer()
 	uint32_t addr;
 
 	addr = (uint32_t)x86_read_msr(X86_MSR_GS_BASE);
-	ASSERT(addr == (uint32_t)&_boot_core);
 	return (struct core *)addr;
 }
 
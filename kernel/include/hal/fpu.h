@@ -0,0 +1,20 @@
+#ifndef __FPU_H__
+#define __FPU_H__
+
+#include <types.h>
+
+/* Size and alignment of the area used by FXSAVE/FXRSTOR, FSAVE/FRSTOR use
+ * the first 108 bytes of it.
+ */
+#define FPU_STATE_SIZE		512
+#define FPU_STATE_ALIGN		16
+
+struct thread;
+
+extern void fpu_switch(struct thread *prev);
+extern boolean_t fpu_trap();
+extern int fpu_alloc(struct thread *t);
+extern void fpu_free(struct thread *t);
+extern void init_fpu_percore();
+
+#endif	/* __FPU_H__ */
@@ -52,6 +52,7 @@
 #define LAPIC_IPI_DEST_ALL_INCL		0x02	// All, including self
 
 extern void lapic_timer_prepare(useconds_t us);
+extern void lapic_timer_program(uint64_t deadline);
 extern boolean_t lapic_enabled();
 extern uint32_t lapic_id();
 extern void lapic_ipi(uint8_t dest, uint8_t id, uint8_t mode, uint8_t vector);
@@ -3,23 +3,63 @@
 
 #include "atomic.h"
 
+/* Types of spinlock */
+#define SPINLOCK_TAS	0	// Test and set, the default
+#define SPINLOCK_TICKET	1	// Ticket lock, granted in FIFO order
+#define SPINLOCK_MCS	2	// MCS queued lock, each waiter spins locally
+
+/* Number of MCS queue nodes each CORE has for nested acquisitions */
+#define NR_MCS_NODES	8
+
+struct lockstat_class;
+
+/* Queue node of a waiter on an MCS lock */
+struct mcs_node {
+	struct mcs_node *volatile next;	// Next waiter in the queue
+	volatile boolean_t locked;	// Spun on until the lock is passed on
+	boolean_t busy;			// Node is in use by an acquisition
+};
+
 struct spinlock {
+	/* Lock word, its meaning depends on the type:
+	 *   SPINLOCK_TAS    - 1 if the lock is free
+	 *   SPINLOCK_TICKET - next ticket to hand out
+	 *   SPINLOCK_MCS    - tail of the waiter queue, 0 if the lock is free
+	 */
 	atomic_t value;
 
 	/* State of the IRQ */
 	volatile boolean_t state;
 	
 	const char *name;
+
+	int type;			// Type of the lock
+	volatile int32_t ticket;	// Ticket being served
+	struct mcs_node *node;		// MCS queue node of the holder
+
+#ifdef _LOCKSTAT
+	struct lockstat_class *stats;	// Statistics of the locks of this name
+	uint64_t acquire_stamp;		// TSC when the lock was acquired
+#endif	/* _LOCKSTAT */
 };
 typedef struct spinlock spinlock_t;
 
 
 static INLINE boolean_t spinlock_held(struct spinlock *lock)
 {
-	return lock->value != 1;
+	switch (lock->type) {
+	case SPINLOCK_TICKET:
+		return lock->value != lock->ticket;
+	case SPINLOCK_MCS:
+		return lock->value != 0;
+	default:
+		return lock->value != 1;
+	}
 }
 
 extern void spinlock_init(struct spinlock *lock, const char *name);
+extern void spinlock_init_type(struct spinlock *lock, const char *name,
+			       int type);
 extern void spinlock_acquire(struct spinlock *lock);
 extern void spinlock_acquire_noirq(struct spinlock *lock);
 extern void spinlock_release(struct spinlock *lock);
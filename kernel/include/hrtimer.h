@@ -0,0 +1,44 @@
+#ifndef __HRTIMER_H__
+#define __HRTIMER_H__
+
+#include "matrix/matrix.h"
+#include "list.h"
+#include "timer.h"
+
+/* Default slack of a high resolution timer in nanoseconds */
+#define HRTIMER_DEFAULT_SLACK	50000
+
+struct core;
+
+/* High resolution timer. Expire times are absolute TSC values of the CORE
+ * the timer is queued on. The timer may fire at any time between expires and
+ * deadline, this allows timers close to each other to share one interrupt.
+ */
+struct hrtimer {
+	struct list link;		// Link to the hrtimer queue
+	struct core *core;		// CORE whose queue the timer is queued on
+	uint64_t expires;		// Earliest time the timer may fire
+	uint64_t deadline;		// Latest time the timer may fire
+	timer_func_t func;		// Function to call when the timer expires
+	void *ctx;			// Argument to pass to timer handler
+	char name[16];			// Name for the timer
+};
+typedef struct hrtimer hrtimer_t;
+
+/* Per-CORE queue of high resolution timers */
+struct hrtimer_queue {
+	struct list timers;		// Active timers sorted by deadline
+	uint64_t next_tick;		// Time of the next timer wheel tick
+	uint64_t next_event;		// Time the timer hardware is armed for
+};
+typedef struct hrtimer_queue hrtimer_queue_t;
+
+extern void init_hrtimer(struct hrtimer *t, const char *name);
+extern void set_hrtimer(struct hrtimer *t, uint64_t expire_ns, uint64_t slack_ns,
+			timer_func_t callback, void *ctx);
+extern void cancel_hrtimer(struct hrtimer *t);
+extern void hrtimer_interrupt();
+extern void hrtimer_queue_init(struct hrtimer_queue *q);
+extern void init_hrtimer_percore();
+
+#endif	/* __HRTIMER_H__ */
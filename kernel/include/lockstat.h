@@ -0,0 +1,66 @@
+#ifndef __LOCKSTAT_H__
+#define __LOCKSTAT_H__
+
+#include <types.h>
+#include "matrix/matrix.h"
+
+/* Number of buckets of the wait and hold time histograms. Bucket 0 counts
+ * times below 2^LOCKSTAT_HIST_SHIFT cycles, each following bucket covers
+ * twice the range of the previous one and the last one everything above.
+ */
+#define LOCKSTAT_HIST_BUCKETS	16
+#define LOCKSTAT_HIST_SHIFT	6
+
+/* How an acquisition got the lock */
+#define LOCKSTAT_FREE		0	// Lock was free
+#define LOCKSTAT_SPUN		1	// Lock was contended, we spun for it
+#define LOCKSTAT_SLEPT		2	// Lock was contended, we slept for it
+
+/* Statistics of all the locks sharing a name, times are in TSC cycles */
+struct lockstat_class {
+	const char *name;			// Name of the locks
+	uint32_t acquisitions;			// Number of acquisitions
+	uint32_t contended;			// Acquisitions that had to wait
+	uint64_t spin_cycles;			// Time spent spinning
+	uint64_t wait_cycles;			// Time spent waiting, spinning or not
+	uint64_t hold_cycles;			// Time the locks were held
+	uint32_t wait_hist[LOCKSTAT_HIST_BUCKETS];// Histogram of the wait times
+	uint32_t hold_hist[LOCKSTAT_HIST_BUCKETS];// Histogram of the hold times
+};
+
+#ifdef _LOCKSTAT
+
+#include "hal/core.h"
+
+extern void lockstat_acquired(struct lockstat_class **clsp, const char *name,
+			      uint64_t start, uint64_t now, int how);
+extern void lockstat_released(struct lockstat_class *cls, uint64_t stamp);
+extern void lockstat_reset();
+extern void init_lockstat();
+
+/* Record an acquisition of a lock that started waiting at `start' */
+#define LOCKSTAT_NOW()		x86_rdtsc()
+#define LOCKSTAT_ACQUIRED(lock, start, how)				\
+	do {								\
+		(lock)->acquire_stamp = x86_rdtsc();			\
+		lockstat_acquired(&(lock)->stats, (lock)->name, (start),\
+				  (lock)->acquire_stamp, (how));	\
+	} while (0)
+#define LOCKSTAT_RELEASED(lock)						\
+	lockstat_released((lock)->stats, (lock)->acquire_stamp)
+
+#else
+
+/* Compiled out, the hooks cost nothing */
+#define LOCKSTAT_NOW()				0
+#define LOCKSTAT_ACQUIRED(lock, start, how)	((void)(start), (void)(how))
+#define LOCKSTAT_RELEASED(lock)			do { } while (0)
+
+static INLINE void init_lockstat()
+{
+	;
+}
+
+#endif	/* _LOCKSTAT */
+
+#endif	/* __LOCKSTAT_H__ */
@@ -9,14 +9,14 @@
  * +------------+
  * | 0x30000000 | User mode image loaded address
  * +------------+
+ * | 0xBFFFE000 | Read-only pages shared with user mode (matrix/shared.h)
+ * +------------+
  * | 0xC0000000 | Kernel memory pool started address
  * +------------+
  */
 
 /* Our kernel stack size is 8192 bytes */
 #define KSTACK_SIZE		0x2000
-/* Our user stack size is 16384 bytes */
-#define USTACK_SIZE		0x4000
 
 /* Start address of the kernel memory pool */
 #define KERNEL_KMEM_START	0xC0000000
@@ -4,6 +4,7 @@
 #include "hal/spinlock.h"
 #include "atomic.h"
 #include "list.h"
+#include "waitqueue.h"
 
 /* Forward declaration of thread */
 struct thread;
@@ -13,9 +14,19 @@ struct mutex {
 	atomic_t value;		// Lock count
 	int flags;		// Behaviour flags for the mutex
 	struct spinlock lock;	// Lock to protect the thread list
-	struct list threads;	// List of waiting threads
+	struct wait_queue wait;	// Waiting threads, by priority
 	struct thread *owner;	// Owner of the lock
+	struct list held_link;	// Link to the owner's held mutexes
 	const char *name;	// Name of the mutex
+
+	/* Contention statistics, updated by the owner */
+	uint32_t spin_acquires;	// Contended acquisitions won by spinning
+	uint32_t sleep_acquires;// Contended acquisitions that had to sleep
+
+#ifdef _LOCKSTAT
+	struct lockstat_class *stats;	// Statistics of the mutexes of this name
+	uint64_t acquire_stamp;		// TSC when the mutex was acquired
+#endif	/* _LOCKSTAT */
 };
 typedef struct mutex mutex_t;
 
@@ -26,5 +37,6 @@ static INLINE boolean_t mutex_held(struct mutex *m) {
 extern void mutex_acquire(struct mutex *m);
 extern void mutex_release(struct mutex *m);
 extern void mutex_init(struct mutex *m, const char *name, int flags);
+extern void mutex_pi_update(struct thread *t);
 
 #endif	/* __MUTEX_H__ */
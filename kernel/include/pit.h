@@ -8,9 +8,12 @@
 /* Seconds to microseconds */
 #define SECS2USECS(secs)	((useconds_t)secs * 1000000)
 
-extern int get_cmostime(struct tm *t);
+extern boolean_t _tsc_stable;
+extern boolean_t _tsc_synced;
+
 extern useconds_t time_to_unix(uint32_t year, uint32_t mon, uint32_t day,
 			       uint32_t hour, uint32_t min, uint32_t sec);
+extern uint64_t tsc_cycles();
 extern useconds_t sys_time();
 extern void spin(useconds_t us);
 extern void tsc_init_target();
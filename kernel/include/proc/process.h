@@ -5,17 +5,16 @@
 #include "sys/time.h"
 #include "matrix/const.h"
 #include "matrix/matrix.h"
+#include "matrix/process.h"
 #include "list.h"
 #include "rtl/avltree.h"
 #include "rtl/notifier.h"
+#include "rcu.h"
 #include "proc/thread.h"
 #include "fs.h"
 #include "fd.h"			// File descriptors
 #include "ioctx.h"
 
-/* Bottom of the user stack */
-#define USTACK_BOTTOM	0x30000000
-
 /* Forward declaration, used to pass arguments */
 struct process_creation;
 
@@ -31,9 +30,12 @@ struct process {
 	
 	int flags;				// Behaviour flags for the process
 	int8_t priority;			// Current scheduling priority
+	coremask_t affinity;			// COREs new threads may run on
 	char *name;				// Name of the process
 
+	struct spinlock lock;			// Protects the list of threads
 	struct list threads;			// List of threads
+	atomic_t ustack_slots;			// Bitmap of the user stack slots in use
 
 	/* Signal information */
 	sigset_t signal_mask;			// Bitmap of masked signals
@@ -50,6 +52,8 @@ struct process {
 
 	/* Other process information */
 	struct avl_tree_node tree_link;		// Link to the process tree
+	struct list hash_link;			// Link to the pid lookup hash
+	struct rcu_head rcu;			// Deferred free after lookups
 
 	struct notifier death_notifier;		// Notifier list of this process
 
@@ -69,6 +73,7 @@ typedef struct process process_t;
 extern struct process *_kernel_proc;
 
 extern struct process *process_lookup(pid_t pid);
+extern void process_release(struct process *p);
 
 extern void process_attach(struct process *p, struct thread *t);
 extern void process_detach(struct thread *t);
@@ -78,6 +83,9 @@ extern int process_create(const char **args, struct process *parent, int flags,
 			  int priority, struct process **procp);
 extern int process_destroy(struct process *proc);
 
+extern ptr_t process_ustack_alloc(struct process *p);
+extern void process_ustack_free(struct process *p, ptr_t ustack);
+
 extern int process_wait(struct process *p, void *sync);
 extern int process_getid();
 
@@ -1,7 +1,21 @@
 #ifndef __SCHED_H__
 #define __SCHED_H__
 
+#include <sched.h>
+
+/* Effective priorities from this value up belong to real-time threads */
+#define SCHED_RT_PRIORITY_BASE	32
+
 extern void sched_insert_thread(struct thread *t);
+extern void sched_insert_threads(struct thread **threads, size_t count);
+extern coremask_t sched_online_cores();
+extern int sched_set_affinity(struct thread *t, coremask_t mask);
+extern int sched_base_priority(struct thread *t);
+extern void sched_change_priority(struct thread *t, int priority);
+extern int sched_set_policy(struct thread *t, int policy, int priority);
+extern int sched_core_stats(core_id_t id, struct sched_core_stats *stats);
+extern void sched_thread_stats(struct thread *t, struct sched_thread_stats *stats);
+extern void sched_preempt();
 extern void sched_post_switch(boolean_t state);
 extern void sched_reschedule(boolean_t state);
 extern void sched_enter();
@@ -68,4 +68,6 @@ struct sigaction {
 
 struct thread;
 
+extern boolean_t signal_pending(struct thread *t);
+
 #endif	/* __SIGNAL_H__ */
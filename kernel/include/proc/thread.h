@@ -8,18 +8,22 @@
 #include "rtl/avltree.h"
 #include "rtl/notifier.h"
 #include "timer.h"
+#include "hrtimer.h"
+#include "semaphore.h"
+#include "workqueue.h"
 #include "proc/signal.h"
 
 struct process;
+struct mutex;
 
 /* Thread entry definition */
 typedef void (*thread_func_t)(void *);
 
 /* x86-specific thread structure */
 struct arch_thread {
-	void *esp;			// Stack pointer
-	void *ebp;			// Base pointer
-	void *eip;			// Instruction pointer
+	void *esp;			// Saved kernel stack pointer
+	void *fpu;			// FPU save area, allocated with the thread
+	boolean_t fpu_used;		// Thread has used the FPU
 };
 
 /* Thread creation arguments structure, for thread_uspace_wrapper() */
@@ -52,6 +56,8 @@ struct thread {
 	size_t ustack_size;		// Size of the user-mode stack
 	int flags;			// Flags for the thread
 	int priority;			// Priority of the thread
+	int policy;			// Scheduling policy
+	int rt_priority;		// Priority in the real-time policies
 
 	/* Thread entry function */
 	thread_func_t entry;		// Entry function for the thread
@@ -61,11 +67,27 @@ struct thread {
 	struct list runq_link;		// Link to run queues
 	struct core *core;		// CORE that the thread runs on
 	useconds_t quantum;		// Current quantum
+	coremask_t affinity;		// COREs the thread is allowed to run on
+	int eff_priority;		// Effective priority, selects the run queue
+	int rcu_nesting;		// Depth of RCU read-side critical sections
+
+	/* Scheduling statistics, times are in TSC cycles */
+	uint64_t ready_stamp;		// When the thread was last made ready
+	uint64_t run_stamp;		// When the thread last started running
+	uint64_t run_delay;		// Total time spent waiting to run
+	uint64_t run_time;		// Total time spent running
+	uint32_t nr_vol_switches;	// Switches away because the thread blocked
+	uint32_t nr_invol_switches;	// Switches away because it was preempted
 
 	/* Sleeping information */
 	struct spinlock *wait_lock;	// Lock to acquire when perform waiting
 	struct list wait_link;		// Link to a waiting list
-	struct timer sleep_timer;	// Sleep timeout timer
+	int wait_flags;			// Flags of the wait queue wait
+	struct mutex *blocked_on;	// Mutex the thread is waiting for
+	phys_addr_t futex_key;		// Futex the thread is waiting on
+	struct list held_mutexes;	// Mutexes owned by the thread
+	struct hrtimer sleep_timer;	// Sleep timeout timer
+	uint64_t timer_slack;		// Slack of the sleep timer in ns
 	int sleep_status;		// Sleep status (timed out/interrupted)
 
 	/* Reference count for the thread
@@ -87,6 +109,9 @@ struct thread {
 	struct list owner_link;		// Link to the owner process
 
 	struct notifier death_notifier;	// Notifier list of this thread
+	struct semaphore join_sem;	// Upped when the thread exits
+	atomic_t joined;		// Whether a thread is joining this thread
+	struct work reap_work;		// Releases the thread once it is dead
 
 	int status;			// Exit status of the thread
 };
@@ -96,6 +121,7 @@ typedef struct thread thread_t;
 #define THREAD_INTERRUPTIBLE	(1<<0)	// Thread is in an interruptible sleep
 #define THREAD_INTERRUPTED	(1<<1)	// Thread has been interrupted
 #define THREAD_KILLED		(1<<2)	// Thread has been killed
+#define THREAD_MIGRATING	(1<<3)	// Thread is moving to another CORE
 
 /* Macro that expands to a pointer to the current thread */
 #define CURR_THREAD	(CURR_CORE->thread)
@@ -107,11 +133,14 @@ extern int thread_create(const char *name, struct process *owner, int flags,
 			 thread_func_t func, void *args, struct thread **tp);
 extern int thread_sleep(struct spinlock *lock, useconds_t timeout,
 			const char *name, int flags);
+extern struct thread *thread_lookup(tid_t tid);
 extern void thread_run(struct thread *t);
 extern void thread_kill(struct thread *t);
 extern void thread_release(struct thread *t);
 extern void thread_wake(struct thread *t);
+extern void thread_wake_many(struct thread **threads, size_t count);
 extern boolean_t thread_interrupt(struct thread *t);
+extern int thread_join(tid_t tid, int *statusp);
 extern void thread_exit();
 extern void init_thread();
 
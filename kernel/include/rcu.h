@@ -0,0 +1,104 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include "list.h"
+#include "barrier.h"
+
+struct rcu_head;
+
+typedef void (*rcu_func_t)(struct rcu_head *head);
+
+/* Callback to run once all the readers that could see an object are gone,
+ * embedded in the object to be freed.
+ */
+struct rcu_head {
+	struct list link;		// Link to the callback list
+	rcu_func_t func;		// Function to call after a grace period
+};
+typedef struct rcu_head rcu_head_t;
+
+/* Per-CORE RCU state */
+struct rcu_core {
+	struct list next;		// Callbacks not yet waiting for a grace period
+	struct list wait;		// Callbacks waiting for grace period wait_gp
+	uint32_t wait_gp;		// Grace period that ends the wait batch
+};
+
+/**
+ * Mark the start of a read-side critical section. The current thread is not
+ * preempted until the matching rcu_read_unlock(), and must not sleep.
+ */
+#define rcu_read_lock() do { \
+	CURR_THREAD->rcu_nesting++; \
+	enter_cs_barrier(); \
+} while (0)
+
+#define rcu_read_unlock() do { \
+	leave_cs_barrier(); \
+	if (!--CURR_THREAD->rcu_nesting) { \
+		rcu_read_unlock_slow(); \
+	} \
+} while (0)
+
+/* Read a pointer published with rcu_assign_pointer() */
+#define rcu_dereference(p)	(*(typeof(p) volatile *)&(p))
+
+/* Publish a pointer, the pointed to object is initialized before it */
+#define rcu_assign_pointer(p, v) do { \
+	leave_cs_barrier(); \
+	(p) = (v); \
+} while (0)
+
+/* Walk a list that is modified with list_add_rcu/list_del_rcu */
+#define LIST_FOR_EACH_RCU(pos, head) \
+	for (pos = rcu_dereference((head)->next); pos != (head); \
+	     pos = rcu_dereference(pos->next))
+
+/**
+ * Insert a new entry after the specified head, a concurrent reader either
+ * sees the fully linked entry or does not see it at all
+ */
+static INLINE void list_add_rcu(struct list *new, struct list *head)
+{
+	struct list *next = head->next;
+
+	new->next = next;
+	new->prev = head;
+	rcu_assign_pointer(head->next, new);
+	next->prev = new;
+}
+
+/**
+ * Insert a new entry before the specified head, a concurrent reader either
+ * sees the fully linked entry or does not see it at all
+ */
+static INLINE void list_add_tail_rcu(struct list *new, struct list *head)
+{
+	struct list *prev = head->prev;
+
+	new->next = head;
+	new->prev = prev;
+	rcu_assign_pointer(prev->next, new);
+	head->prev = new;
+}
+
+/**
+ * Delete an entry, keeping its next pointer intact for readers that are
+ * still on it. The entry must not be reused before a grace period ends.
+ */
+static INLINE void list_del_rcu(struct list *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->prev = entry;
+}
+
+extern void call_rcu(struct rcu_head *head, rcu_func_t func);
+extern void synchronize_rcu();
+extern void rcu_note_qs();
+extern void rcu_read_unlock_slow();
+extern void rcu_tick();
+extern void rcu_core_init(struct rcu_core *r);
+extern void init_rcu();
+
+#endif	/* __RCU_H__ */
@@ -0,0 +1,61 @@
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+#include "hal/spinlock.h"
+#include "list.h"
+#include "waitqueue.h"
+
+/* Number of per-CORE reader slots of a spinning rwlock, one per CORE that
+ * a coremask_t can address.
+ */
+#define RWSPIN_NR_SLOTS		32
+
+/* Sleeping reader-writer lock. Writers are preferred, once a writer waits
+ * new readers queue up behind it.
+ */
+struct rwlock {
+	struct spinlock lock;		// Lock to protect the lock state
+	int readers;			// Number of readers holding the lock
+	boolean_t writer;		// Whether a writer holds the lock
+	struct wait_queue read_waiters;	// Readers waiting for the lock
+	struct wait_queue write_waiters;// Writers waiting for the lock
+	const char *name;		// Name of the lock
+};
+typedef struct rwlock rwlock_t;
+
+/* Reader count of a CORE, padded to a cache line of its own */
+struct rwspin_slot {
+	atomic_t readers;		// Readers on this CORE
+	boolean_t state;		// IRQ state of the outermost reader
+	uint8_t pad[64 - sizeof(atomic_t) - sizeof(boolean_t)];
+};
+
+/* Spinning reader-writer lock. Readers only touch the slot of their own CORE
+ * so they do not contend with each other, writers are preferred and have to
+ * look at all the slots.
+ */
+struct rwspinlock {
+	struct spinlock wlock;		// Serializes the writers
+	atomic_t writer;		// A writer holds or waits for the lock
+	struct rwspin_slot slots[RWSPIN_NR_SLOTS];
+	const char *name;		// Name of the lock
+};
+typedef struct rwspinlock rwspinlock_t;
+
+static INLINE boolean_t rwlock_write_held(struct rwlock *l) {
+	return l->writer;
+}
+
+extern void rwlock_read_acquire(struct rwlock *l);
+extern void rwlock_read_release(struct rwlock *l);
+extern void rwlock_write_acquire(struct rwlock *l);
+extern void rwlock_write_release(struct rwlock *l);
+extern void rwlock_init(struct rwlock *l, const char *name);
+
+extern void rwspin_read_acquire(struct rwspinlock *l);
+extern void rwspin_read_release(struct rwspinlock *l);
+extern void rwspin_write_acquire(struct rwspinlock *l);
+extern void rwspin_write_release(struct rwspinlock *l);
+extern void rwspin_init(struct rwspinlock *l, const char *name);
+
+#endif	/* __RWLOCK_H__ */
@@ -0,0 +1,60 @@
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include <types.h>
+#include "barrier.h"
+#include "hal/spinlock.h"
+#include "hal/core.h"
+
+/* Sequence lock for data that is read often and written rarely. Readers
+ * take no lock, they retry if a writer got in while they were reading.
+ * Writers are serialized by the spinlock, the sequence is odd while an
+ * update is in progress.
+ */
+struct seqlock {
+	volatile uint32_t seq;		// Bumped before and after each update
+	struct spinlock lock;		// Lock to serialize the writers
+};
+typedef struct seqlock seqlock_t;
+
+static INLINE uint32_t read_seqbegin(struct seqlock *sl)
+{
+	uint32_t seq;
+
+	while ((seq = sl->seq) & 1) {
+		core_spin_hint();
+	}
+	leave_cs_barrier();
+
+	return seq;
+}
+
+/* Evaluates to TRUE if the data read since read_seqbegin() may be torn */
+static INLINE boolean_t read_seqretry(struct seqlock *sl, uint32_t seq)
+{
+	leave_cs_barrier();
+
+	return sl->seq != seq;
+}
+
+static INLINE void write_seqlock(struct seqlock *sl)
+{
+	spinlock_acquire(&sl->lock);
+	sl->seq++;
+	leave_cs_barrier();
+}
+
+static INLINE void write_sequnlock(struct seqlock *sl)
+{
+	leave_cs_barrier();
+	sl->seq++;
+	spinlock_release(&sl->lock);
+}
+
+static INLINE void seqlock_init(struct seqlock *sl, const char *name)
+{
+	sl->seq = 0;
+	spinlock_init(&sl->lock, name);
+}
+
+#endif	/* __SEQLOCK_H__ */
@@ -5,15 +5,24 @@
 
 typedef int (*smp_call_func_t)(void *ctx);
 
+/* Flags for the SMP calls */
+#define SMP_CALL_ASYNC		(1<<0)	// Do not wait for the call to complete
+
 extern volatile uint32_t _smp_boot_status;
 
 /* Values for _smp_boot_status */
 #define SMP_BOOT_INIT		0	// Boot started
 #define SMP_BOOT_ALIVE		1	// AC has reached kmain_ac()
-#define SMP_BOOT_BOOTED		2	// AC has completed kmain_ac()
+#define SMP_BOOT_BOOTED		2	// AC is on the running COREs list
 #define SMP_BOOT_COMPLETE	3	// All ACs have been booted
 
+extern int smp_call_single(core_id_t id, smp_call_func_t func, void *ctx,
+			   int flags);
+extern int smp_call_many(coremask_t mask, smp_call_func_t func, void *ctx,
+			 int flags);
+extern int smp_call_all(smp_call_func_t func, void *ctx, int flags);
 extern void smp_ipi_handler();
+extern void smp_boot_cores();
 extern void init_smp();
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef __SOFTIRQ_H__
+#define __SOFTIRQ_H__
+
+#include <types.h>
+#include "semaphore.h"
+
+/* Bottom halves, a lower number runs first */
+#define SOFTIRQ_TIMER	0	// Timer wheel tick
+#define SOFTIRQ_KBD	1	// Keyboard scan code decoding
+#define SOFTIRQ_BLOCK	2	// Block device completions
+#define NR_SOFTIRQS	3
+
+struct thread;
+
+typedef void (*softirq_func_t)(void);
+
+/* Per-CORE bottom half state */
+struct softirq_core {
+	uint32_t pending;		// Bitmap of the raised softirqs
+	boolean_t active;		// Softirqs are being run on this CORE
+	struct semaphore sem;		// Wakes up the softirq thread
+	struct thread *thread;		// Runs the softirqs left over under load
+};
+typedef struct softirq_core softirq_core_t;
+
+extern void softirq_register(int nr, softirq_func_t func);
+extern void softirq_raise(int nr);
+extern void softirq_run();
+extern void softirq_core_init(struct softirq_core *s);
+extern void init_softirq_percore();
+extern void init_softirq();
+
+#endif	/* __SOFTIRQ_H__ */
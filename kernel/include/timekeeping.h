@@ -0,0 +1,40 @@
+#ifndef __TIMEKEEPING_H__
+#define __TIMEKEEPING_H__
+
+#include <types.h>
+#include "sys/time.h"
+#include "matrix/matrix.h"
+#include "div64.h"
+#include "mm/mmu.h"
+
+#define NSECS_PER_USEC		1000
+#define NSECS_PER_SEC		1000000000
+
+/* Factors to convert a cycle count with a multiply and a shift */
+struct clock_conv {
+	uint32_t mult;			// Multiplier
+	uint32_t shift;			// Right shift applied to the product
+};
+typedef struct clock_conv clock_conv_t;
+
+extern struct clock_conv _tsc_to_ns;
+extern struct clock_conv _tsc_to_us;
+
+extern void clock_conv_init(struct clock_conv *cv, uint32_t from_freq,
+			    uint64_t to_freq);
+
+static INLINE uint64_t clock_conv(struct clock_conv *cv, uint64_t cycles)
+{
+	return mul_u64_u32_shr(cycles, cv->mult, cv->shift);
+}
+
+extern uint64_t ktime_get_ns();
+extern uint64_t ktime_get_real_ns();
+extern void ktime_set_real_ns(uint64_t ns);
+extern int clock_gettime_ns(clockid_t id, uint64_t *ns);
+extern void timekeeping_set_freq(uint64_t freq);
+extern void timekeeping_update();
+extern int timekeeping_map_page(struct mmu_ctx *ctx);
+extern void init_timekeeping();
+
+#endif	/* __TIMEKEEPING_H__ */
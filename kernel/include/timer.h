@@ -6,14 +6,32 @@
 
 #define TIMER_NEVER	(-1)
 
+/* Resolution of the timer wheel, one wheel tick is 1024us */
+#define TIMER_TICK_SHIFT	10
+#define TIMER_TICK_US		(1 << TIMER_TICK_SHIFT)
+
+/* Geometry of the timer wheel. The first level has 256 slots with a
+ * granularity of one tick, each of the upper levels has 64 slots and
+ * every slot covers a whole revolution of the level below it.
+ */
+#define TVR_BITS	8
+#define TVN_BITS	6
+#define TVR_SIZE	(1 << TVR_BITS)
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TVN_LEVELS	3
+
+struct core;
 struct timer;
 
 typedef void (*timer_func_t)(void *ctx);
 
 struct timer {
-	struct list link;		// Link to timers list
-	struct core *core;		// CORE that the timer was started on
+	struct list link;		// Link to timer wheel slot
+	struct core *core;		// CORE whose wheel the timer is queued on
 	useconds_t expire_time;		// Time at which the timer will fire
+	uint32_t expire_tick;		// Wheel tick at which the timer will fire
 	timer_func_t func;		// Function to call when the timer expires
 	int flags;			// Flags for the timer
 	void *ctx;			// Argument to pass to timer handler
@@ -21,14 +39,25 @@ struct timer {
 };
 typedef struct timer timer_t;
 
+/* Per-CORE hierarchical timer wheel */
+struct timer_wheel {
+	uint32_t tick;				// Next wheel tick to be processed
+	size_t nr_timers;			// Number of timers queued on the wheel
+	struct list tv1[TVR_SIZE];		// Timers due in the next 256 ticks
+	struct list tvn[TVN_LEVELS][TVN_SIZE];	// Timers due later, cascaded down
+	struct list expired;			// Expired timers waiting to be run
+};
+typedef struct timer_wheel timer_wheel_t;
+
 /* Flags for timer */
 #define TIMER_SCHED	(1<<0)		// Scheduler timer, reserved for system use
 
 extern void init_timer(struct timer *t, const char *name, int flags);
 extern void set_timer(struct timer *t, useconds_t expire_time,
 		      timer_func_t callback, void *ctx);
-extern void cancel_timer(struct timer *t);
+extern boolean_t cancel_timer(struct timer *t);
 extern void timer_delay(uint32_t us);
 extern void timer_tick();
+extern void timer_wheel_init(struct timer_wheel *w);
 
 #endif	/* __TIMER_H__ */
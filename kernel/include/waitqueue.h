@@ -0,0 +1,67 @@
+#ifndef __WAITQUEUE_H__
+#define __WAITQUEUE_H__
+
+#include <types.h>
+#include "list.h"
+#include "hal/spinlock.h"
+
+struct thread;
+
+/* Queue of threads waiting for an event. The queue is protected by a lock
+ * of the owner's choice, which also protects the state of the event, so
+ * waiters check the state and go to sleep without missing a wake up.
+ */
+struct wait_queue {
+	struct list threads;		// Waiting threads, linked by wait_link
+	int flags;			// Behaviour flags for the queue
+	const char *name;		// Name of the queue
+};
+typedef struct wait_queue wait_queue_t;
+
+/* Flags for wait queue */
+#define WAITQ_PRIORITY		(1<<0)	// Waiters are ordered by priority
+
+/* Flags for a wait */
+#define WAIT_EXCLUSIVE		(1<<0)	// Woken up one at a time
+#define WAIT_INTERRUPTIBLE	(1<<1)	// Sleep can be interrupted
+
+/* Number of exclusive waiters to wake to wake up everybody */
+#define WAKE_ALL		((size_t)-1)
+
+static INLINE boolean_t wait_queue_empty(struct wait_queue *wq) {
+	return LIST_EMPTY(&wq->threads);
+}
+
+/**
+ * Sleep on a wait queue until the condition is true, the timeout is
+ * restarted each time the thread is woken up with the condition still
+ * false. Evaluates to 0 once the condition is true, the lock is released.
+ */
+#define wait_event(wq, lock, cond, timeout, flags) ({ \
+	int __rc = 0; \
+	spinlock_acquire(lock); \
+	while (!(cond)) { \
+		__rc = wait_queue_sleep((wq), (lock), (timeout), (flags)); \
+		if (__rc != 0) { \
+			break; \
+		} \
+		spinlock_acquire(lock); \
+	} \
+	if (!__rc) { \
+		spinlock_release(lock); \
+	} \
+	__rc; \
+})
+
+#define wait_queue_wake_one(wq)	wait_queue_wake((wq), 1)
+#define wait_queue_wake_all(wq)	wait_queue_wake((wq), WAKE_ALL)
+
+extern void wait_queue_add(struct wait_queue *wq, int flags);
+extern int wait_queue_sleep(struct wait_queue *wq, struct spinlock *lock,
+			    useconds_t timeout, int flags);
+extern size_t wait_queue_wake(struct wait_queue *wq, size_t nr);
+extern struct thread *wait_queue_first(struct wait_queue *wq);
+extern void wait_queue_requeue(struct wait_queue *wq, struct thread *t);
+extern void wait_queue_init(struct wait_queue *wq, const char *name, int flags);
+
+#endif	/* __WAITQUEUE_H__ */
@@ -0,0 +1,63 @@
+#ifndef __WORKQUEUE_H__
+#define __WORKQUEUE_H__
+
+#include <types.h>
+#include "list.h"
+#include "atomic.h"
+#include "timer.h"
+#include "semaphore.h"
+#include "hal/spinlock.h"
+
+struct core;
+struct work_pool;
+
+typedef void (*work_func_t)(void *ctx);
+
+/* Deferred work run in thread context, so the function may sleep */
+struct work {
+	struct list link;		// Link to the pending list of a pool
+	struct work_pool *pool;		// Pool the work was last queued on
+	atomic_t pending;		// Work is queued or its timer is armed
+	uint32_t seq;			// Bumped each time the work is queued
+	work_func_t func;		// Function to run
+	void *ctx;			// Argument to pass to the function
+};
+typedef struct work work_t;
+
+/* Work that is queued once a timer expires */
+struct delayed_work {
+	struct work work;		// Work to queue
+	struct timer timer;		// Timer delaying the work
+};
+typedef struct delayed_work delayed_work_t;
+
+/* Per-CORE pool of worker threads */
+struct work_pool {
+	struct spinlock lock;		// Lock to protect the pool
+	struct list works;		// Work waiting for a worker
+	struct list workers;		// Worker threads of the pool
+	struct list flushers;		// Threads waiting for work to complete
+	struct semaphore sem;		// Counts the work waiting for a worker
+	struct semaphore grow_sem;	// Upped to ask the manager for a worker
+	size_t nr_workers;		// Number of worker threads
+	size_t nr_idle;			// Number of workers not running work
+	struct core *core;		// CORE the workers are bound to
+};
+typedef struct work_pool work_pool_t;
+
+extern void init_work(struct work *w, work_func_t func, void *ctx);
+extern void init_delayed_work(struct delayed_work *dw, work_func_t func,
+			      void *ctx);
+extern boolean_t queue_work_on(struct core *c, struct work *w);
+extern boolean_t queue_work(struct work *w);
+extern boolean_t queue_delayed_work(struct delayed_work *dw, useconds_t delay);
+extern void flush_work(struct work *w);
+extern void flush_delayed_work(struct delayed_work *dw);
+extern boolean_t cancel_work(struct work *w);
+extern boolean_t cancel_work_sync(struct work *w);
+extern boolean_t cancel_delayed_work(struct delayed_work *dw);
+extern boolean_t cancel_delayed_work_sync(struct delayed_work *dw);
+extern void work_pool_init(struct work_pool *pool, struct core *c);
+extern void init_workqueue_percore();
+
+#endif	/* __WORKQUEUE_H__ */
@@ -27,12 +27,16 @@
 #include "proc/thread.h"
 #include "terminal.h"
 #include "kd.h"
+#include "lockstat.h"
+#include "softirq.h"
+#include "workqueue.h"
 #include "fs.h"
 #include "module.h"
 #include "platform.h"
 #include "symbol.h"
 #include "kstrdup.h"
 #include "device.h"
+#include "timekeeping.h"
 
 struct boot_module {
 	struct list link;
@@ -70,6 +74,9 @@ int kmain(u_long addr, uint32_t initial_stack)
 	/* Bring up the debug terminal */
 	preinit_terminal();
 
+	/* Register the lock statistics command if they are compiled in */
+	init_lockstat();
+
 	/* Clear the screen */
 	clear_scr();
 
@@ -115,6 +122,9 @@ int kmain(u_long addr, uint32_t initial_stack)
 	init_terminal();
 	kprintf("Terminal initialization... done.\n");
 
+	/* Register the bottom halves before the interrupts raise them */
+	init_softirq();
+
 	/* Properly initialize the CORE and detect other COREs */
 	init_core();
 	kprintf("CORE initialization... done.\n");
@@ -142,13 +152,30 @@ int kmain(u_long addr, uint32_t initial_stack)
 	/* Initialize the scheduler */
 	init_sched_percore();
 	kprintf("Per-CORE scheduler initialization... done.\n");
+
+	init_softirq_percore();
+	kprintf("Per-CORE softirq initialization... done.\n");
+
+	/* Start the worker threads of the boot CORE */
+	init_workqueue_percore();
+	kprintf("Per-CORE workqueue initialization... done.\n");
 	
 	init_sched();
 	kprintf("Scheduler initialization... done.\n");
 
+	init_rcu();
+	kprintf("RCU initialization... done.\n");
+
+	init_timekeeping();
+	kprintf("Timekeeping initialization... done.\n");
+
 	init_syscalls();
 	kprintf("System call initialization... done.\n");
 
+	/* Boot the application COREs now that they can create threads */
+	smp_boot_cores();
+	kprintf("Application CORE boot... done.\n");
+
 	/* Create the initialization process */
 	rc = thread_create("init", NULL, 0, sys_init_thread, NULL, NULL);
 	ASSERT(rc == 0);
@@ -166,16 +193,26 @@ void kmain_ac(struct core *c)
 
 	/* Initialize all the required stuff */
 	preinit_core_percore(c);
+
+	/* The boot CORE can start the next AC now */
+	_smp_boot_status = SMP_BOOT_BOOTED;
+
 	init_mmu_percore();
+	init_core_percore();
 	init_sched_percore();
+	init_softirq_percore();
+	init_workqueue_percore();
 
 	/* Signal that we're up */
-	_smp_boot_status = SMP_BOOT_BOOTED;
+	c->state = CORE_RUNNING;
 
 	/* Wait for remaining COREs to be brought up */
 	while (_smp_boot_status != SMP_BOOT_COMPLETE) {
 		core_spin_hint();
 	}
+
+	/* Start our scheduler */
+	sched_enter();
 }
 
 static void load_boot_module(struct boot_module *mod)
@@ -120,7 +120,7 @@ void page_free(struct page *p)
 		PANIC("free page not allocated");
 	} else {
 		spinlock_acquire(&_pages_lock);
-		clear_frame(frame);
+		clear_frame(frame * PAGE_SIZE);
 		spinlock_release(&_pages_lock);
 		
 		p->frame = 0;
@@ -162,7 +162,7 @@ void init_page()
 	kprintf("page: available physical memory size: %uMB.\n",
 		mem_size / (1024 * 1024));
 
-	spinlock_init(&_pages_lock, "pages-lock");
+	spinlock_init_type(&_pages_lock, "pages-lock", SPINLOCK_MCS);
 
 	/* Calculate how many pages we have in the system */
 	_nr_total_pages = mem_size / PAGE_SIZE;
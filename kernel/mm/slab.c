@@ -8,6 +8,7 @@
 #include "mm/kmem.h"
 #include "mm/malloc.h"
 #include "mm/slab.h"
+#include "rcu.h"
 
 struct slab;
 
@@ -150,7 +151,7 @@ void slab_cache_init(slab_cache_t *cache, const char *name, size_t size,
 	spinlock_init(&cache->lock, "slabs-lock");
 
 	spinlock_acquire(&_slab_caches_lock);
-	list_add(&cache->link, &_slab_caches);
+	list_add_rcu(&cache->link, &_slab_caches);
 	spinlock_release(&_slab_caches_lock);
 
 	DEBUG(DL_DBG, ("cache created %s\n", cache->name));
@@ -183,8 +184,11 @@ void slab_cache_delete(slab_cache_t *cache)
 	}
 
 	spinlock_acquire(&_slab_caches_lock);
-	list_del(&cache->link);
+	list_del_rcu(&cache->link);
 	spinlock_release(&_slab_caches_lock);
+
+	/* Let walkers of the cache list move past it before it is reused */
+	synchronize_rcu();
 }
 
 /* Initialize the slab allocator */
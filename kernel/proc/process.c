@@ -8,6 +8,7 @@
 #include "matrix/matrix.h"
 #include "matrix/const.h"
 #include "matrix/process.h"
+#include "matrix/shared.h"
 #include "hal/hal.h"
 #include "mm/mlayout.h"
 #include "mm/page.h"
@@ -23,6 +24,9 @@
 #include "debug.h"
 #include "elf.h"
 #include "semaphore.h"
+#include "rwlock.h"
+#include "rcu.h"
+#include "timekeeping.h"
 
 struct process_creation {
 	struct semaphore sem;	// Semaphore for synchronize
@@ -46,9 +50,15 @@ static pid_t _next_pid = 1;
 /* Process structure cache */
 static slab_cache_t _proc_cache;
 
-/* Tree of all processes */
+/* Tree of all processes, the writers of the tree also maintain the pid
+ * hash which process_lookup() walks without taking any lock.
+ */
 static struct avl_tree _proc_tree;
-static struct mutex _proc_tree_lock;
+static struct rwlock _proc_tree_lock;
+
+#define PROC_HASH_SIZE		64
+#define PROC_HASH(pid)		((pid) & (PROC_HASH_SIZE - 1))
+static struct list _proc_hash[PROC_HASH_SIZE];
 
 /* kernel process */
 struct process *_kernel_proc = NULL;
@@ -142,6 +152,7 @@ static void process_ctor(void *obj)
 	/* Initialize the signature */
 	p->ref_count = 0;
 
+	spinlock_init(&p->lock, "proc-lock");
 	LIST_INIT(&p->threads);
 
 	/* Initialize the death notifier */
@@ -158,7 +169,10 @@ static void process_dtor(void *obj)
 	DEBUG(DL_DBG, ("process (%p) destructed.\n", obj));
 }
 
-static void process_release(struct process *p)
+/**
+ * Drop a reference to a process, e.g. one taken by process_lookup()
+ */
+void process_release(struct process *p)
 {
 	if (atomic_dec(&p->ref_count) == 0) {
 		process_destroy(p);
@@ -211,8 +225,10 @@ static int process_alloc(const char *name, struct process *parent, struct va_spa
 	p->gid = 500;			// FixMe: set it to the current user's group
 	p->vas = vas;			// Virtual address space
 	p->priority = priority;
+	p->affinity = parent ? parent->affinity : COREMASK_ALL;
 	p->flags = flags;
 	p->status = 0;
+	p->ustack_slots = 1;		// Slot 0 is the stack of the main thread
 	
 	io_init_ctx(&p->ioctx, parent ? &parent->ioctx : NULL);
 	
@@ -240,9 +256,10 @@ static int process_alloc(const char *name, struct process *parent, struct va_spa
 	}
 
 	/* Insert this process into process tree */
-	mutex_acquire(&_proc_tree_lock);
+	rwlock_write_acquire(&_proc_tree_lock);
 	avl_tree_insert_node(&_proc_tree, &p->tree_link, p->id, p);
-	mutex_release(&_proc_tree_lock);
+	list_add_tail_rcu(&p->hash_link, &_proc_hash[PROC_HASH(p->id)]);
+	rwlock_write_release(&_proc_tree_lock);
 
 	p->state = PROCESS_RUNNING;
 	*procp = p;
@@ -259,15 +276,41 @@ out:
 }
 
 /**
- * Lookup a process of the specified pid
+ * Take a reference to a process found without a lock, unless its last
+ * reference is already gone and the process is being destroyed
+ */
+static boolean_t process_refer_live(struct process *p)
+{
+	int32_t ref_count;
+
+	do {
+		ref_count = p->ref_count;
+		if (ref_count < 0) {
+			return FALSE;
+		}
+	} while (!atomic_tas(&p->ref_count, ref_count, ref_count + 1));
+
+	return TRUE;
+}
+
+/**
+ * Lookup a process of the specified pid. The process is returned with a
+ * reference, drop it with process_release().
  */
 struct process *process_lookup(pid_t pid)
 {
-	struct process *proc;
+	struct process *p, *proc = NULL;
+	struct list *l;
 
-	mutex_acquire(&_proc_tree_lock);
-	proc = avl_tree_lookup(&_proc_tree, pid);
-	mutex_release(&_proc_tree_lock);
+	rcu_read_lock();
+	LIST_FOR_EACH_RCU(l, &_proc_hash[PROC_HASH(pid)]) {
+		p = LIST_ENTRY(l, struct process, hash_link);
+		if ((p->id == pid) && process_refer_live(p)) {
+			proc = p;
+			break;
+		}
+	}
+	rcu_read_unlock();
 
 	return proc;
 }
@@ -279,7 +322,10 @@ void process_attach(struct process *p, struct thread *t)
 {
 	t->owner = p;
 	ASSERT(p->state != PROCESS_DEAD);
+	spinlock_acquire(&p->lock);
+	t->affinity = p->affinity;	// Under the lock to see any change
 	list_add_tail(&t->owner_link, &p->threads);
+	spinlock_release(&p->lock);
 	atomic_inc(&p->ref_count);
 }
 
@@ -289,12 +335,16 @@ void process_attach(struct process *p, struct thread *t)
 void process_detach(struct thread *t)
 {
 	struct process *p;
+	boolean_t last;
 
 	p = t->owner;
+	spinlock_acquire(&p->lock);
 	list_del(&t->owner_link);
+	last = LIST_EMPTY(&p->threads);
+	spinlock_release(&p->lock);
 
 	/* Move the process to the dead state if no threads is alive */
-	if (LIST_EMPTY(&p->threads)) {
+	if (last) {
 		ASSERT(p->state != PROCESS_DEAD);
 		p->state = PROCESS_DEAD;
 		process_cleanup(p);
@@ -307,12 +357,81 @@ void process_detach(struct thread *t)
 	process_release(p);
 }
 
+/**
+ * Allocate a stack slot for a new user thread of the process and map the
+ * stack into the address space of the process.
+ * @return		- Base address of the stack, 0 if no stack available.
+ */
+ptr_t process_ustack_alloc(struct process *p)
+{
+	int rc = -1;
+	int32_t slots;
+	int i;
+	ptr_t ustack = 0;
+
+	for (i = 1; i < USTACK_SLOTS; i++) {
+		slots = p->ustack_slots;
+		if (FLAG_ON(slots, (1 << i))) {
+			continue;
+		}
+
+		/* Someone else may have taken the slot in between, try again */
+		if (!atomic_tas(&p->ustack_slots, slots, slots | (1 << i))) {
+			i--;
+			continue;
+		}
+
+		ustack = USTACK_BOTTOM - i * USTACK_SLOT_SIZE;
+		break;
+	}
+
+	if (!ustack) {
+		DEBUG(DL_DBG, ("process(%s:%d) out of stack slots.\n",
+			       p->name, p->id));
+		goto out;
+	}
+
+	rc = va_map(p->vas, ustack, USTACK_SIZE,
+		    VA_MAP_READ|VA_MAP_WRITE|VA_MAP_FIXED, NULL);
+	if (rc != 0) {
+		DEBUG(DL_DBG, ("va_map for ustack failed, err(%x).\n", rc));
+		process_ustack_free(p, ustack);
+		ustack = 0;
+	}
+
+ out:
+	return ustack;
+}
+
+/**
+ * Return the stack slot of a user thread to the process, the stack must
+ * have been unmapped already.
+ */
+void process_ustack_free(struct process *p, ptr_t ustack)
+{
+	int32_t slots;
+	int i;
+
+	i = (USTACK_BOTTOM - ustack) / USTACK_SLOT_SIZE;
+	ASSERT(i < USTACK_SLOTS);
+
+	/* The main thread's slot is never reused */
+	if (i == 0) {
+		return;
+	}
+
+	do {
+		slots = p->ustack_slots;
+	} while (!atomic_tas(&p->ustack_slots, slots, slots & ~(1 << i)));
+}
+
 int process_exit(int status)
 {
 	struct thread *t;
 	struct list *l;
 	size_t n = 0;
 
+	spinlock_acquire(&CURR_PROC->lock);
 	LIST_FOR_EACH(l, &CURR_PROC->threads) {
 		t = LIST_ENTRY(l, struct thread, owner_link);
 		if (t != CURR_THREAD) {
@@ -320,6 +439,7 @@ int process_exit(int status)
 		}
 		n++;
 	}
+	spinlock_release(&CURR_PROC->lock);
 
 	DEBUG(DL_DBG, ("process(%s:%d), thread number(%d).\n", CURR_PROC->name,
 		       CURR_PROC->id, n));
@@ -393,6 +513,19 @@ static int create_aspace(struct process_creation *info)
 		goto out;
 	}
 	
+	/* Map the read-only pages the process reads without system calls */
+	rc = timekeeping_map_page(vas->mmu);
+	if (rc != 0) {
+		DEBUG(DL_DBG, ("map time page failed, err(%x).\n", rc));
+		goto out;
+	}
+	rc = va_map(vas, SHARED_PROC_PAGE, PAGE_SIZE, VA_MAP_READ|VA_MAP_FIXED,
+		    NULL);
+	if (rc != 0) {
+		DEBUG(DL_DBG, ("va_map for process page failed, err(%x).\n", rc));
+		goto out;
+	}
+	
 	info->vas = vas;
 	info->ustack = USTACK_BOTTOM;
 	info->data = data;
@@ -442,6 +575,9 @@ static void process_entry_thread(void *ctx)
 	/* Copy the arguments */
 	copy_process_args(info->argv, info->argc, args);
 
+	/* Fill the process page, it is read-only to user mode only */
+	((struct proc_page *)SHARED_PROC_PAGE)->pid = CURR_PROC->id;
+
 	/* Get the ELF loader to clear BSS and get the entry pointer */
 	entry = elf_finish_binary(info->data);
 
@@ -525,21 +661,34 @@ int process_create(const char **args, struct process *parent, int flags,
 	return rc;
 }
 
+static void process_free_rcu(struct rcu_head *head)
+{
+	struct process *proc;
+
+	proc = LIST_ENTRY(head, struct process, rcu);
+
+	kfree(proc->name);
+	
+	/* Free this process to our process cache */
+	slab_cache_free(&_proc_cache, proc);
+}
+
 int process_destroy(struct process *proc)
 {
 	ASSERT(LIST_EMPTY(&proc->threads));
 	
 	/* Remove this process from the process tree */
-	mutex_acquire(&_proc_tree_lock);
+	rwlock_write_acquire(&_proc_tree_lock);
 	avl_tree_remove_node(&_proc_tree, &proc->tree_link);
-	mutex_release(&_proc_tree_lock);
+	list_del_rcu(&proc->hash_link);
+	rwlock_write_release(&_proc_tree_lock);
 
 	notifier_clear(&proc->death_notifier);
 
-	kfree(proc->name);
-	
-	/* Free this process to our process cache */
-	slab_cache_free(&_proc_cache, proc);
+	/* Lookups may still be walking past the process, free it once they
+	 * are done.
+	 */
+	call_rcu(&proc->rcu, process_free_rcu);
 
 	return 0;
 }
@@ -585,7 +734,7 @@ int process_getid()
  */
 void init_process()
 {
-	int rc = -1;
+	int i, rc = -1;
 	
 	/* Relocate the stack so we know where it is, the stack size is 8KB. Note
 	 * that this was done in the context of kernel mmu.
@@ -598,7 +747,10 @@ void init_process()
 
 	/* Initialize the process avl tree and its lock */
 	avl_tree_init(&_proc_tree);
-	mutex_init(&_proc_tree_lock, "ptree-mutex", 0);
+	rwlock_init(&_proc_tree_lock, "ptree-rwlock");
+	for (i = 0; i < PROC_HASH_SIZE; i++) {
+		LIST_INIT(&_proc_hash[i]);
+	}
 
 	/* Create the kernel process. Note that kernel process doesn't need virtual
 	 * address space.
@@ -622,17 +774,19 @@ void shutdown_process()
 	/* At least kernel process should be alive */
 	ASSERT(!AVL_TREE_EMPTY(&_proc_tree));
 	
-	mutex_acquire(&_proc_tree_lock);
+	rwlock_read_acquire(&_proc_tree_lock);
 	
 	AVL_TREE_FOR_EACH(node, &_proc_tree) {
 		p = AVL_TREE_ENTRY(node, struct process);
 		if (p != _kernel_proc) {
+			spinlock_acquire(&p->lock);
 			LIST_FOR_EACH(l, &p->threads) {
 				t = LIST_ENTRY(l, struct thread, owner_link);
 				thread_kill(t);
 			}
+			spinlock_release(&p->lock);
 		}
 	}
 	
-	mutex_release(&_proc_tree_lock);
+	rwlock_read_release(&_proc_tree_lock);
 }
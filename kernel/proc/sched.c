@@ -7,15 +7,20 @@
 #include "hal/core.h"
 #include "hal/spinlock.h"
 #include "bitops.h"
+#include "div64.h"
 #include "mm/malloc.h"
 #include "mm/mmu.h"
 #include "mm/va.h"
 #include "sys/time.h"
 #include "debug.h"
 #include "timer.h"
+#include "hal/lapic.h"
+#include "mutex.h"
+#include "rcu.h"
 #include "proc/process.h"
 #include "proc/sched.h"
 #include "semaphore.h"
+#include "workqueue.h"
 
 /* Number of priority levels */
 #define NR_PRIORITIES	32
@@ -41,8 +46,16 @@ struct sched_core {
 	struct sched_queue *active;		// Active queue
 	struct sched_queue *expired;		// Expired queue
 	struct sched_queue queues[2];		// Active and expired queues
+	struct sched_queue rt;			// Real-time queue
 	
 	size_t total;				// Total running/ready thread count
+	boolean_t need_resched;			// A higher priority thread is ready
+
+	/* Statistics, times are in TSC cycles */
+	uint64_t run_delay;			// Run delay of the threads picked
+	uint64_t queue_depth_sum;		// Sum of the queue depths at switches
+	uint32_t nr_switches;			// Number of thread switches
+	uint32_t max_queue_depth;		// Deepest queue seen at a switch
 };
 typedef struct sched_core sched_core_t;
 
@@ -50,14 +63,17 @@ typedef struct sched_core sched_core_t;
 static int _nr_running_threads = 0;
 
 /* Dead process queue */
-static struct list _dead_threads = {
-	.prev = &_dead_threads,
-	.next = &_dead_threads
-};
-static struct spinlock _dead_threads_lock;
-static struct semaphore _dead_threads_sem;
 
-/* Allocate a CORE for a thread to run on */
+/* Whether a thread is allowed to run on a CORE */
+#define SCHED_CORE_ALLOWED(t, c)	((t)->affinity & COREMASK_BIT((c)->id))
+
+/* Whether a thread runs with a real-time priority */
+#define SCHED_RT(t)	((t)->eff_priority >= SCHED_RT_PRIORITY_BASE)
+
+/* Run queue of a CORE a thread belongs to */
+#define SCHED_QUEUE(c, t)	(SCHED_RT(t) ? &(c)->rt : (c)->active)
+
+/* Allocate a CORE for a thread to run on, honouring its affinity */
 static struct core *sched_alloc_core(struct thread *t)
 {
 	size_t load, average, total;
@@ -71,6 +87,10 @@ static struct core *sched_alloc_core(struct thread *t)
 		goto out;
 	}
 
+	if (!SCHED_CORE_ALLOWED(t, core)) {
+		core = NULL;
+	}
+
 	/* Add 1 to the total number of threads to account for the thread we
 	 * are adding.
 	 */
@@ -80,6 +100,15 @@ static struct core *sched_alloc_core(struct thread *t)
 
 	LIST_FOR_EACH(l, &_running_cores) {
 		other = LIST_ENTRY(l, struct core, link);
+		if (!SCHED_CORE_ALLOWED(t, other) || !other->sched) {
+			continue;
+		}
+
+		/* Fall back to the first allowed CORE if none is underloaded */
+		if (!core) {
+			core = other;
+		}
+		
 		load = other->sched->total;
 		if (load < average) {
 			core = other;
@@ -87,6 +116,8 @@ static struct core *sched_alloc_core(struct thread *t)
 		}
 	}
 
+	ASSERT(core != NULL);
+
  out:
 	return core;
 }
@@ -94,9 +125,11 @@ static struct core *sched_alloc_core(struct thread *t)
 /**
  * Add `p' to one of the queues of runnable processes. This function is responsible
  * for inserting a process into one of the scheduling queues. `p' must not in the
- * scheduling queues before enqueue.
+ * scheduling queues before enqueue. A preempted real-time thread goes to the
+ * head of its queue so that it resumes first.
  */
-static INLINE void sched_enqueue(struct sched_queue *queue, struct thread *t)
+static INLINE void sched_enqueue(struct sched_queue *queue, struct thread *t,
+				 boolean_t head)
 {
 	int q;
 #ifdef _DEBUG_SCHED
@@ -105,7 +138,7 @@ static INLINE void sched_enqueue(struct sched_queue *queue, struct thread *t)
 #endif	/* _DEBUG_SCHED */
 
 	/* Determine where to insert the process */
-	q = t->priority;
+	q = t->eff_priority % NR_PRIORITIES;
 
 #ifdef _DEBUG_SCHED
 	LIST_FOR_EACH(l, &queue->threads[q]) {
@@ -116,9 +149,13 @@ static INLINE void sched_enqueue(struct sched_queue *queue, struct thread *t)
 	}
 #endif	/* _DEBUG_SCHED */
 	
-	/* Now add the process to the tail of the queue. */
+	/* Now add the process to the queue. */
 	ASSERT((q < NR_PRIORITIES) && (q >= 0));
-	list_add_tail(&t->runq_link, &queue->threads[q]);
+	if (head) {
+		list_add(&t->runq_link, &queue->threads[q]);
+	} else {
+		list_add_tail(&t->runq_link, &queue->threads[q]);
+	}
 	queue->bitmap |= (1 << q);
 }
 
@@ -135,7 +172,7 @@ static INLINE void sched_dequeue(struct sched_queue *queue, struct thread *t)
 	struct list *l;
 #endif	/* _DEBUG_SCHED */
 
-	q = t->priority;
+	q = t->eff_priority % NR_PRIORITIES;
 
 	/* Now make sure that the process is not in its ready queue. Remove the process
 	 * if it was found.
@@ -166,9 +203,31 @@ static void sched_adjust_priority(struct sched_core *c, struct thread *t)
 	;
 }
 
+/**
+ * Ask a CORE to reschedule if a thread just made ready there should preempt
+ * the thread it is running. Only real-time threads preempt this way.
+ */
+static void sched_check_preempt(struct core *c, struct thread *t)
+{
+	struct thread *curr = c->thread;
+
+	if (!SCHED_RT(t) || (curr && (curr->eff_priority >= t->eff_priority) &&
+			     (curr != c->sched->idle_thread))) {
+		return;
+	}
+
+	c->sched->need_resched = TRUE;
+	if (c != CURR_CORE) {
+		lapic_ipi(LAPIC_IPI_DEST_SINGLE, c->id, LAPIC_IPI_FIXED,
+			  LAPIC_VECT_IPI);
+	}
+}
+
 static void sched_timer_func(void *ctx)
 {
+	/* The switch happens on the way out of the interrupt */
 	CURR_THREAD->quantum = 0;
+	CURR_CORE->sched->need_resched = TRUE;
 
 	DEBUG(DL_DBG, ("timer schedule.\n"));
 }
@@ -183,8 +242,15 @@ static struct thread *sched_pick_thread(struct sched_core *c)
 	struct thread *t;
 
 	t = NULL;
-	
-	if (c->active->bitmap) {
+
+	/* Real-time threads always run before the others */
+	if (c->rt.bitmap) {
+		q = bitops_fls(c->rt.bitmap);
+		ASSERT(!LIST_EMPTY(&c->rt.threads[q]));
+		l = c->rt.threads[q].next;
+		t = LIST_ENTRY(l, struct thread, runq_link);
+		sched_dequeue(&c->rt, t);
+	} else if (c->active->bitmap) {
 		q = bitops_fls(c->active->bitmap);
 		ASSERT(!LIST_EMPTY(&c->active->threads[q]));
 		l = c->active->threads[q].next;
@@ -197,6 +263,16 @@ static struct thread *sched_pick_thread(struct sched_core *c)
 	return t;
 }
 
+/* Queue a ready thread on its CORE, the scheduler lock must be held */
+static void sched_insert_locked(struct sched_core *sched, struct thread *t)
+{
+	t->ready_stamp = x86_rdtsc();
+	sched_enqueue(SCHED_QUEUE(sched, t), t, FALSE);
+	sched->total++;
+	atomic_inc(&_nr_running_threads);
+	sched_check_preempt(t->core, t);
+}
+
 void sched_insert_thread(struct thread *t)
 {
 	sched_core_t *sched;
@@ -208,16 +284,88 @@ void sched_insert_thread(struct thread *t)
 	sched = t->core->sched;
 	
 	spinlock_acquire(&sched->lock);
-	
-	sched_enqueue(sched->active, t);
-	sched->total++;
-
+	sched_insert_locked(sched, t);
 	spinlock_release(&sched->lock);
 
 	DEBUG(DL_DBG, ("thread(%s:%d) inserted, total(%d).\n",
 		       t->name, t->id, sched->total));
 }
 
+/**
+ * Insert a batch of ready threads, taking the scheduler lock of each
+ * target CORE once for all the threads going there
+ */
+void sched_insert_threads(struct thread **threads, size_t count)
+{
+	coremask_t done = 0;
+	sched_core_t *sched;
+	struct core *c;
+	size_t i, j;
+
+	for (i = 0; i < count; i++) {
+		ASSERT(threads[i]->state == THREAD_READY);
+		threads[i]->core = sched_alloc_core(threads[i]);
+	}
+
+	for (i = 0; i < count; i++) {
+		c = threads[i]->core;
+		if (done & COREMASK_BIT(c->id)) {
+			continue;
+		}
+		done |= COREMASK_BIT(c->id);
+
+		sched = c->sched;
+		spinlock_acquire(&sched->lock);
+		for (j = i; j < count; j++) {
+			if (threads[j]->core == c) {
+				sched_insert_locked(sched, threads[j]);
+			}
+		}
+		spinlock_release(&sched->lock);
+	}
+}
+
+/**
+ * Account the time the previous thread ran and the time the next thread
+ * waited to run. Must be called with the scheduler lock of the CORE held.
+ */
+static void sched_account(struct sched_core *c, struct thread *prev,
+			  struct thread *next)
+{
+	uint64_t now;
+
+	now = x86_rdtsc();
+
+	/* The stamps may come from another CORE, ignore a skewed TSC */
+	if (now > prev->run_stamp) {
+		prev->run_time += now - prev->run_stamp;
+	}
+	if (prev->state == THREAD_READY) {
+		prev->ready_stamp = now;
+	}
+
+	if (next != prev) {
+		if (prev->state == THREAD_READY) {
+			prev->nr_invol_switches++;
+		} else {
+			prev->nr_vol_switches++;
+		}
+
+		if ((next != c->idle_thread) && (now > next->ready_stamp)) {
+			next->run_delay += now - next->ready_stamp;
+			c->run_delay += now - next->ready_stamp;
+		}
+
+		c->nr_switches++;
+		c->queue_depth_sum += c->total;
+		if (c->total > c->max_queue_depth) {
+			c->max_queue_depth = c->total;
+		}
+	}
+
+	next->run_stamp = now;
+}
+
 /**
  * Picks a new thread to run and switches to it. Interrupts must be disable.
  * @param state		- Previous interrupt state
@@ -233,8 +381,23 @@ void sched_reschedule(boolean_t state)
 	/* Get current schedule CORE */
 	c = CURR_CORE->sched;
 
+	/* A thread in an RCU read-side critical section is not preempted, it
+	 * reschedules when it leaves the section.
+	 */
+	if ((CURR_THREAD->state == THREAD_RUNNING) && CURR_THREAD->rcu_nesting) {
+		c->need_resched = TRUE;
+		spinlock_release_noirq(&CURR_THREAD->lock);
+		local_irq_restore(state);
+		return;
+	}
+
+	/* Switching away is a quiescent state for RCU */
+	ASSERT(!CURR_THREAD->rcu_nesting);
+	rcu_note_qs();
+
 	/* Lock current CORE for operating on scheduler queues */
 	spinlock_acquire_noirq(&c->lock);
+	c->need_resched = FALSE;
 
 	/* Thread cannot be in ready state if we are running it now */
 	ASSERT(CURR_THREAD->state != THREAD_READY);
@@ -245,12 +408,29 @@ void sched_reschedule(boolean_t state)
 	}
 
 	/* Enqueue and dequeue the current process to update the thread queue */
-	if (CURR_THREAD->state == THREAD_RUNNING) {
-		/* The thread hasn't gone to sleep, re-queue it */
+	if ((CURR_THREAD->state == THREAD_RUNNING) &&
+	    (CURR_THREAD == c->idle_thread ||
+	     SCHED_CORE_ALLOWED(CURR_THREAD, CURR_CORE))) {
+		/* The thread hasn't gone to sleep, re-queue it. A real-time
+		 * thread that was preempted before its time slice ran out
+		 * stays at the head of its queue.
+		 */
 		CURR_THREAD->state = THREAD_READY;
 		if (CURR_THREAD != c->idle_thread) {
-			sched_enqueue(c->active, CURR_THREAD);
+			sched_enqueue(SCHED_QUEUE(c, CURR_THREAD), CURR_THREAD,
+				      SCHED_RT(CURR_THREAD) &&
+				      ((CURR_THREAD->policy == SCHED_FIFO) ||
+				       (CURR_THREAD->quantum > 0)));
 		}
+	} else if (CURR_THREAD->state == THREAD_RUNNING) {
+		/* The affinity of the thread no longer allows this CORE. It
+		 * can only be queued on another CORE once we have switched
+		 * off its stack, sched_post_switch() will do that.
+		 */
+		CURR_THREAD->state = THREAD_READY;
+		SET_FLAG(CURR_THREAD->flags, THREAD_MIGRATING);
+		c->total--;
+		atomic_dec(&_nr_running_threads);
 	} else {
 		/* The thread has gone sleep or dead */
 		DEBUG(DL_DBG, ("thread(%s:%s:%d) with state(%d).\n",
@@ -266,7 +446,12 @@ void sched_reschedule(boolean_t state)
 	 */
 	next = sched_pick_thread(c);
 	if (next) {
-		next->quantum = THREAD_QUANTUM;
+		/* A FIFO thread runs until it blocks or is preempted */
+		if (next->policy == SCHED_FIFO) {
+			next->quantum = 0;
+		} else {
+			next->quantum = THREAD_QUANTUM;
+		}
 	} else {
 		next = c->idle_thread;
 		if (next != CURR_THREAD) {
@@ -279,6 +464,8 @@ void sched_reschedule(boolean_t state)
 
 	ASSERT(next->core == CURR_CORE);
 
+	sched_account(c, CURR_THREAD, next);
+
 	/* Move the next thread to running state and set it as the current */
 	c->prev_thread = CURR_THREAD;
 	next->state = THREAD_RUNNING;
@@ -291,6 +478,8 @@ void sched_reschedule(boolean_t state)
 	if (CURR_THREAD->quantum > 0) {
 		set_timer(&c->timer, CURR_THREAD->quantum, sched_timer_func,
 			  CURR_THREAD);
+	} else {
+		cancel_timer(&c->timer);
 	}
 	
 	/* Perform the thread switch if current thread is not the same as
@@ -322,6 +511,17 @@ void sched_reschedule(boolean_t state)
 	}
 }
 
+/* Drop the last reference of a dead thread, runs in a worker */
+static void sched_reap_thread(void *ctx)
+{
+	struct thread *t;
+
+	t = (struct thread *)ctx;
+
+	DEBUG(DL_INF, ("release thread(%s:%d).\n", t->name, t->id));
+	thread_release(t);
+}
+
 void sched_post_switch(boolean_t state)
 {
 	struct thread *t;
@@ -332,6 +532,15 @@ void sched_post_switch(boolean_t state)
 	t = CURR_CORE->sched->prev_thread;
 	if (t) {
 
+		/* Move a thread that is not allowed on this CORE any more.
+		 * We are off its stack now, so it is safe to queue it on
+		 * another CORE.
+		 */
+		if (FLAG_ON(t->flags, THREAD_MIGRATING)) {
+			CLEAR_FLAG(t->flags, THREAD_MIGRATING);
+			sched_insert_thread(t);
+		}
+
 		/* Release the previous thread. We have performed switch if
 		 * prev_thread is not NULL
 		 */
@@ -339,46 +548,272 @@ void sched_post_switch(boolean_t state)
 		
 		/* Deal with thread terminations. We cannot delete the thread
 		 * directly as all alloctor functions are unsafe to call here.
-		 * Instead we queue the thread to the reaper's queue.
+		 * Instead we leave it to a worker of this CORE.
 		 */
 		if (t->state == THREAD_DEAD) {
-			spinlock_acquire(&_dead_threads_lock);
-			list_add_tail(&t->runq_link, &_dead_threads);
-			spinlock_release(&_dead_threads_lock);
-			
-			DEBUG(DL_DBG, ("thread(%s:%d) -> dead threads list.\n",
+			DEBUG(DL_DBG, ("thread(%s:%d) -> reap work.\n",
 				       t->name, t->id));
-			semaphore_up(&_dead_threads_sem, 1);
+			init_work(&t->reap_work, sched_reap_thread, t);
+			queue_work(&t->reap_work);
 		}
 	}
 
 	local_irq_restore(state);
 }
 
-static void sched_reaper_thread(void *ctx)
+/**
+ * Get the mask of the COREs that are running the scheduler
+ */
+coremask_t sched_online_cores()
 {
-	/* Reap the dead threads */
+	struct core *c;
 	struct list *l;
-	struct thread *t;
+	coremask_t mask = 0;
 
-	/* If this is the first time reaper run, you should enable IRQ first */
-	while (TRUE) {
-		/* Wait for dead threads to be added to the list */
-		semaphore_down(&_dead_threads_sem);
+	LIST_FOR_EACH(l, &_running_cores) {
+		c = LIST_ENTRY(l, struct core, link);
+		if (c->sched) {
+			mask |= COREMASK_BIT(c->id);
+		}
+	}
 
-		spinlock_acquire(&_dead_threads_lock);
+	return mask;
+}
 
-		ASSERT(!LIST_EMPTY(&_dead_threads));
-		
-		l = _dead_threads.next;
-		list_del(l);
+/**
+ * Change the COREs a thread is allowed to run on. A ready thread queued on
+ * a CORE that is no longer allowed is moved right away, a running one is
+ * moved the next time it is rescheduled.
+ */
+int sched_set_affinity(struct thread *t, coremask_t mask)
+{
+	int rc = -1;
+	struct sched_core *sched;
+	struct core *c;
 
-		spinlock_release(&_dead_threads_lock);
+	if (!(mask & sched_online_cores())) {
+		DEBUG(DL_DBG, ("no online CORE in mask(0x%x).\n", mask));
+		goto out;
+	}
 
-		t = LIST_ENTRY(l, struct thread, runq_link);
-		
-		DEBUG(DL_INF, ("release thread(%s:%d).\n", t->name, t->id));
-		thread_release(t);
+	spinlock_acquire(&t->lock);
+
+	t->affinity = mask;
+
+	c = t->core;
+	if ((t->state == THREAD_READY) && c && !SCHED_CORE_ALLOWED(t, c)) {
+		sched = c->sched;
+		spinlock_acquire(&sched->lock);
+
+		/* The thread could have been picked by its CORE in the
+		 * meantime, check again with the queue locked.
+		 */
+		if ((t->state == THREAD_READY) && (t->core == c) &&
+		    !FLAG_ON(t->flags, THREAD_MIGRATING)) {
+			sched_dequeue(SCHED_QUEUE(sched, t), t);
+			sched->total--;
+			atomic_dec(&_nr_running_threads);
+			spinlock_release(&sched->lock);
+			sched_insert_thread(t);
+		} else {
+			spinlock_release(&sched->lock);
+		}
+	}
+
+	spinlock_release(&t->lock);
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+/**
+ * Get the priority of a thread before any inheritance
+ */
+int sched_base_priority(struct thread *t)
+{
+	if (t->policy == SCHED_OTHER) {
+		return t->priority;
+	}
+
+	return SCHED_RT_PRIORITY_BASE + t->rt_priority;
+}
+
+/**
+ * Change the effective priority of a thread. A ready thread is moved to the
+ * queue of its new priority. Must be called with the thread's lock held.
+ */
+void sched_change_priority(struct thread *t, int priority)
+{
+	struct sched_core *sched;
+	struct core *c;
+
+	ASSERT(spinlock_held(&t->lock));
+	ASSERT((priority >= 0) &&
+	       (priority < SCHED_RT_PRIORITY_BASE + NR_PRIORITIES));
+
+	c = t->core;
+	if ((t->state != THREAD_READY) || !c ||
+	    FLAG_ON(t->flags, THREAD_MIGRATING)) {
+		/* Let the CORE pick a thread that may now be more important */
+		if ((t == CURR_THREAD) && (priority < t->eff_priority)) {
+			CURR_CORE->sched->need_resched = TRUE;
+		}
+
+		t->eff_priority = priority;
+		goto out;
+	}
+
+	sched = c->sched;
+	spinlock_acquire(&sched->lock);
+
+	/* The thread could have been picked by its CORE in the meantime */
+	if ((t->state == THREAD_READY) && (t->core == c)) {
+		sched_dequeue(SCHED_QUEUE(sched, t), t);
+		t->eff_priority = priority;
+		sched_enqueue(SCHED_QUEUE(sched, t), t, FALSE);
+		sched_check_preempt(c, t);
+	} else {
+		t->eff_priority = priority;
+	}
+
+	spinlock_release(&sched->lock);
+
+ out:
+	return;
+}
+
+/**
+ * Set the scheduling policy and the priority within the policy of a thread
+ */
+int sched_set_policy(struct thread *t, int policy, int priority)
+{
+	int rc = -1;
+
+	if ((policy != SCHED_OTHER) && (policy != SCHED_FIFO) &&
+	    (policy != SCHED_RR)) {
+		goto out;
+	}
+
+	if ((priority < SCHED_PRIORITY_MIN) || (priority > SCHED_PRIORITY_MAX)) {
+		goto out;
+	}
+
+	spinlock_acquire(&t->lock);
+	t->policy = policy;
+	if (policy == SCHED_OTHER) {
+		t->priority = priority;
+		t->rt_priority = 0;
+	} else {
+		t->rt_priority = priority;
+	}
+	spinlock_release(&t->lock);
+
+	/* Work out the new effective priority, taking the mutexes the thread
+	 * holds and waits for into account.
+	 */
+	mutex_pi_update(t);
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+/* Convert TSC cycles counted on a CORE to microseconds */
+static uint64_t sched_cycles_to_us(struct core *c, uint64_t cycles)
+{
+	do_div(cycles, c->arch.cycles_per_us);
+	return cycles;
+}
+
+/**
+ * Get the scheduler statistics of a CORE
+ */
+int sched_core_stats(core_id_t id, struct sched_core_stats *stats)
+{
+	int rc = -1;
+	struct sched_core *sched;
+	struct thread *idle;
+	struct core *c;
+	uint64_t avg, idle_time, now;
+
+	if ((id > _highest_core_id) || !_cores[id] || !_cores[id]->sched) {
+		DEBUG(DL_DBG, ("core(%d) not running the scheduler.\n", id));
+		goto out;
+	}
+
+	c = _cores[id];
+	sched = c->sched;
+	idle = sched->idle_thread;
+
+	spinlock_acquire(&sched->lock);
+
+	/* Count the idle stint in progress, the TSC may be skewed if read remotely */
+	idle_time = idle->run_time;
+	if (c->thread == idle) {
+		now = x86_rdtsc();
+		if (now > idle->run_stamp) {
+			idle_time += now - idle->run_stamp;
+		}
+	}
+	stats->idle_time = sched_cycles_to_us(c, idle_time);
+	stats->run_delay = sched_cycles_to_us(c, sched->run_delay);
+	stats->nr_switches = sched->nr_switches;
+	stats->nr_running = sched->total;
+	stats->max_queue_depth = sched->max_queue_depth;
+	avg = sched->queue_depth_sum;
+	if (sched->nr_switches) {
+		do_div(avg, sched->nr_switches);
+	}
+	stats->avg_queue_depth = (uint32_t)avg;
+
+	spinlock_release(&sched->lock);
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+/**
+ * Get the scheduler statistics of a thread
+ */
+void sched_thread_stats(struct thread *t, struct sched_thread_stats *stats)
+{
+	struct core *c;
+
+	spinlock_acquire(&t->lock);
+
+	c = t->core ? t->core : CURR_CORE;
+	stats->run_delay = sched_cycles_to_us(c, t->run_delay);
+	stats->run_time = sched_cycles_to_us(c, t->run_time);
+	stats->nr_vol_switches = t->nr_vol_switches;
+	stats->nr_invol_switches = t->nr_invol_switches;
+	stats->core = c->id;
+
+	spinlock_release(&t->lock);
+}
+
+/**
+ * Reschedule if a higher priority thread became ready for this CORE. Called
+ * on the way out of interrupts and system calls, and at points where no
+ * spinlock is held.
+ */
+void sched_preempt()
+{
+	struct sched_core *c;
+	boolean_t state;
+
+	state = local_irq_disable();
+
+	/* Softirqs run on the stack of the interrupted thread, the switch
+	 * waits until they are done.
+	 */
+	c = CURR_CORE->sched;
+	if (c && c->need_resched && CURR_THREAD && !CURR_CORE->softirq.active) {
+		spinlock_acquire_noirq(&CURR_THREAD->lock);
+		sched_reschedule(state);
+	} else {
+		local_irq_restore(state);
 	}
 }
 
@@ -406,9 +841,14 @@ void init_sched_percore()
 	CURR_CORE->sched = kmalloc(sizeof(struct sched_core), 0);
 	ASSERT(CURR_CORE->sched != NULL);
 
-	spinlock_init(&CURR_CORE->sched->lock, "sched-lock");
+	spinlock_init_type(&CURR_CORE->sched->lock, "sched-lock",
+			   SPINLOCK_TICKET);
 	
 	CURR_CORE->sched->total = 0;
+	CURR_CORE->sched->run_delay = 0;
+	CURR_CORE->sched->queue_depth_sum = 0;
+	CURR_CORE->sched->nr_switches = 0;
+	CURR_CORE->sched->max_queue_depth = 0;
 	CURR_CORE->sched->active = &CURR_CORE->sched->queues[0];
 	CURR_CORE->sched->expired = &CURR_CORE->sched->queues[1];
 
@@ -422,7 +862,9 @@ void init_sched_percore()
 
 	/* Set the idle thread as the current thread */
 	CURR_CORE->sched->idle_thread->core = CURR_CORE;
+	CURR_CORE->sched->idle_thread->affinity = COREMASK_BIT(CURR_CORE->id);
 	CURR_CORE->sched->idle_thread->state = THREAD_RUNNING;
+	CURR_CORE->sched->idle_thread->run_stamp = x86_rdtsc();
 	CURR_CORE->sched->prev_thread = NULL;
 	CURR_CORE->thread = CURR_CORE->sched->idle_thread;
 	
@@ -436,20 +878,15 @@ void init_sched_percore()
 			LIST_INIT(&CURR_CORE->sched->queues[i].threads[j]);
 		}
 	}
+	CURR_CORE->sched->rt.bitmap = 0;
+	for (j = 0; j < NR_PRIORITIES; j++) {
+		LIST_INIT(&CURR_CORE->sched->rt.threads[j]);
+	}
+	CURR_CORE->sched->need_resched = FALSE;
 }
 
 void init_sched()
 {
-	int rc = -1;
-
-	semaphore_init(&_dead_threads_sem, "dead-t-sem", 0);
-
-	spinlock_init(&_dead_threads_lock, "dead-t-lock");
-
-	/* Create kernel mode reaper thread for the whole system */
-	rc = thread_create("reaper", NULL, 0, sched_reaper_thread, NULL, NULL);
-	ASSERT(rc == 0);
-
 	DEBUG(DL_DBG, ("sched queues initialization done.\n"));
 }
 
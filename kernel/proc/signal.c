@@ -75,6 +75,13 @@ void signal_send(struct thread *t, int num, struct siginfo *info, boolean_t forc
 	thread_interrupt(t);
 }
 
+/* A signal that is not blocked is pending for the thread */
+boolean_t signal_pending(struct thread *t)
+{
+	return (t->pending_signals &
+		~(t->signal_mask | t->owner->signal_mask)) != 0;
+}
+
 void signal_handle_pending()
 {
 	int i, rc;
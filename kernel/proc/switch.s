@@ -1,12 +1,33 @@
 ;
 ; process.s
 ; 
-[GLOBAL read_eip]
-read_eip:			; When read_eip is called, the current instruction location
-				; is pushed on to the stack, we pop it to EAX and return.
-	pop eax			; Get the instruction pointer
-	jmp eax			; Return. Can't use RET because return
-				; address popped off the stack
+; void switch_to(void **prev_esp, void *next_esp)
+;   Saves the callee-saved registers on the current stack, stores the stack
+;   pointer to prev_esp (if not NULL) and resumes the thread whose stack is
+;   next_esp. The new thread returns from its own call to switch_to, or for a
+;   new thread, into the entry function set up by arch_thread_init().
+[GLOBAL switch_to]
+switch_to:
+	mov eax, [esp+4]	; Where to save the current stack pointer
+	mov edx, [esp+8]	; Stack pointer of the thread to switch to
+
+	push ebp		; According to __cdecl, we must preserve EBP, EBX,
+	push ebx		; ESI and EDI, EAX, ECX and EDX are scratch
+	push esi
+	push edi
+
+	test eax, eax		; No previous thread to save on the first switch
+	jz .switch
+	mov [eax], esp		; Save the current stack pointer
+
+.switch:
+	mov esp, edx		; Switch to the new stack
+
+	pop edi			; Restore the registers of the new thread
+	pop esi
+	pop ebx
+	pop ebp
+	ret			; Return into the new thread
 
 [GLOBAL page_copy]
 page_copy:
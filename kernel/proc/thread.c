@@ -4,14 +4,19 @@
 #include "matrix/matrix.h"
 #include "debug.h"
 #include "hal/core.h"
+#include "hal/fpu.h"
 #include "mm/mlayout.h"
 #include "mm/kmem.h"
 #include "mm/malloc.h"
 #include "mm/slab.h"
 #include "mm/va.h"
+#include "mm/mmu.h"
+#include "mm/page.h"
 #include "proc/thread.h"
 #include "proc/process.h"
 #include "proc/sched.h"
+#include "rwlock.h"
+#include "smp.h"
 
 /* Temporarily used thread id */
 static tid_t _next_tid = 1;
@@ -19,7 +24,14 @@ static tid_t _next_tid = 1;
 /* Thread structure cache */
 static slab_cache_t _thread_cache;
 
-extern uint32_t read_eip();
+/* Released threads each CORE keeps around with their kernel stacks */
+#define THREAD_CACHE_MAX	16
+
+/* Tree of all threads */
+static struct avl_tree _thread_tree;
+static struct rwspinlock _thread_tree_lock;
+
+extern void switch_to(void **prev_esp, void *next_esp);
 
 static tid_t id_alloc()
 {
@@ -28,74 +40,41 @@ static tid_t id_alloc()
 
 void arch_thread_init(struct thread *t, void *kstack, void (*entry)())
 {
-	t->arch.esp = kstack;
-	t->arch.ebp = 0;
-	t->arch.eip = entry;
+	uint32_t *sp = kstack;
+
+	/* Build the frame switch_to() expects to find on the stack of a thread
+	 * it switches to: the callee-saved registers and the return address.
+	 * A fake return address is placed above the entry function's frame.
+	 */
+	*--sp = 0;			// Return address of the entry function
+	*--sp = (uint32_t)entry;	// Return address of switch_to()
+	*--sp = 0;			// EBP
+	*--sp = 0;			// EBX
+	*--sp = 0;			// ESI
+	*--sp = 0;			// EDI
+
+	t->arch.esp = sp;
+	t->arch.fpu_used = FALSE;
 }
 
 void arch_thread_switch(struct thread *curr, struct thread *prev)
 {
-	void *esp, *ebp, *eip;
-
-	/* Get the stack pointer and base pointer first */
-	asm volatile("mov %%esp, %0" : "=r"(esp));
-	asm volatile("mov %%ebp, %0" : "=r"(ebp));
-
-	/* Read the instruction pointer. We do some cunning logic here:
-	 * One of the two things could have happened when this function exits
-	 *   (a) We called the function and it returned the EIP as requested.
-	 *   (b) We have just switched processes, and because the saved EIP is
-	 *       essentially the instruction after read_eip(), it will seem as
-	 *       if read_eip has just returned.
-	 * In the second case we need to return immediately. To detect it we put
-	 * a magic number in EAX further down at the end of this function. As C
-	 * returns value in EAX, it will look like the return value is this
-	 * magic number. (0x87654321).
-	 */
-	eip = (void *)read_eip();
-	
-	/* If we have just switched processes, do nothing */
-	if (0x87654321 == (uint32_t)eip) {
-		return;
-	}
-
-	/* Save the process context for previous process */
-	if (prev) {
-		prev->arch.eip = eip;
-		prev->arch.esp = esp;
-		prev->arch.ebp = ebp;
-	}
-
-	/* Switch to current process context */
-	eip = curr->arch.eip;
-	esp = curr->arch.esp;
-	ebp = curr->arch.ebp;
-
 	/* Switch the kernel stack in TSS to the process's kernel stack */
 	set_kernel_stack(curr->kstack);
 
+	/* Save the FPU state of the previous thread if it used the FPU */
+	fpu_switch(prev);
+
 #ifdef _DEBUG_THREAD
-	DEBUG(DL_DBG, ("prev(%s:%x:%x:%x), curr(%s:%x:%x:%x)\n",
-		       prev->name, prev->arch.eip, prev->arch.esp, prev->arch.ebp,
-		       curr->name, curr->arch.eip, curr->arch.esp, curr->arch.ebp));
+	DEBUG(DL_DBG, ("prev(%s:%p), curr(%s:%p)\n",
+		       prev ? prev->name : "none", prev ? prev->arch.esp : NULL,
+		       curr->name, curr->arch.esp));
 #endif	/* _DEBUG_THREAD */
 
-	/* Here we:
-	 * [1] Temporarily puts the new EIP location in EBX.
-	 * [2] Loads the stack and base pointers from the new process struct.
-	 * [3] Puts a magic number (0x87654321) in EAX so that above we can recognize
-	 *     that we've just switched process.
-	 * [4] Jumps to the location in EBX (remember we put the new EIP in there)
-	 * Note that you can't change the sequence we set each register here. You
-	 * can check the actual asm code generated by your compiler for the reason.
+	/* Save the context of the previous thread and resume the current one.
+	 * We return from here when the previous thread is switched back to.
 	 */
-	asm volatile ("mov %0, %%ebx\n"
-		      "mov %1, %%esp\n"
-		      "mov %2, %%ebp\n"
-		      "mov $0x87654321, %%eax\n"	/* read_eip() will return 0x87654321 */
-		      "jmp *%%ebx\n"
-		      :: "r"(eip), "r"(esp), "r"(ebp)
-		      : "%ebx", "%esp", "%eax");
+	switch_to(prev ? &prev->arch.esp : NULL, curr->arch.esp);
 }
 
 /**
@@ -139,6 +118,30 @@ void arch_thread_enter_uspace(ptr_t entry, ptr_t ustack, ptr_t ctx)
 		     :: "m"(entry), "r"(ustack) : "%ax", "%esp", "%eax");
 }
 
+/**
+ * Kernel entry of a thread created for user mode. The argument for the user
+ * entry is put on the top of the user stack below a null return address, so
+ * the entry is called like a normal C function which must never return.
+ */
+void thread_uspace_wrapper(void *ctx)
+{
+	struct thread_uspace_creation *info;
+	ptr_t entry, ustack, args;
+
+	info = (struct thread_uspace_creation *)ctx;
+	entry = info->entry;
+	ustack = info->esp;
+	args = info->args;
+	kfree(info);
+
+	ustack -= sizeof(ptr_t);
+	*((ptr_t *)ustack) = args;
+
+	arch_thread_enter_uspace(entry, ustack, 0);
+
+	PANIC("Failed to enter user space");
+}
+
 /* Thread kernel entry function wrapper */
 static void thread_wrapper()
 {
@@ -156,6 +159,100 @@ static void thread_wrapper()
 	thread_exit();
 }
 
+/* Drop the translation of a kernel page from the TLB of the current CORE */
+static int kstack_flush_tlb(void *ctx)
+{
+	x86_invlpg((ptr_t)ctx);
+	return 0;
+}
+
+/**
+ * Allocate a kernel stack with an unmapped guard page below it, so that an
+ * overflow faults instead of corrupting the memory below the stack.
+ * @return		- Pointer to the top of the stack
+ */
+static void *kstack_alloc()
+{
+	void *base;
+	struct page *p;
+
+	base = kmalloc(KSTACK_SIZE + PAGE_SIZE, MM_ALIGN);
+	if (!base) {
+		return NULL;
+	}
+
+	/* The kernel page tables are shared, so every CORE may have the guard
+	 * page cached. Flush it everywhere before its frame gets reused.
+	 */
+	p = mmu_get_page(&_kernel_mmu_ctx, (ptr_t)base, FALSE, 0);
+	ASSERT(p != NULL);
+	page_free(p);
+	smp_call_all(kstack_flush_tlb, base, 0);
+
+	return (void *)((ptr_t)base + PAGE_SIZE + KSTACK_SIZE);
+}
+
+static void kstack_free(void *kstack)
+{
+	void *base;
+	struct page *p;
+
+	base = (void *)((ptr_t)kstack - KSTACK_SIZE - PAGE_SIZE);
+
+	/* Back the guard page again before the pool reuses it */
+	p = mmu_get_page(&_kernel_mmu_ctx, (ptr_t)base, FALSE, 0);
+	ASSERT(p != NULL);
+	page_alloc(p, 0);
+	smp_call_all(kstack_flush_tlb, base, 0);
+
+	kfree(base);
+}
+
+/* Take a released thread with its kernel stack from the current CORE */
+static struct thread *thread_cache_get()
+{
+	boolean_t state;
+	struct thread *t = NULL;
+	struct core *c;
+
+	state = local_irq_disable();
+
+	c = CURR_CORE;
+	if (c->nr_free_threads) {
+		t = LIST_ENTRY(c->free_threads.next, struct thread, runq_link);
+		list_del(&t->runq_link);
+		c->nr_free_threads--;
+	}
+
+	local_irq_restore(state);
+
+	return t;
+}
+
+/**
+ * Keep a released thread with its kernel stack on the current CORE
+ * @return		- FALSE if the cache of the CORE is full
+ */
+static boolean_t thread_cache_put(struct thread *t)
+{
+	boolean_t state;
+	boolean_t ret = FALSE;
+	struct core *c;
+
+	state = local_irq_disable();
+
+	c = CURR_CORE;
+	if (c->nr_free_threads < THREAD_CACHE_MAX) {
+		list_add(&t->runq_link, &c->free_threads);
+		c->nr_free_threads++;
+		ret = TRUE;
+	}
+
+	local_irq_restore(state);
+
+	return ret;
+}
+
 static void thread_ctor(void *obj)
 {
 	struct thread *t = (struct thread *)obj;
@@ -167,8 +264,9 @@ static void thread_ctor(void *obj)
 	LIST_INIT(&t->runq_link);
 	LIST_INIT(&t->wait_link);
 	LIST_INIT(&t->owner_link);
+	LIST_INIT(&t->held_mutexes);
 
-	init_timer(&t->sleep_timer, "t-slp-tmr", 0);
+	init_hrtimer(&t->sleep_timer, "t-slp-tmr");
 
 	/* Initialize the death notifier */
 	init_notifier(&t->death_notifier);
@@ -179,13 +277,14 @@ static void thread_dtor(void *obj)
 	;
 }
 
-static void thread_wake_internal(struct thread *t)
+/* Take a sleeping thread off its wait list and mark it ready to run */
+static void thread_wake_prepare(struct thread *t)
 {
 	ASSERT(t->state == THREAD_SLEEPING);
 	ASSERT(!t->wait_lock || spinlock_held(t->wait_lock));
 
 	/* Cancel the timer */
-	cancel_timer(&t->sleep_timer);
+	cancel_hrtimer(&t->sleep_timer);
 
 	/* Remove the thread from the list and wake it up */
 	list_del(&t->wait_link);
@@ -193,20 +292,49 @@ static void thread_wake_internal(struct thread *t)
 	t->wait_lock = NULL;
 
 	t->state = THREAD_READY;
+}
+
+static void thread_wake_internal(struct thread *t)
+{
+	thread_wake_prepare(t);
 	sched_insert_thread(t);
 }
 
+/**
+ * Lock the wait lock and then the thread itself. The wait lock may change
+ * while we wait for it if the thread is moved to another wait queue, so
+ * check it again once both locks are held.
+ */
+static struct spinlock *thread_lock_wait(struct thread *t)
+{
+	struct spinlock *l;
+
+	while (TRUE) {
+		l = t->wait_lock;
+		if (l) {
+			spinlock_acquire(l);
+		}
+
+		spinlock_acquire(&t->lock);
+		if (t->wait_lock == l) {
+			break;
+		}
+
+		spinlock_release(&t->lock);
+		if (l) {
+			spinlock_release(l);
+		}
+	}
+
+	return l;
+}
+
 static boolean_t thread_interrupt_internal(struct thread *t, int flags)
 {
 	struct spinlock *l;
 	boolean_t ret = FALSE;
 
-	l = t->wait_lock;
-	if (l) {
-		spinlock_acquire(l);
-	}
-	
-	spinlock_acquire(&t->lock);
+	l = thread_lock_wait(t);
 	
 	if ((t->state == THREAD_SLEEPING) &&
 	    FLAG_ON(t->flags, THREAD_INTERRUPTIBLE)) {
@@ -234,12 +362,7 @@ static void thread_timeout(void *ctx)
 
 	DEBUG(DL_DBG, ("thread(%s:%p:%d) timed out.\n", t->name, t, t->id));
 
-	l = t->wait_lock;
-	if (l) {
-		spinlock_acquire(l);
-	}
-	
-	spinlock_acquire(&t->lock);
+	l = thread_lock_wait(t);
 
 	/* The thread could have been woken up already by another CPU */
 	if (t->state == THREAD_SLEEPING) {
@@ -265,11 +388,37 @@ int thread_create(const char *name, struct process *owner, int flags,
 		owner = _kernel_proc;
 	}
 
-	/* Allocate a thread structure from our slab allocator */
-	t = slab_cache_alloc(&_thread_cache);
+	/* Reuse a released thread of this CORE, it still has its kernel stack.
+	 * Otherwise allocate a thread structure from our slab allocator.
+	 */
+	t = thread_cache_get();
 	if (!t) {
-		DEBUG(DL_INF, ("slab allocate thread failed.\n"));
-		goto out;
+		t = slab_cache_alloc(&_thread_cache);
+		if (!t) {
+			DEBUG(DL_INF, ("slab allocate thread failed.\n"));
+			goto out;
+		}
+
+		/* Allocate kernel stack for the thread, it is only zeroed
+		 * the first time.
+		 */
+		t->kstack = kstack_alloc();
+		if (!t->kstack) {
+			DEBUG(DL_INF, ("kmalloc kstack failed.\n"));
+			slab_cache_free(&_thread_cache, t);
+			t = NULL;
+			goto out;
+		}
+		memset((void *)((ptr_t)t->kstack - KSTACK_SIZE), 0, KSTACK_SIZE);
+
+		/* The FPU trap handler can't allocate, do it up front */
+		if (fpu_alloc(t) != 0) {
+			DEBUG(DL_INF, ("kmalloc fpu area failed.\n"));
+			kstack_free(t->kstack);
+			slab_cache_free(&_thread_cache, t);
+			t = NULL;
+			goto out;
+		}
 	}
 
 	/* Allocate an ID for the thread */
@@ -277,14 +426,6 @@ int thread_create(const char *name, struct process *owner, int flags,
 
 	strncpy(t->name, name, T_NAME_LEN - 1);
 	t->name[T_NAME_LEN - 1] = 0;
-	
-	/* Allocate kernel stack for the process */
-	t->kstack = kmalloc(KSTACK_SIZE, MM_ALIGN) + KSTACK_SIZE;
-	if (!t->kstack) {
-		DEBUG(DL_INF, ("kmalloc kstack failed.\n"));
-		goto out;
-	}
-	memset((void *)((uint32_t)t->kstack - KSTACK_SIZE), 0, KSTACK_SIZE);
 
 	/* Initialize the architecture-specific data */
 	arch_thread_init(t, t->kstack, thread_wrapper);
@@ -294,15 +435,33 @@ int thread_create(const char *name, struct process *owner, int flags,
 	 */
 	t->core = NULL;
 
+	/* A thread taken from the cache still has the count it was freed with */
+	t->ref_count = 0;
 	t->state = THREAD_CREATED;
 	t->flags = flags;
 	t->priority = 16;
+	t->policy = SCHED_OTHER;
+	t->rt_priority = 0;
+	t->eff_priority = t->priority;
+	t->blocked_on = NULL;
+	t->rcu_nesting = 0;
+	t->timer_slack = HRTIMER_DEFAULT_SLACK;
+	t->ready_stamp = 0;
+	t->run_stamp = 0;
+	t->run_delay = 0;
+	t->run_time = 0;
+	t->nr_vol_switches = 0;
+	t->nr_invol_switches = 0;
 	t->ustack = 0;
 	t->ustack_size = 0;
 	t->entry = func;
 	t->args = args;
 	t->quantum = 0;
 	t->wait_lock = NULL;
+	t->wait_flags = 0;
+	t->joined = 0;
+	t->status = 0;
+	semaphore_init(&t->join_sem, "t-join-sem", 0);
 
 	/* Initialize signal handling state */
 	t->pending_signals = 0;
@@ -314,6 +473,12 @@ int thread_create(const char *name, struct process *owner, int flags,
 
 	/* Add the thread to the owner */
 	process_attach(owner, t);
+
+	/* Insert this thread into thread tree */
+	rwspin_write_acquire(&_thread_tree_lock);
+	avl_tree_insert_node(&_thread_tree, &t->tree_link, t->id, t);
+	rwspin_write_release(&_thread_tree_lock);
+	
 	rc = 0;
 
 	DEBUG(DL_DBG, ("thread(%s:%p:%d) created.\n", t->name, t, t->id));
@@ -328,12 +493,6 @@ int thread_create(const char *name, struct process *owner, int flags,
 	}
 
 out:
-	if (rc != 0) {
-		if (t) {
-			kfree(t);
-		}
-	}
-	
 	return rc;
 }
 
@@ -353,11 +512,26 @@ int thread_sleep(struct spinlock *lock, useconds_t timeout, const char *name, in
 	spinlock_acquire_noirq(&CURR_THREAD->lock);
 	CURR_THREAD->sleep_status = 0;
 	CURR_THREAD->wait_lock = lock;
+	if (FLAG_ON(flags, THREAD_INTERRUPTIBLE)) {
+		/* A signal posted before we took the lock found us awake and
+		 * will not interrupt the sleep, don't start it at all.
+		 */
+		if (signal_pending(CURR_THREAD)) {
+			spinlock_release_noirq(&CURR_THREAD->lock);
+			list_del(&CURR_THREAD->wait_link);
+			if (lock) {
+				spinlock_release_noirq(lock);
+			}
+			local_irq_restore(state);
+			return -1;
+		}
+		SET_FLAG(CURR_THREAD->flags, THREAD_INTERRUPTIBLE);
+	}
 
 	/* Start the timer if required */
 	if (timeout > 0) {
-		set_timer(&CURR_THREAD->sleep_timer, timeout, thread_timeout,
-			  CURR_THREAD);
+		set_hrtimer(&CURR_THREAD->sleep_timer, (uint64_t)timeout * 1000,
+			    CURR_THREAD->timer_slack, thread_timeout, CURR_THREAD);
 	}
 
 	/* Release the specified lock */
@@ -381,6 +555,31 @@ cancel:
 	return rc;
 }
 
+/**
+ * Lookup a thread of the specified tid. The thread is returned with a
+ * reference, drop it with thread_release(). A thread whose last reference
+ * is gone is on its way out of the tree and is not returned.
+ */
+struct thread *thread_lookup(tid_t tid)
+{
+	struct thread *t;
+	int32_t ref_count;
+
+	rwspin_read_acquire(&_thread_tree_lock);
+	t = avl_tree_lookup(&_thread_tree, tid);
+	while (t) {
+		ref_count = t->ref_count;
+		if (ref_count < 0) {
+			t = NULL;
+		} else if (atomic_tas(&t->ref_count, ref_count, ref_count + 1)) {
+			break;
+		}
+	}
+	rwspin_read_release(&_thread_tree_lock);
+
+	return t;
+}
+
 void thread_wake(struct thread *t)
 {
 	spinlock_acquire(&t->lock);
@@ -388,6 +587,27 @@ void thread_wake(struct thread *t)
 	spinlock_release(&t->lock);
 }
 
+/**
+ * Wake up a batch of sleeping threads. The threads stay locked until they
+ * are all queued, so the scheduler lock of a CORE is taken only once for
+ * the threads that go there.
+ */
+void thread_wake_many(struct thread **threads, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		spinlock_acquire(&threads[i]->lock);
+		thread_wake_prepare(threads[i]);
+	}
+
+	sched_insert_threads(threads, count);
+
+	for (i = count; i > 0; i--) {
+		spinlock_release(&threads[i - 1]->lock);
+	}
+}
+
 void thread_run(struct thread *t)
 {
 	spinlock_acquire(&t->lock);
@@ -423,7 +643,6 @@ boolean_t thread_interrupt(struct thread *t)
 
 void thread_release(struct thread *t)
 {
-	void *kstack;
 	struct process *p;
 
 	if (atomic_dec(&t->ref_count) > 0) {
@@ -438,20 +657,62 @@ void thread_release(struct thread *t)
 
 	p = t->owner;
 
+	rwspin_write_acquire(&_thread_tree_lock);
+	avl_tree_remove_node(&_thread_tree, &t->tree_link);
+	rwspin_write_release(&_thread_tree_lock);
+
 	/* Detach from its owner */
 	process_detach(t);
 
 	/* Cleanup the thread */
-	kstack = (void *)((uint32_t)t->kstack - KSTACK_SIZE);
-	kfree(kstack);
-
 	notifier_clear(&t->death_notifier);
 
 	DEBUG(DL_DBG, ("process(%s:%d:%d), thread(%s:%d), kstack(%p).\n", p->name,
-		       p->id, p->state, t->name, t->id, kstack));
+		       p->id, p->state, t->name, t->id, t->kstack));
+
+	/* Keep the thread for the next thread_create() on this CORE, free it
+	 * if the CORE has enough of them already.
+	 */
+	if (!thread_cache_put(t)) {
+		fpu_free(t);
+		kstack_free(t->kstack);
+		slab_cache_free(&_thread_cache, t);
+	}
+}
 
-	/* Free this thread to the thread cache */
-	slab_cache_free(&_thread_cache, t);
+/**
+ * Wait for a thread of the current process to exit and get its exit status.
+ * Only one thread may join a thread.
+ */
+int thread_join(tid_t tid, int *statusp)
+{
+	int rc = -1;
+	struct thread *t;
+
+	/* Hold a reference so the thread is not reaped while we wait for it */
+	t = thread_lookup(tid);
+	if (!t) {
+		DEBUG(DL_DBG, ("thread(%d) not found.\n", tid));
+		goto out;
+	}
+
+	if ((t == CURR_THREAD) || (t->owner != CURR_PROC) ||
+	    !atomic_tas(&t->joined, 0, 1)) {
+		DEBUG(DL_DBG, ("thread(%s:%d) cannot be joined.\n", t->name, t->id));
+		thread_release(t);
+		goto out;
+	}
+
+	semaphore_down(&t->join_sem);
+
+	if (statusp) {
+		*statusp = t->status;
+	}
+	thread_release(t);
+	rc = 0;
+
+ out:
+	return rc;
 }
 
 void thread_exit()
@@ -459,17 +720,19 @@ void thread_exit()
 	int rc = -1;
 	boolean_t state;
 
-	/* Unmap the user stack */
+	/* Unmap the user stack and give its slot back to the process */
 	if (CURR_THREAD->ustack_size) {
 		DEBUG(DL_DBG, ("unmap ustack, proc(%s), vas(%p).\n",
 			       CURR_PROC->name, CURR_PROC->vas));
 		rc = va_unmap(CURR_PROC->vas, (ptr_t)CURR_THREAD->ustack,
 			       CURR_THREAD->ustack_size);
 		ASSERT(rc == 0);
+		process_ustack_free(CURR_PROC, (ptr_t)CURR_THREAD->ustack);
 	}
 
 	/* Notify the waiter that we are exiting */
 	notifier_run(&CURR_THREAD->death_notifier);
+	semaphore_up(&CURR_THREAD->join_sem, 1);
 
 	state = local_irq_disable();
 	spinlock_acquire_noirq(&CURR_THREAD->lock);
@@ -486,5 +749,9 @@ void init_thread()
 	/* Initialize the thread slab cache */
 	slab_cache_init(&_thread_cache, "thread-cache", sizeof(struct thread), 
 			thread_ctor, thread_dtor, 0);
+
+	/* Initialize the thread avl tree and its lock */
+	avl_tree_init(&_thread_tree);
+	rwspin_init(&_thread_tree_lock, "ttree-lock");
 }
 
@@ -8,7 +8,7 @@ section	.__ac_init_trampoline
 [GLOBAL acstart]
 acstart:			; Entry for the application core
 	jmp	ac_boot		; Make the jump
-	
+
 align 	16
 ; The following are the arguments need to beset by the caller
 entry_addr	dd 0
@@ -17,23 +17,30 @@ kernel_sp	dd 0
 kernel_cr3	dd 0
 
 align 	8
-ac_boot:	
+ac_boot:
+	cli
 	xor	eax, eax
-	
+
 	;; Set the data segment
 	mov 	ax, cs
 	mov 	ds, ax
 	mov	es, ax
 	mov	fs, ax
 
-	;; Following is the debug code, remove it when you are able to go on
-	jmp	$
+	;; The code is copied to a page below 1MB and not run where it was
+	;; linked, so everything is addressed relative to acstart. Work out
+	;; the physical address of the page from the code segment.
+	shl	eax, 4
+	mov	ebx, eax
 
 	;; Set the correct base address of the GDT and load it
-	mov	eax, _base
-	mov	dword [eax], _gdt
-	mov	eax, _gdtptr
-	lgdt	[eax]
+	lea	ecx, [ebx + (_gdt - acstart)]
+	mov	dword [_base - acstart], ecx
+	lgdt	[_gdtptr - acstart]
+
+	;; Set the physical address of the 32-bit code for the far jump
+	lea	ecx, [ebx + (.ac_boot32 - acstart)]
+	mov	dword [_entry32 - acstart], ecx
 
 	;; Switch protect mode
 	mov	eax, cr0
@@ -41,7 +48,7 @@ ac_boot:
 	mov	cr0, eax
 
 	;; Jump to the 32-bit code segment, this is a far jump!
-	jmp	dword 0x08:.ac_boot32
+	o32 jmp	far [_entry32 - acstart]
 
 align 	8
 [BITS 32]
@@ -51,25 +58,45 @@ align 	8
 	mov	ds, ax
 	mov	es, ax
 	mov	fs, ax
+	mov	gs, ax
+	mov	ss, ax
+
+	;; Load the kernel page directory and enable paging, the page is
+	;; identity mapped so we keep running from it.
+	mov	eax, [ebx + (kernel_cr3 - acstart)]
+	mov	cr3, eax
+	mov	eax, cr0
+	or	eax, 0x80000000
+	mov	cr0, eax
 
 	;; Load the stack address
-	mov	esp, [kernel_sp]
+	mov	esp, [ebx + (kernel_sp - acstart)]
 
 	;; Clear the stack frame/FLAGS
 	xor	ebp, ebp
+	push	dword 0x02
+	popfd
 
 	;; Call the AC kernel entry (kmain_ac)
-	call	[entry_addr]
+	push	dword [ebx + (entry_arg - acstart)]
+	mov	eax, [ebx + (entry_addr - acstart)]
+	call	eax
+	cli
+	hlt
 	jmp	$
 
+_entry32:
+	dd	0			; Offset will be update at run time
+	dw	0x08			; Kernel code segment
+
 _gdt:
 	dq	0x0000000000000000 	; NULL descriptor
 	dq	0x00CF9A000000FFFF 	; Kernel code segment
 	dq	0x00CF92000000FFFF 	; Kernel data segment
 	dq	0x00CFFA000000FFFF 	; Usermode code segment
 	dq	0x00CFF2000000FFFF 	; Usermode data segment
-_gdtend:	
+_gdtend:
 _gdtptr:
 _limit 	dw	_gdtend - _gdt - 1	; sizeof gdt - 1
 					; you add or remove entry in gdt
-_base	dd	0			; Base address will be update at run time
\ No newline at end of file
+_base	dd	0			; Base address will be update at run time
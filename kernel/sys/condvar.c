@@ -0,0 +1,67 @@
+/*
+ * condvar.c
+ */
+#include <types.h>
+#include <stddef.h>
+#include "matrix/matrix.h"
+#include "debug.h"
+#include "proc/thread.h"
+#include "mutex.h"
+#include "condvar.h"
+
+/**
+ * Release a mutex and wait for the condition variable to be signaled, the
+ * mutex is acquired again before returning. We are queued before the mutex
+ * is released, so a signal sent after the caller checked its condition is
+ * not lost.
+ * @return		- 0 if signaled, -1 if timed out or interrupted
+ */
+int condvar_wait_timeout(struct condvar *cv, struct mutex *m,
+			 useconds_t timeout)
+{
+	int rc = -1;
+
+	ASSERT(m->owner == CURR_THREAD);
+
+	spinlock_acquire(&cv->lock);
+	wait_queue_add(&cv->wait, WAIT_EXCLUSIVE);
+	mutex_release(m);
+
+	rc = wait_queue_sleep(&cv->wait, &cv->lock, timeout, WAIT_EXCLUSIVE);
+
+	mutex_acquire(m);
+
+	return rc;
+}
+
+void condvar_wait(struct condvar *cv, struct mutex *m)
+{
+	condvar_wait_timeout(cv, m, -1);
+}
+
+/**
+ * Wake up one thread waiting on the condition variable
+ */
+void condvar_signal(struct condvar *cv)
+{
+	spinlock_acquire(&cv->lock);
+	wait_queue_wake_one(&cv->wait);
+	spinlock_release(&cv->lock);
+}
+
+/**
+ * Wake up all the threads waiting on the condition variable
+ */
+void condvar_broadcast(struct condvar *cv)
+{
+	spinlock_acquire(&cv->lock);
+	wait_queue_wake_all(&cv->wait);
+	spinlock_release(&cv->lock);
+}
+
+void condvar_init(struct condvar *cv, const char *name)
+{
+	spinlock_init(&cv->lock, "cv-lock");
+	wait_queue_init(&cv->wait, name, 0);
+	cv->name = name;
+}
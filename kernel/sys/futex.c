@@ -0,0 +1,256 @@
+#include <types.h>
+#include <stddef.h>
+#include "matrix/matrix.h"
+#include "debug.h"
+#include "barrier.h"
+#include "mm/mlayout.h"
+#include "mm/mmu.h"
+#include "mm/va.h"
+#include "proc/process.h"
+#include "proc/thread.h"
+#include "futex.h"
+
+/* Number of wait queues futexes hash to */
+#define FUTEX_HASH_SIZE		64
+#define FUTEX_HASH(key)		(((key) >> 2) % FUTEX_HASH_SIZE)
+
+/* Wait queue of all the futexes hashing to it */
+struct futex_queue {
+	struct spinlock lock;	// Lock protecting the waiters
+	struct list waiters;	// Threads waiting, linked by wait_link
+	volatile uint32_t seq;	// Bumped by each wake, see futex_wait()
+};
+
+static struct futex_queue _futex_queues[FUTEX_HASH_SIZE];
+
+/**
+ * Check that size bytes at addr are word aligned, in a single page that is
+ * present and accessible from user mode, and get their physical address.
+ * @return		- 0 on success, -1 otherwise
+ */
+static int futex_user_addr(ptr_t addr, size_t size, phys_addr_t *physp)
+{
+	int rc = -1;
+	struct mmu_ctx *ctx;
+	struct page *page;
+
+	if (!addr || (addr & (sizeof(int) - 1)) ||
+	    ((addr % PAGE_SIZE) + size > PAGE_SIZE) ||
+	    (addr >= KERNEL_KMEM_START) || !CURR_PROC->vas) {
+		goto out;
+	}
+
+	ctx = CURR_PROC->vas->mmu;
+
+	mutex_acquire(&ctx->lock);
+	page = mmu_get_page(ctx, addr, FALSE, 0);
+	if (page && page->present && page->user) {
+		*physp = (page->frame * PAGE_SIZE) + (addr % PAGE_SIZE);
+		rc = 0;
+	}
+	mutex_release(&ctx->lock);
+
+ out:
+	return rc;
+}
+
+/**
+ * Work out the key of a futex, the physical address of the user's word.
+ * Processes sharing the page find the same futex whatever their mapping.
+ */
+static INLINE int futex_key(int *uaddr, phys_addr_t *keyp)
+{
+	return futex_user_addr((ptr_t)uaddr, sizeof(int), keyp);
+}
+
+static INLINE struct futex_queue *futex_queue(phys_addr_t key)
+{
+	return &_futex_queues[FUTEX_HASH(key)];
+}
+
+/**
+ * Sleep on a futex if it still holds val. The value is read before the
+ * queue is locked, as the read may fault. A waker changes the value before
+ * it wakes, so a wake up in between shows as a change of the wake sequence.
+ * @return		- 0 if woken up, -1 if the value differs, the
+ *			  timeout expired or a signal interrupted the sleep
+ */
+static int futex_wait(int *uaddr, phys_addr_t key, int val,
+		      useconds_t timeout)
+{
+	struct futex_queue *q;
+	uint32_t seq;
+
+	q = futex_queue(key);
+
+	seq = q->seq;
+	leave_cs_barrier();
+	if (*uaddr != val) {
+		return -1;
+	}
+
+	spinlock_acquire(&q->lock);
+
+	if (q->seq != seq) {
+		spinlock_release(&q->lock);
+		return 0;
+	}
+
+	CURR_THREAD->futex_key = key;
+	list_add_tail(&CURR_THREAD->wait_link, &q->waiters);
+
+	return thread_sleep(&q->lock, timeout, "futex", THREAD_INTERRUPTIBLE);
+}
+
+/* Wake up to nr waiters of a futex, the queue lock must be held */
+static int futex_wake_locked(struct futex_queue *q, phys_addr_t key, int nr)
+{
+	struct thread *t;
+	struct list *l, *p;
+	int woken = 0;
+
+	q->seq++;
+
+	LIST_FOR_EACH_SAFE(l, p, &q->waiters) {
+		if (woken >= nr) {
+			break;
+		}
+
+		t = LIST_ENTRY(l, struct thread, wait_link);
+		if (t->futex_key == key) {
+			thread_wake(t);
+			woken++;
+		}
+	}
+
+	return woken;
+}
+
+static int futex_wake(phys_addr_t key, int nr)
+{
+	struct futex_queue *q;
+	int woken;
+
+	q = futex_queue(key);
+	spinlock_acquire(&q->lock);
+	woken = futex_wake_locked(q, key, nr);
+	spinlock_release(&q->lock);
+
+	return woken;
+}
+
+/**
+ * Wake nr_wake waiters of a futex and move up to nr_requeue of the others
+ * to a second futex, so that e.g. a condition variable broadcast does not
+ * wake every waiter just to have them contend on the mutex.
+ */
+static int futex_requeue(phys_addr_t key, phys_addr_t key2, int nr_wake,
+			 int nr_requeue)
+{
+	struct futex_queue *q, *q2;
+	struct thread *t;
+	struct list *l, *p;
+	int woken, moved = 0;
+
+	q = futex_queue(key);
+	q2 = futex_queue(key2);
+
+	/* Take the two queue locks in address order */
+	if (q == q2) {
+		spinlock_acquire(&q->lock);
+	} else if (q < q2) {
+		spinlock_acquire(&q->lock);
+		spinlock_acquire_noirq(&q2->lock);
+	} else {
+		spinlock_acquire(&q2->lock);
+		spinlock_acquire_noirq(&q->lock);
+	}
+
+	woken = futex_wake_locked(q, key, nr_wake);
+
+	LIST_FOR_EACH_SAFE(l, p, &q->waiters) {
+		if (moved >= nr_requeue) {
+			break;
+		}
+
+		t = LIST_ENTRY(l, struct thread, wait_link);
+		if (t->futex_key != key) {
+			continue;
+		}
+
+		/* The thread lock keeps a timeout from looking at the thread
+		 * while it changes queue.
+		 */
+		spinlock_acquire_noirq(&t->lock);
+		list_del(&t->wait_link);
+		list_add_tail(&t->wait_link, &q2->waiters);
+		t->futex_key = key2;
+		t->wait_lock = &q2->lock;
+		spinlock_release_noirq(&t->lock);
+		moved++;
+	}
+
+	if (q == q2) {
+		spinlock_release(&q->lock);
+	} else if (q < q2) {
+		spinlock_release_noirq(&q2->lock);
+		spinlock_release(&q->lock);
+	} else {
+		spinlock_release_noirq(&q->lock);
+		spinlock_release(&q2->lock);
+	}
+
+	return woken + moved;
+}
+
+int sys_futex(int *uaddr, int op, int val, void *arg, int val2)
+{
+	int rc;
+	phys_addr_t key, key2;
+	useconds_t timeout = -1;
+
+	rc = futex_key(uaddr, &key);
+	if (rc != 0) {
+		goto out;
+	}
+
+	switch (op) {
+	case FUTEX_WAIT:
+		if (arg) {
+			rc = futex_user_addr((ptr_t)arg, sizeof(useconds_t), &key2);
+			if (rc != 0) {
+				break;
+			}
+			timeout = *(useconds_t *)arg;
+		}
+		rc = futex_wait(uaddr, key, val, timeout);
+		break;
+	case FUTEX_WAKE:
+		rc = futex_wake(key, val);
+		break;
+	case FUTEX_REQUEUE:
+		rc = futex_key((int *)arg, &key2);
+		if (rc != 0) {
+			break;
+		}
+		rc = futex_requeue(key, key2, val, val2);
+		break;
+	default:
+		rc = -1;
+		break;
+	}
+
+ out:
+	return rc;
+}
+
+void init_futex()
+{
+	int i;
+
+	for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+		spinlock_init(&_futex_queues[i].lock, "futex-lock");
+		LIST_INIT(&_futex_queues[i].waiters);
+		_futex_queues[i].seq = 0;
+	}
+}
@@ -0,0 +1,231 @@
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include "debug.h"
+#include "div64.h"
+#include "hal/core.h"
+#include "hal/lapic.h"
+#include "timer.h"
+#include "hrtimer.h"
+#include "softirq.h"
+
+static INLINE uint64_t ns_to_cycles(uint64_t ns)
+{
+	uint64_t cycles;
+
+	cycles = ns * CURR_CORE->arch.cycles_per_us;
+	do_div(cycles, 1000);
+
+	return cycles;
+}
+
+/* Period of the timer wheel tick in TSC cycles */
+static INLINE uint64_t tick_cycles()
+{
+	return (uint64_t)TIMER_TICK_US * CURR_CORE->arch.cycles_per_us;
+}
+
+/* Insert a timer into the queue, keeping the queue sorted by deadline */
+static void hrtimer_enqueue(struct hrtimer_queue *q, struct hrtimer *t)
+{
+	struct list *l;
+	struct hrtimer *pos;
+
+	LIST_FOR_EACH(l, &q->timers) {
+		pos = LIST_ENTRY(l, struct hrtimer, link);
+		if (pos->deadline > t->deadline) {
+			break;
+		}
+	}
+
+	/* Insert before the first timer with a later deadline */
+	list_add_tail(&t->link, l);
+}
+
+/**
+ * Arm the timer hardware of the CORE for the earliest of the next timer
+ * wheel tick and the first hrtimer deadline. Unless forced, the hardware is
+ * only touched if the new event is earlier than the one it is armed for.
+ * Must be called on the CORE with its timer lock held.
+ */
+static void hrtimer_reprogram(struct core *c, boolean_t force)
+{
+	struct hrtimer_queue *q;
+	struct hrtimer *t;
+	uint64_t next;
+
+	q = &c->hrtimers;
+	next = q->next_tick;
+	if (!LIST_EMPTY(&q->timers)) {
+		t = LIST_ENTRY(q->timers.next, struct hrtimer, link);
+		if (t->deadline < next) {
+			next = t->deadline;
+		}
+	}
+
+	if (!force && next >= q->next_event) {
+		return;
+	}
+
+	q->next_event = next;
+	lapic_timer_program(next);
+}
+
+void init_hrtimer(struct hrtimer *t, const char *name)
+{
+	ASSERT(t != NULL);
+
+	LIST_INIT(&t->link);
+	t->core = NULL;
+	t->expires = 0;
+	t->deadline = 0;
+	t->func = NULL;
+	t->ctx = NULL;
+	strncpy(t->name, name, 15);
+	t->name[15] = 0;
+}
+
+/**
+ * Activate a high resolution timer to run the callback function after
+ * expire_ns nanoseconds. The callback may be delayed by up to slack_ns
+ * nanoseconds so that it can be batched with other timers.
+ */
+void set_hrtimer(struct hrtimer *t, uint64_t expire_ns, uint64_t slack_ns,
+		 timer_func_t callback, void *ctx)
+{
+	boolean_t state;
+	struct core *c;
+
+	ASSERT(t != NULL);
+
+	cancel_hrtimer(t);
+
+	state = local_irq_disable();
+	c = CURR_CORE;
+
+	spinlock_acquire_noirq(&c->timer_lock);
+
+	t->expires = x86_rdtsc() + ns_to_cycles(expire_ns);
+	t->deadline = t->expires + ns_to_cycles(slack_ns);
+	t->func = callback;
+	t->ctx = ctx;
+	t->core = c;
+
+	hrtimer_enqueue(&c->hrtimers, t);
+	hrtimer_reprogram(c, FALSE);
+
+	spinlock_release_noirq(&c->timer_lock);
+	local_irq_restore(state);
+}
+
+/**
+ * Deactivate a high resolution timer, the timer may be queued on another
+ * CORE. The timer hardware is left alone, an early interrupt is harmless.
+ */
+void cancel_hrtimer(struct hrtimer *t)
+{
+	struct core *c;
+
+	ASSERT(t != NULL);
+
+	while (TRUE) {
+		c = t->core;
+		if (!c) {
+			break;
+		}
+
+		spinlock_acquire(&c->timer_lock);
+
+		/* Check again, the timer could have fired in the meantime */
+		if (t->core == c) {
+			list_del(&t->link);
+			t->core = NULL;
+			spinlock_release(&c->timer_lock);
+			break;
+		}
+
+		spinlock_release(&c->timer_lock);
+	}
+}
+
+/**
+ * Handle an interrupt of the timer hardware. Runs the due hrtimers, rearms
+ * the hardware for the next event and ticks the timer wheel if its period
+ * has elapsed.
+ */
+void hrtimer_interrupt()
+{
+	struct hrtimer_queue *q;
+	struct hrtimer *t;
+	struct core *c;
+	timer_func_t func;
+	uint64_t now;
+	void *ctx;
+	boolean_t tick = FALSE;
+
+	c = CURR_CORE;
+	q = &c->hrtimers;
+
+	spinlock_acquire(&c->timer_lock);
+
+	/* Run every timer whose expire time has passed. The queue is sorted by
+	 * deadline, so all the timers that share this interrupt are at the
+	 * head of the queue.
+	 */
+	now = x86_rdtsc();
+	while (!LIST_EMPTY(&q->timers)) {
+		t = LIST_ENTRY(q->timers.next, struct hrtimer, link);
+		if (t->expires > now) {
+			break;
+		}
+
+		list_del(&t->link);
+		t->core = NULL;
+		func = t->func;
+		ctx = t->ctx;
+
+		spinlock_release(&c->timer_lock);
+		func(ctx);
+		spinlock_acquire(&c->timer_lock);
+
+		now = x86_rdtsc();
+	}
+
+	/* Without a LAPIC we are called from the periodic PIT interrupt */
+	if (!lapic_enabled() || now >= q->next_tick) {
+		tick = TRUE;
+		q->next_tick = now + tick_cycles();
+	}
+
+	hrtimer_reprogram(c, TRUE);
+
+	spinlock_release(&c->timer_lock);
+
+	/* The wheel timers run as a bottom half once we leave the interrupt */
+	if (tick) {
+		softirq_raise(SOFTIRQ_TIMER);
+	}
+}
+
+void hrtimer_queue_init(struct hrtimer_queue *q)
+{
+	LIST_INIT(&q->timers);
+	q->next_tick = 0;
+	q->next_event = 0;
+}
+
+void init_hrtimer_percore()
+{
+	struct core *c;
+	boolean_t state;
+
+	state = local_irq_disable();
+	c = CURR_CORE;
+
+	spinlock_acquire_noirq(&c->timer_lock);
+	c->hrtimers.next_tick = x86_rdtsc() + tick_cycles();
+	hrtimer_reprogram(c, TRUE);
+	spinlock_release_noirq(&c->timer_lock);
+
+	local_irq_restore(state);
+}
@@ -0,0 +1,245 @@
+/*
+ * lockstat.c
+ */
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include "matrix/matrix.h"
+#include "atomic.h"
+#include "bitops.h"
+#include "div64.h"
+#include "lockstat.h"
+#include "kd.h"
+
+#ifdef _LOCKSTAT
+
+/* Number of lock names we can tell apart, must be a power of 2 */
+#define LOCKSTAT_CLASSES	256
+
+/* Table of the lock classes, hashed by name. A slot is claimed by setting
+ * its key and never released, so lookups need no lock. This matters as the
+ * table is used from inside every lock operation.
+ */
+static atomic_t _lockstat_keys[LOCKSTAT_CLASSES];
+static struct lockstat_class _lockstat_classes[LOCKSTAT_CLASSES];
+
+/* Class for the locks that did not fit into the table */
+static struct lockstat_class _lockstat_overflow = {
+	.name = "<overflow>"
+};
+
+static INLINE void lockstat_add64(volatile uint64_t *var, uint64_t val)
+{
+	uint64_t old;
+
+	do {
+		old = *var;
+	} while (!__sync_bool_compare_and_swap(var, old, old + val));
+}
+
+static INLINE int lockstat_bucket(uint64_t cycles)
+{
+	uint32_t value;
+	int bucket;
+
+	cycles >>= LOCKSTAT_HIST_SHIFT;
+	if (cycles >> 32) {
+		return LOCKSTAT_HIST_BUCKETS - 1;
+	}
+
+	value = (uint32_t)cycles;
+	if (!value) {
+		return 0;
+	}
+
+	bucket = bitops_fls(value) + 1;
+	return MIN(bucket, LOCKSTAT_HIST_BUCKETS - 1);
+}
+
+static uint32_t lockstat_hash(const char *name)
+{
+	uint32_t hash = 5381;
+
+	while (*name) {
+		hash = (hash << 5) + hash + *name++;
+	}
+
+	return hash;
+}
+
+/* Find the class of a lock name, create it if this is the first lock */
+static struct lockstat_class *lockstat_lookup(const char *name)
+{
+	uint32_t hash;
+	int i, idx;
+	const char *key;
+
+	if (!name) {
+		return &_lockstat_overflow;
+	}
+
+	hash = lockstat_hash(name);
+	for (i = 0; i < LOCKSTAT_CLASSES; i++) {
+		idx = (hash + i) & (LOCKSTAT_CLASSES - 1);
+
+		key = (const char *)_lockstat_keys[idx];
+		if (!key) {
+			/* Claim the free slot, somebody may beat us to it */
+			if (!atomic_tas(&_lockstat_keys[idx], 0, (int32_t)name)) {
+				i--;
+				continue;
+			}
+			_lockstat_classes[idx].name = name;
+			return &_lockstat_classes[idx];
+		}
+
+		if ((key == name) || (strcmp(key, name) == 0)) {
+			return &_lockstat_classes[idx];
+		}
+	}
+
+	return &_lockstat_overflow;
+}
+
+/**
+ * Account an acquisition of a lock. The class of the lock is looked up on
+ * its first acquisition, so statically initialized locks need no setup.
+ */
+void lockstat_acquired(struct lockstat_class **clsp, const char *name,
+		       uint64_t start, uint64_t now, int how)
+{
+	struct lockstat_class *cls;
+	uint64_t wait;
+
+	cls = *clsp;
+	if (!cls) {
+		cls = lockstat_lookup(name);
+		*clsp = cls;
+	}
+
+	atomic_inc((atomic_t *)&cls->acquisitions);
+	if (how == LOCKSTAT_FREE) {
+		return;
+	}
+
+	wait = (now > start) ? (now - start) : 0;
+	atomic_inc((atomic_t *)&cls->contended);
+	atomic_inc((atomic_t *)&cls->wait_hist[lockstat_bucket(wait)]);
+	lockstat_add64(&cls->wait_cycles, wait);
+	if (how == LOCKSTAT_SPUN) {
+		lockstat_add64(&cls->spin_cycles, wait);
+	}
+}
+
+/* Account the hold time of a lock that is about to be released */
+void lockstat_released(struct lockstat_class *cls, uint64_t stamp)
+{
+	uint64_t now, hold;
+
+	if (!cls) {
+		return;
+	}
+
+	now = x86_rdtsc();
+	hold = (now > stamp) ? (now - stamp) : 0;
+	atomic_inc((atomic_t *)&cls->hold_hist[lockstat_bucket(hold)]);
+	lockstat_add64(&cls->hold_cycles, hold);
+}
+
+static void lockstat_clear(struct lockstat_class *cls)
+{
+	const char *name;
+
+	name = cls->name;
+	memset(cls, 0, sizeof(struct lockstat_class));
+	cls->name = name;
+}
+
+/**
+ * Clear the statistics of all lock classes. Updates racing with the reset
+ * may survive it.
+ */
+void lockstat_reset()
+{
+	int i;
+
+	for (i = 0; i < LOCKSTAT_CLASSES; i++) {
+		if (_lockstat_keys[i]) {
+			lockstat_clear(&_lockstat_classes[i]);
+		}
+	}
+	lockstat_clear(&_lockstat_overflow);
+}
+
+static void lockstat_print_hist(const char *what, uint32_t *hist)
+{
+	int i;
+
+	kd_printf("  %s:\n", what);
+	for (i = 0; i < LOCKSTAT_HIST_BUCKETS; i++) {
+		if (hist[i]) {
+			kd_printf("    < %lld cycles: %d\n",
+				  1ULL << (LOCKSTAT_HIST_SHIFT + i), hist[i]);
+		}
+	}
+}
+
+static int kd_cmd_lockstat(int argc, char **argv, kd_filter_t *filter)
+{
+	struct lockstat_class *cls;
+	uint64_t wait, hold;
+	int i;
+
+	if ((argc > 1) && (strcmp(argv[1], "reset") == 0)) {
+		lockstat_reset();
+		return 0;
+	}
+
+	kd_printf("%-16s %10s %10s %12s %10s %10s\n", "name", "acquired",
+		  "contended", "spin", "avg-wait", "avg-hold");
+
+	for (i = 0; i <= LOCKSTAT_CLASSES; i++) {
+		if (i == LOCKSTAT_CLASSES) {
+			cls = &_lockstat_overflow;
+		} else if (_lockstat_keys[i]) {
+			cls = &_lockstat_classes[i];
+		} else {
+			continue;
+		}
+
+		if (!cls->acquisitions) {
+			continue;
+		}
+
+		/* Only show the histograms of the lock asked for */
+		if ((argc > 1) && (strcmp(argv[1], cls->name) != 0)) {
+			continue;
+		}
+
+		wait = cls->wait_cycles;
+		if (cls->contended) {
+			do_div(wait, cls->contended);
+		}
+		hold = cls->hold_cycles;
+		do_div(hold, cls->acquisitions);
+
+		kd_printf("%-16s %10d %10d %12lld %10lld %10lld\n", cls->name,
+			  cls->acquisitions, cls->contended, cls->spin_cycles,
+			  wait, hold);
+
+		if (argc > 1) {
+			lockstat_print_hist("wait", cls->wait_hist);
+			lockstat_print_hist("hold", cls->hold_hist);
+		}
+	}
+
+	return 0;
+}
+
+void init_lockstat()
+{
+	kd_register_cmd("lockstat", "Display [name] or reset the lock statistics.",
+			kd_cmd_lockstat);
+}
+
+#endif	/* _LOCKSTAT */
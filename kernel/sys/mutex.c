@@ -3,20 +3,172 @@
 #include "matrix/matrix.h"
 #include "debug.h"
 #include "proc/thread.h"
+#include "proc/sched.h"
+#include "hal/core.h"
 #include "mutex.h"
+#include "lockstat.h"
+
+/* Number of rounds a waiter spins on a running owner before it sleeps */
+#define MUTEX_SPIN_MAX		1000
+
+/* Maximum length of a blocking chain that priority inheritance walks */
+#define MUTEX_PI_MAX_DEPTH	8
+
+/* Lock protecting the wait lists ordering, the blocked_on/held_mutexes links
+ * of the threads and the priority inheritance chains. Lock order is
+ * m->lock -> _pi_lock -> t->lock -> scheduler lock.
+ */
+static struct spinlock _pi_lock = {
+	.value = 1,
+	.state = FALSE,
+	.name = "pi-lock"
+};
 
 static INLINE void mutex_recursive_error(struct mutex *m)
 {
 	PANIC("Recursive locking of non-recursive mutex");
 }
 
+/**
+ * Work out the priority a thread should run at, the highest of its own and
+ * the top waiter of every mutex it holds
+ */
+static int mutex_pi_priority(struct thread *t)
+{
+	struct mutex *m;
+	struct thread *w;
+	struct list *l;
+	int prio;
+
+	prio = sched_base_priority(t);
+	LIST_FOR_EACH(l, &t->held_mutexes) {
+		m = LIST_ENTRY(l, struct mutex, held_link);
+		w = wait_queue_first(&m->wait);
+		if (w && (w->eff_priority > prio)) {
+			prio = w->eff_priority;
+		}
+	}
+
+	return prio;
+}
+
+/**
+ * Recompute the priority of a thread and pass the change along the chain of
+ * mutex owners it is blocked behind. Must be called with _pi_lock held.
+ */
+static void mutex_pi_propagate(struct thread *t)
+{
+	struct mutex *m;
+	int depth, prio;
+
+	ASSERT(spinlock_held(&_pi_lock));
+
+	for (depth = 0; t && (depth < MUTEX_PI_MAX_DEPTH); depth++) {
+		prio = mutex_pi_priority(t);
+		if (prio == t->eff_priority) {
+			break;
+		}
+
+		spinlock_acquire(&t->lock);
+		sched_change_priority(t, prio);
+		spinlock_release(&t->lock);
+
+		/* Reposition the thread in the wait list of the mutex it is
+		 * blocked on and go on with the owner of that mutex.
+		 */
+		m = t->blocked_on;
+		if (!m || LIST_EMPTY(&t->wait_link)) {
+			break;
+		}
+		wait_queue_requeue(&m->wait, t);
+		t = m->owner;
+	}
+}
+
+/**
+ * Account a contended mutex to its owner so that the owner inherits the
+ * priority of the waiters. Must be called with _pi_lock held.
+ */
+static void mutex_pi_link(struct mutex *m)
+{
+	ASSERT(spinlock_held(&_pi_lock));
+
+	if (m->owner && LIST_EMPTY(&m->held_link)) {
+		list_add_tail(&m->held_link, &m->owner->held_mutexes);
+	}
+}
+
+/**
+ * Spin on a contended mutex for as long as its owner runs on another CORE,
+ * as it is likely to release the mutex before we could go to sleep and be
+ * woken up again. Thread structures come from a slab cache so the owner
+ * can be read safely even if it exits meanwhile.
+ */
+static boolean_t mutex_spin(struct mutex *m)
+{
+	struct thread *owner;
+	int i;
+
+	for (i = 0; i < MUTEX_SPIN_MAX; i++) {
+		/* The owner blocked or shares our CORE, spinning is useless */
+		owner = m->owner;
+		if (owner && ((owner->state != THREAD_RUNNING) ||
+			      (owner->core == CURR_CORE))) {
+			break;
+		}
+
+		if (!m->value && atomic_tas(&m->value, 0, 1)) {
+			return TRUE;
+		}
+
+		core_spin_hint();
+	}
+
+	return FALSE;
+}
+
+/**
+ * Stop waiting for a mutex after the sleep timed out or got interrupted.
+ * The timeout took us off the wait list, so the owner no longer inherits
+ * our priority.
+ */
+static void mutex_wait_cancel(struct mutex *m)
+{
+	spinlock_acquire(&m->lock);
+	spinlock_acquire_noirq(&_pi_lock);
+
+	ASSERT(m->owner != CURR_THREAD);
+	CURR_THREAD->blocked_on = NULL;
+	mutex_pi_propagate(m->owner);
+
+	spinlock_release_noirq(&_pi_lock);
+	spinlock_release(&m->lock);
+}
+
 static int mutex_acquire_internal(struct mutex *m, useconds_t timeout, int flags)
 {
 	int rc = -1;
+	int how = LOCKSTAT_FREE;
+	int wait_flags = WAIT_EXCLUSIVE;
+	uint64_t start;
+
+	start = LOCKSTAT_NOW();
+
+	/* The flags are thread sleep flags, the wait queue has its own */
+	if (FLAG_ON(flags, THREAD_INTERRUPTIBLE)) {
+		SET_FLAG(wait_flags, WAIT_INTERRUPTIBLE);
+	}
 
 	if (!atomic_tas(&m->value, 0, 1)) {
 		if (m->owner == CURR_THREAD) {
+			/* Leave the stamp of the outer acquire alone, or its
+			 * hold time would be cut short.
+			 */
 			mutex_recursive_error(m);
+			return rc;
+		} else if (mutex_spin(m)) {
+			m->spin_acquires++;
+			how = LOCKSTAT_SPUN;
 		} else {
 			spinlock_acquire(&m->lock);
 
@@ -25,22 +177,53 @@ static int mutex_acquire_internal(struct mutex *m, useconds_t timeout, int flags
 			 */
 			if (atomic_tas(&m->value, 0, 1)) {
 				spinlock_release(&m->lock);
+				how = LOCKSTAT_SPUN;
 			} else {
-				list_add_tail(&CURR_THREAD->wait_link, &m->threads);
+				/* Queue by priority and lend our priority to the
+				 * owner, and to whatever the owner is waiting for.
+				 */
+				spinlock_acquire_noirq(&_pi_lock);
+				CURR_THREAD->blocked_on = m;
+				wait_queue_add(&m->wait, wait_flags);
+				mutex_pi_link(m);
+				mutex_pi_propagate(m->owner);
+				spinlock_release_noirq(&_pi_lock);
 
-				/* If thread_sleep is successful, we will own the lock */
-				rc = thread_sleep(&m->lock, timeout, m->name, flags);
+				/* If thread_sleep is successful, we will own the
+				 * lock, mutex_release() has already made us the
+				 * owner.
+				 */
+				rc = wait_queue_sleep(&m->wait, &m->lock, timeout,
+						      wait_flags);
 				if (rc != 0) {
+					mutex_wait_cancel(m);
 					return rc;
 				}
 
 				DEBUG(DL_DBG, ("mutex(%s) put thread(%s:%d) to wait list.\n",
 					       m->name, CURR_THREAD->name, CURR_THREAD->id));
+				ASSERT(m->owner == CURR_THREAD);
+				m->sleep_acquires++;
+				LOCKSTAT_ACQUIRED(m, start, LOCKSTAT_SLEPT);
+				return 0;
 			}
 		}
 	}
 
 	m->owner = CURR_THREAD;
+	LOCKSTAT_ACQUIRED(m, start, how);
+
+	/* A thread may have queued up while the owner was not set yet, make
+	 * sure it gets accounted to us.
+	 */
+	__sync_synchronize();
+	if (!wait_queue_empty(&m->wait)) {
+		spinlock_acquire(&_pi_lock);
+		mutex_pi_link(m);
+		mutex_pi_propagate(CURR_THREAD);
+		spinlock_release(&_pi_lock);
+	}
+
 	return 0;
 }
 
@@ -52,7 +235,6 @@ void mutex_acquire(struct mutex *m)
 void mutex_release(struct mutex *m)
 {
 	struct thread *t;
-	struct list *l;
 
 	spinlock_acquire(&m->lock);
 
@@ -64,33 +246,99 @@ void mutex_release(struct mutex *m)
 
 	/* If the current value is 1, the mutex is being released. If there is
 	 * a thread waiting, we do not need to modify the count, as we transfer
-	 * ownership of the lock to it. Otherwise, decrement the count.
+	 * ownership of the lock to the waiter with the highest priority.
+	 * Otherwise, decrement the count.
 	 */
 	if (m->value == 1) {
+		LOCKSTAT_RELEASED(m);
+
+		/* Waiters need the mutex lock to queue up, so without waiters
+		 * and inherited priority there is nothing for priority
+		 * inheritance to do.
+		 */
+		if (wait_queue_empty(&m->wait) && LIST_EMPTY(&m->held_link) &&
+		    (CURR_THREAD->eff_priority ==
+		     sched_base_priority(CURR_THREAD))) {
+			m->owner = NULL;
+			atomic_dec(&m->value);
+			goto out;
+		}
+
+		spinlock_acquire_noirq(&_pi_lock);
+
+		list_del(&m->held_link);
 		m->owner = NULL;
-		if (!LIST_EMPTY(&m->threads)) {
-			l = m->threads.next;
-			t = LIST_ENTRY(l, struct thread, wait_link);
+		t = wait_queue_first(&m->wait);
+		if (t) {
 			DEBUG(DL_DBG, ("mutex(%s) waking up thread(%s:%d).\n",
 				       m->name, t->name, t->id));
-			thread_wake(t);
+
+			/* Hand the mutex over, the remaining waiters now boost
+			 * the new owner.
+			 */
+			m->owner = t;
+			t->blocked_on = NULL;
+			wait_queue_wake_one(&m->wait);
+			mutex_pi_link(m);
+			mutex_pi_propagate(t);
 		} else {
 			DEBUG(DL_DBG, ("mutex(%s) no waiting threads.\n", m->name));
 			atomic_dec(&m->value);
 		}
+
+		/* Drop any priority we inherited through this mutex */
+		mutex_pi_propagate(CURR_THREAD);
+
+		spinlock_release_noirq(&_pi_lock);
 	} else {
 		atomic_dec(&m->value);
 	}
 
+ out:
 	spinlock_release(&m->lock);
+
+	/* A waiter we woke up or our own deboost may call for a switch */
+	if (local_irq_state()) {
+		sched_preempt();
+	}
+}
+
+/**
+ * Recompute the effective priority of a thread after its base priority was
+ * changed, and propagate it to the owners of the mutex it waits for.
+ */
+void mutex_pi_update(struct thread *t)
+{
+	struct mutex *m;
+
+	spinlock_acquire(&_pi_lock);
+
+	mutex_pi_propagate(t);
+
+	/* Keep the wait list ordered even if the priority did not change the
+	 * chain, e.g. a boosted thread lowering its base priority.
+	 */
+	m = t->blocked_on;
+	if (m) {
+		wait_queue_requeue(&m->wait, t);
+	}
+
+	spinlock_release(&_pi_lock);
 }
 
 void mutex_init(struct mutex *m, const char *name, int flags)
 {
 	m->value = 0;
 	spinlock_init(&m->lock, "mutex-lock");
-	LIST_INIT(&m->threads);
+	wait_queue_init(&m->wait, name, WAITQ_PRIORITY);
+	LIST_INIT(&m->held_link);
 	m->flags = flags;
 	m->owner = NULL;
 	m->name = name;
+	m->spin_acquires = 0;
+	m->sleep_acquires = 0;
+#ifdef _LOCKSTAT
+	m->stats = NULL;
+	m->acquire_stamp = 0;
+#endif	/* _LOCKSTAT */
 }
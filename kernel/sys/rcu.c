@@ -0,0 +1,239 @@
+#include <types.h>
+#include <stddef.h>
+#include "matrix/matrix.h"
+#include "debug.h"
+#include "hal/hal.h"
+#include "hal/core.h"
+#include "proc/thread.h"
+#include "proc/sched.h"
+#include "semaphore.h"
+#include "rcu.h"
+
+/* Lock protecting the grace period state */
+static struct spinlock _rcu_lock = {
+	.value = 1,
+	.state = FALSE,
+	.name = "rcu-lock"
+};
+
+static volatile uint32_t _rcu_completed = 0;	// Grace periods completed
+static uint32_t _rcu_needed = 0;		// Highest grace period requested
+static boolean_t _rcu_active = FALSE;		// A grace period is in progress
+static volatile coremask_t _rcu_pending = 0;	// COREs yet to pass a quiescent state
+
+/* Callbacks whose grace period has ended, run by the RCU thread */
+static struct list _rcu_done = {
+	.prev = &_rcu_done,
+	.next = &_rcu_done
+};
+static struct spinlock _rcu_done_lock;
+static struct semaphore _rcu_done_sem;
+static boolean_t _rcu_ready = FALSE;
+
+/* Grace period waited for by synchronize_rcu() */
+struct rcu_sync {
+	struct rcu_head head;
+	struct semaphore sem;
+};
+
+/* Start a new grace period if one was requested, _rcu_lock must be held */
+static void rcu_start_gp()
+{
+	if (_rcu_active || ((int32_t)(_rcu_needed - _rcu_completed) <= 0)) {
+		return;
+	}
+
+	_rcu_active = TRUE;
+	_rcu_pending = sched_online_cores();
+}
+
+/**
+ * Report that the current CORE passed through a quiescent state, that is it
+ * holds no reference obtained in a read-side critical section. Called at
+ * context switch and from the tick, interrupts must be disabled.
+ */
+void rcu_note_qs()
+{
+	coremask_t bit;
+
+	bit = COREMASK_BIT(CURR_CORE->id);
+	if (!(_rcu_pending & bit)) {
+		return;
+	}
+
+	spinlock_acquire_noirq(&_rcu_lock);
+
+	_rcu_pending &= ~bit;
+	if (_rcu_active && !_rcu_pending) {
+		/* Every CORE went through a quiescent state, the grace
+		 * period is over.
+		 */
+		_rcu_completed++;
+		_rcu_active = FALSE;
+		rcu_start_gp();
+	}
+
+	spinlock_release_noirq(&_rcu_lock);
+}
+
+/* Move the callbacks of the current CORE along, interrupts must be disabled */
+static void rcu_process_callbacks(struct rcu_core *r)
+{
+	struct list *l;
+
+	/* The batch we were waiting for is done, hand it to the RCU thread */
+	if (!LIST_EMPTY(&r->wait) &&
+	    ((int32_t)(_rcu_completed - r->wait_gp) >= 0)) {
+		spinlock_acquire_noirq(&_rcu_done_lock);
+		while (!LIST_EMPTY(&r->wait)) {
+			l = r->wait.next;
+			list_del(l);
+			list_add_tail(l, &_rcu_done);
+		}
+		spinlock_release_noirq(&_rcu_done_lock);
+
+		semaphore_up(&_rcu_done_sem, 1);
+	}
+
+	/* Start waiting for the callbacks queued since. A grace period that
+	 * is already running may have started before they were queued, so
+	 * they have to wait for the next one as well.
+	 */
+	if (LIST_EMPTY(&r->wait) && !LIST_EMPTY(&r->next)) {
+		while (!LIST_EMPTY(&r->next)) {
+			l = r->next.next;
+			list_del(l);
+			list_add_tail(l, &r->wait);
+		}
+
+		spinlock_acquire_noirq(&_rcu_lock);
+		r->wait_gp = _rcu_completed + (_rcu_active ? 2 : 1);
+		if ((int32_t)(r->wait_gp - _rcu_needed) > 0) {
+			_rcu_needed = r->wait_gp;
+		}
+		rcu_start_gp();
+		spinlock_release_noirq(&_rcu_lock);
+	}
+}
+
+/**
+ * Called from the timer tick. An interrupted thread that is not in a
+ * read-side critical section is in a quiescent state.
+ */
+void rcu_tick()
+{
+	if (!_rcu_ready || !CURR_THREAD) {
+		return;
+	}
+
+	if (!CURR_THREAD->rcu_nesting) {
+		rcu_note_qs();
+	}
+
+	rcu_process_callbacks(&CURR_CORE->rcu);
+}
+
+/**
+ * Leaving the outermost read-side critical section, switch if a preemption
+ * was held off by it
+ */
+void rcu_read_unlock_slow()
+{
+	if (local_irq_state()) {
+		sched_preempt();
+	}
+}
+
+/**
+ * Queue a callback to run after all the read-side critical sections that
+ * are in progress now have finished. The callback runs in thread context.
+ */
+void call_rcu(struct rcu_head *head, rcu_func_t func)
+{
+	boolean_t state;
+
+	head->func = func;
+
+	state = local_irq_disable();
+	list_add_tail(&head->link, &CURR_CORE->rcu.next);
+	local_irq_restore(state);
+}
+
+static void rcu_sync_func(struct rcu_head *head)
+{
+	struct rcu_sync *s;
+
+	s = LIST_ENTRY(head, struct rcu_sync, head);
+	semaphore_up(&s->sem, 1);
+}
+
+/**
+ * Wait until all the read-side critical sections in progress have finished
+ */
+void synchronize_rcu()
+{
+	struct rcu_sync s;
+
+	/* Before the RCU thread runs there is only the boot thread */
+	if (!_rcu_ready) {
+		return;
+	}
+
+	ASSERT(!CURR_THREAD->rcu_nesting);
+
+	semaphore_init(&s.sem, "rcu-sync-sem", 0);
+	call_rcu(&s.head, rcu_sync_func);
+	semaphore_down(&s.sem);
+}
+
+static void rcu_thread(void *ctx)
+{
+	struct list batch;
+	struct rcu_head *head;
+	struct list *l;
+
+	UNUSED(ctx);
+
+	while (TRUE) {
+		semaphore_down(&_rcu_done_sem);
+
+		LIST_INIT(&batch);
+		spinlock_acquire(&_rcu_done_lock);
+		while (!LIST_EMPTY(&_rcu_done)) {
+			l = _rcu_done.next;
+			list_del(l);
+			list_add_tail(l, &batch);
+		}
+		spinlock_release(&_rcu_done_lock);
+
+		while (!LIST_EMPTY(&batch)) {
+			l = batch.next;
+			list_del(l);
+			head = LIST_ENTRY(l, struct rcu_head, link);
+			head->func(head);
+		}
+	}
+}
+
+void rcu_core_init(struct rcu_core *r)
+{
+	LIST_INIT(&r->next);
+	LIST_INIT(&r->wait);
+	r->wait_gp = 0;
+}
+
+void init_rcu()
+{
+	int rc = -1;
+
+	spinlock_init(&_rcu_done_lock, "rcu-done-lock");
+	semaphore_init(&_rcu_done_sem, "rcu-done-sem", 0);
+
+	/* Create kernel mode thread to run the RCU callbacks */
+	rc = thread_create("rcu", NULL, 0, rcu_thread, NULL, NULL);
+	ASSERT(rc == 0);
+
+	_rcu_ready = TRUE;
+
+	DEBUG(DL_DBG, ("RCU initialization done.\n"));
+}
@@ -0,0 +1,179 @@
+#include <types.h>
+#include <stddef.h>
+#include "matrix/matrix.h"
+#include "barrier.h"
+#include "debug.h"
+#include "hal/hal.h"
+#include "hal/core.h"
+#include "proc/thread.h"
+#include "rwlock.h"
+
+void rwlock_read_acquire(struct rwlock *l)
+{
+	spinlock_acquire(&l->lock);
+
+	/* Let a waiting writer go first so writers do not starve */
+	if (!l->writer && wait_queue_empty(&l->write_waiters)) {
+		l->readers++;
+		spinlock_release(&l->lock);
+		return;
+	}
+
+	/* The releasing writer will count us as a reader before waking us */
+	wait_queue_sleep(&l->read_waiters, &l->lock, -1, 0);
+}
+
+/* Hand the lock over to the waiters, must be called with the lock held */
+static void rwlock_wake_waiters(struct rwlock *l)
+{
+	if (!wait_queue_empty(&l->write_waiters)) {
+		l->writer = TRUE;
+		wait_queue_wake_one(&l->write_waiters);
+		return;
+	}
+
+	/* No writer waiting, let all the readers in */
+	l->readers += wait_queue_wake_all(&l->read_waiters);
+}
+
+void rwlock_read_release(struct rwlock *l)
+{
+	spinlock_acquire(&l->lock);
+
+	if (l->readers <= 0) {
+		PANIC("Release of rwlock not held for reading");
+	}
+
+	l->readers--;
+	if (!l->readers) {
+		rwlock_wake_waiters(l);
+	}
+
+	spinlock_release(&l->lock);
+}
+
+void rwlock_write_acquire(struct rwlock *l)
+{
+	spinlock_acquire(&l->lock);
+
+	if (!l->writer && !l->readers) {
+		l->writer = TRUE;
+		spinlock_release(&l->lock);
+		return;
+	}
+
+	/* The releasing side marks us as the writer before waking us */
+	wait_queue_sleep(&l->write_waiters, &l->lock, -1, WAIT_EXCLUSIVE);
+}
+
+void rwlock_write_release(struct rwlock *l)
+{
+	spinlock_acquire(&l->lock);
+
+	if (!l->writer) {
+		PANIC("Release of rwlock not held for writing");
+	}
+
+	l->writer = FALSE;
+	rwlock_wake_waiters(l);
+
+	spinlock_release(&l->lock);
+}
+
+void rwlock_init(struct rwlock *l, const char *name)
+{
+	spinlock_init(&l->lock, "rwlock-lock");
+	l->readers = 0;
+	l->writer = FALSE;
+	wait_queue_init(&l->read_waiters, name, 0);
+	wait_queue_init(&l->write_waiters, name, 0);
+	l->name = name;
+}
+
+static INLINE struct rwspin_slot *rwspin_slot(struct rwspinlock *l)
+{
+	ASSERT(CURR_CORE->id < RWSPIN_NR_SLOTS);
+	return &l->slots[CURR_CORE->id];
+}
+
+void rwspin_read_acquire(struct rwspinlock *l)
+{
+	struct rwspin_slot *s;
+	boolean_t state;
+
+	state = local_irq_disable();
+	s = rwspin_slot(l);
+
+	while (TRUE) {
+		/* A nested reader must not wait for a writer that is itself
+		 * waiting for the outer reader.
+		 */
+		if (atomic_inc(&s->readers) > 0) {
+			break;
+		}
+
+		if (!l->writer) {
+			s->state = state;
+			break;
+		}
+
+		/* A writer is in, back off until it is done */
+		atomic_dec(&s->readers);
+		while (l->writer) {
+			core_spin_hint();
+		}
+	}
+
+	enter_cs_barrier();
+}
+
+void rwspin_read_release(struct rwspinlock *l)
+{
+	struct rwspin_slot *s;
+	boolean_t state;
+
+	s = rwspin_slot(l);
+	state = s->state;
+
+	leave_cs_barrier();
+	if (atomic_dec(&s->readers) == 1) {
+		local_irq_restore(state);
+	}
+}
+
+void rwspin_write_acquire(struct rwspinlock *l)
+{
+	int i;
+
+	spinlock_acquire(&l->wlock);
+
+	/* Stop new readers, then wait for the ones inside to drain */
+	atomic_xchg(&l->writer, TRUE);
+	for (i = 0; i < RWSPIN_NR_SLOTS; i++) {
+		while (l->slots[i].readers) {
+			core_spin_hint();
+		}
+	}
+
+	enter_cs_barrier();
+}
+
+void rwspin_write_release(struct rwspinlock *l)
+{
+	leave_cs_barrier();
+	l->writer = FALSE;
+	spinlock_release(&l->wlock);
+}
+
+void rwspin_init(struct rwspinlock *l, const char *name)
+{
+	int i;
+
+	spinlock_init(&l->wlock, "rwspin-wlock");
+	l->writer = FALSE;
+	for (i = 0; i < RWSPIN_NR_SLOTS; i++) {
+		l->slots[i].readers = 0;
+		l->slots[i].state = FALSE;
+	}
+	l->name = name;
+}
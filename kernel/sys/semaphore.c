@@ -5,7 +5,12 @@
 #include "semaphore.h"
 #include "debug.h"
 
-void semaphore_down(struct semaphore *s)
+/**
+ * Take a count from a semaphore, waiting at most timeout microseconds for
+ * one to become available. A timeout of -1 waits forever.
+ * @return		- 0 if a count was taken, -1 if timed out
+ */
+int semaphore_down_timeout(struct semaphore *s, useconds_t timeout)
 {
 	DEBUG(DL_DBG, ("sem(%s) count(%d).\n", s->name, s->count));
 	
@@ -14,36 +19,43 @@ void semaphore_down(struct semaphore *s)
 	if (s->count) {
 		--(s->count);
 		spinlock_release(&s->lock);
-		return;
+		return 0;
 	}
 
-	list_add_tail(&CURR_THREAD->wait_link, &s->threads);
+	/* The thread waking us hands its count over to us */
 	DEBUG(DL_DBG, ("sem(%s) put thread(%s:%d) to wait list.\n",
 		       s->name, CURR_THREAD->name, CURR_THREAD->id));
-	thread_sleep(&s->lock, -1, s->name, 0);
+	return wait_queue_sleep(&s->wait, &s->lock, timeout, WAIT_EXCLUSIVE);
+}
+
+void semaphore_down(struct semaphore *s)
+{
+	semaphore_down_timeout(s, -1);
 }
 
+/**
+ * Take a count from a semaphore if one is available, never sleeps
+ * @return		- 0 if a count was taken, -1 otherwise
+ */
+int semaphore_trydown(struct semaphore *s)
+{
+	return semaphore_down_timeout(s, 0);
+}
+
+/**
+ * Give count counts back to a semaphore. The waiters are handed their
+ * count directly and woken up as one batch.
+ */
 void semaphore_up(struct semaphore *s, size_t count)
 {
-	struct thread *t;
-	struct list *l;
-	size_t i;
+	size_t woken;
 
 	DEBUG(DL_DBG, ("sem(%s) count(%d).\n", s->name, s->count));
 	
 	spinlock_acquire(&s->lock);
 
-	for (i = 0; i < count; i++) {
-		if (LIST_EMPTY(&s->threads)) {
-			s->count++;
-		} else {
-			l = s->threads.next;
-			t = LIST_ENTRY(l, struct thread, wait_link);
-			DEBUG(DL_DBG, ("sem(%s) waking up thread(%s:%d).\n",
-				       s->name, t->name, t->id));
-			thread_wake(t);
-		}
-	}
+	woken = wait_queue_wake(&s->wait, count);
+	s->count += count - woken;
 
 	spinlock_release(&s->lock);
 }
@@ -51,7 +63,7 @@ void semaphore_up(struct semaphore *s, size_t count)
 void semaphore_init(struct semaphore *s, const char *name, size_t initial)
 {
 	spinlock_init(&s->lock, "sem-lock");
-	LIST_INIT(&s->threads);
+	wait_queue_init(&s->wait, name, 0);
 	s->count = initial;
 	s->name = name;
 }
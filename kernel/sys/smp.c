@@ -3,6 +3,8 @@
 #include <string.h>
 #include "debug.h"
 #include "list.h"
+#include "atomic.h"
+#include "barrier.h"
 #include "hal/hal.h"
 #include "hal/core.h"
 #include "hal/lapic.h"
@@ -16,22 +18,29 @@
 
 #define SMP_CALLS_PER_CORE	4
 
+/* Microseconds to wait for an AC to reach kmain_ac() */
+#define SMP_BOOT_TIMEOUT	1000000
+
+/* Microseconds to wait for the ACs to complete their initialization */
+#define SMP_INIT_TIMEOUT	5000000
+
 /* SMP call information */
 struct smp_call {
-	struct list link;	// Link to the destination CORE's call queue
-	struct smp_call *next;	// Pointer to the next structure in the free pool
+	struct smp_call *next;	// Next call in the CORE's queue or the free pool
 
 	smp_call_func_t func;	// Handler function
 	void *ctx;		// Argument to handler
+	int flags;		// Flags for the call
 	
 	int status;		// Status code function returned
-	int ref_count;		// Reference count
+	volatile boolean_t done;// Set once the call has completed
 };
 
 /* Page reserved to copy the AC bootstrap code to */
 static phys_addr_t _ac_bootstrap_page = 0;
 
 static struct smp_call *_smp_call_pool = NULL;
+static struct spinlock _smp_call_lock;
 static boolean_t _smp_call_enabled = FALSE;
 
 /* Variable used to synchronize the stages of the SMP boot process */
@@ -67,45 +76,40 @@ void arch_smp_boot_prepare()
 static boolean_t boot_core_and_wait(core_id_t id)
 {
 	boolean_t ret = FALSE;
-	//useconds_t delay = 0;
-	
-	/* Send an INIT IPI to the AC to reset its state and delay 10ms */
-	lapic_ipi(LAPIC_IPI_DEST_SINGLE, id, LAPIC_IPI_INIT, 0x00);
-	spin(10000);
+	useconds_t delay = 0;
 
 	/* Send a Start-up IPI. The vector argument specifies where to look
 	 * for the bootstrap code. As the SIPI will start execution from 0x000VV000,
 	 * where VV is the vector specified in the IPI.
 	 */
 	lapic_ipi(LAPIC_IPI_DEST_SINGLE, id, LAPIC_IPI_SIPI, _ac_bootstrap_page >> 12);
-	spin(10000);
-
-	/* If the CORE is up then return */
-	if (_smp_boot_status > SMP_BOOT_INIT) {
-		ret = TRUE;
-		goto out;
-	}
+	spin(200);
 
-	/* Sends a second Start-up IPI and then check in 10ms intervals to
-	 * see if it has booted. If it hasn't booted after 5 seconds, fail.
+	/* Sends a second Start-up IPI if the CORE is not up yet as the MP
+	 * specification says, an AC that already started ignores it.
 	 */
-	/* lapic_ipi(LAPIC_IPI_DEST_SINGLE, id, LAPIC_IPI_SIPI, _ac_bootstrap_page >> 12); */
-	/* for (delay = 0; delay < 500000; delay += 10000) { */
-	/* 	if (_smp_boot_status > SMP_BOOT_INIT) { */
-	/* 		ret = TRUE; */
-	/* 		goto out; */
-	/* 	} */
-	/* 	spin(10000); */
-	/* } */
+	if (_smp_boot_status == SMP_BOOT_INIT) {
+		lapic_ipi(LAPIC_IPI_DEST_SINGLE, id, LAPIC_IPI_SIPI,
+			  _ac_bootstrap_page >> 12);
+	}
 
-	ret = TRUE;
+	/* Check in 100us intervals to see if it has booted */
+	for (delay = 0; delay < SMP_BOOT_TIMEOUT; delay += 100) {
+		if (_smp_boot_status > SMP_BOOT_INIT) {
+			ret = TRUE;
+			break;
+		}
+		spin(100);
+	}
 
- out:
 	return ret;
 }
 
-void arch_smp_boot_core(struct core *c)
+boolean_t arch_smp_boot_core(struct core *c)
 {
+	boolean_t ret = FALSE;
+	void *mapping;
+
 	kprintf("smp: booting CORE %d...\n", c->id);
 	ASSERT(lapic_enabled());
 
@@ -117,22 +121,41 @@ void arch_smp_boot_core(struct core *c)
 	ASSERT(c->arch.double_fault_stack != NULL);
 
 	/* Fill in details required by the bootstrap code */
-	/* (*(uint32_t *)(mapping + 16)) = (ptr_t)kmain_ac; */
-	/* (*(uint32_t *)(mapping + 20)) = (ptr_t)c; */
-	/* (*(uint32_t *)(mapping + 24)) = (ptr_t)c->arch.double_fault_stack + KSTACK_SIZE; */
-	/* (*(uint32_t *)(mapping + 28)) = (ptr_t)_ac_mmu_ctx->pdbr; */
+	mapping = (void *)_ac_bootstrap_page;
+	(*(uint32_t *)(mapping + 16)) = (ptr_t)kmain_ac;
+	(*(uint32_t *)(mapping + 20)) = (ptr_t)c;
+	(*(uint32_t *)(mapping + 24)) = (ptr_t)c->arch.double_fault_stack + KSTACK_SIZE;
+	(*(uint32_t *)(mapping + 28)) = (ptr_t)_kernel_mmu_ctx.pdbr;
+
+	_smp_boot_status = SMP_BOOT_INIT;
 
 	/* Wakeup the CORE */
 	if (!boot_core_and_wait(c->id)) {
 		DEBUG(DL_ERR, ("boot CORE %d failed.\n", c->id));
+
+		/* Put it back to sleep, it must not start late on the
+		 * parameters of the next CORE.
+		 */
+		lapic_ipi(LAPIC_IPI_DEST_SINGLE, c->id, LAPIC_IPI_INIT, 0x00);
+		kmem_free(c->arch.double_fault_stack);
+		c->arch.double_fault_stack = NULL;
 		goto out;
 	}
 
 	/* Sync the TSC of the AC with the boot CORE */
 	tsc_init_source();
 
+	/* Wait for the AC to get on the running COREs list, it then does the
+	 * rest of its initialization on its own.
+	 */
+	while (_smp_boot_status != SMP_BOOT_BOOTED) {
+		core_spin_hint();
+	}
+
+	ret = TRUE;
+
  out:
-	return;
+	return ret;
 }
 
 void arch_smp_boot_cleanup()
@@ -140,30 +163,288 @@ void arch_smp_boot_cleanup()
 	/* Free the bootstrap page */
 }
 
+/**
+ * Boot all the application COREs. The INIT delay is taken once for all
+ * of them, and each AC only holds the boot CORE up until it has synced
+ * its TSC, the rest of its initialization overlaps with the boot of the
+ * next one.
+ */
 void smp_boot_cores()
 {
 	core_id_t i;
 	boolean_t state;
+	size_t booted = 0, running;
+	useconds_t delay;
+
+	if (_nr_cores == 1) {
+		return;
+	}
 
 	state = local_irq_disable();
 	arch_smp_boot_prepare();
 
+	/* Send an INIT IPI to the ACs to reset their state and delay 10ms */
 	for (i = 0; i <= _highest_core_id; i++) {
 		if (_cores[i] && _cores[i]->state == CORE_OFFLINE) {
-			arch_smp_boot_core(_cores[i]);
+			lapic_ipi(LAPIC_IPI_DEST_SINGLE, i, LAPIC_IPI_INIT, 0x00);
 		}
 	}
+	spin(10000);
+
+	for (i = 0; i <= _highest_core_id; i++) {
+		if (_cores[i] && _cores[i]->state == CORE_OFFLINE) {
+			if (arch_smp_boot_core(_cores[i])) {
+				booted++;
+			} else {
+				_nr_cores--;
+			}
+		}
+	}
+
+	/* Wait for the ACs to complete their initialization */
+	for (delay = 0; delay < SMP_INIT_TIMEOUT; delay += 1000) {
+		running = 0;
+		for (i = 0; i <= _highest_core_id; i++) {
+			if (_cores[i] && (_cores[i] != &_boot_core) &&
+			    (_cores[i]->state == CORE_RUNNING)) {
+				running++;
+			}
+		}
+		if (running == booted) {
+			break;
+		}
+		spin(1000);
+	}
+
+	if (running != booted) {
+		PANIC("AC initialization timed out");
+	}
+
+	/* Let them enter the scheduler */
+	_smp_boot_status = SMP_BOOT_COMPLETE;
 
 	arch_smp_boot_cleanup();
 
 	local_irq_restore(state);
+
+	kprintf("smp: %d COREs running.\n", booted + 1);
 }
 
+static void smp_call_free(struct smp_call *call)
+{
+	spinlock_acquire(&_smp_call_lock);
+	call->next = _smp_call_pool;
+	_smp_call_pool = call;
+	spinlock_release(&_smp_call_lock);
+}
+
+/**
+ * Run the calls queued on the current CORE. The queue is taken over as a
+ * whole, so all the calls queued behind a single IPI get run.
+ */
+static void smp_call_process()
+{
+	struct smp_call *call, *next, *prev = NULL;
+	int status;
+
+	call = (struct smp_call *)atomic_xchg((atomic_t *)&CURR_CORE->calls, 0);
+
+	/* The queue is a stack, reverse it to run the calls in order */
+	while (call) {
+		next = call->next;
+		call->next = prev;
+		prev = call;
+		call = next;
+	}
+
+	for (call = prev; call; call = next) {
+		/* The caller may free a synchronous call once it is done */
+		next = call->next;
+		status = call->func(call->ctx);
+
+		if (FLAG_ON(call->flags, SMP_CALL_ASYNC)) {
+			smp_call_free(call);
+		} else {
+			call->status = status;
+			leave_cs_barrier();
+			call->done = TRUE;
+		}
+	}
+}
+
+/**
+ * Get a call structure from the pool. If it ran dry, the calls in flight
+ * free theirs, we run ours meanwhile in case somebody is waiting on us.
+ */
+static struct smp_call *smp_call_alloc()
+{
+	struct smp_call *call;
+
+	while (TRUE) {
+		spinlock_acquire(&_smp_call_lock);
+		call = _smp_call_pool;
+		if (call) {
+			_smp_call_pool = call->next;
+		}
+		spinlock_release(&_smp_call_lock);
+
+		if (call) {
+			break;
+		}
+
+		smp_call_process();
+		core_spin_hint();
+	}
+
+	return call;
+}
+
+/**
+ * Push a call onto the queue of a CORE. An IPI is only sent if the queue
+ * was empty, otherwise one is already on its way and the target runs our
+ * call along with the ones before it.
+ */
+static void smp_call_queue(struct core *c, struct smp_call *call)
+{
+	struct smp_call *head;
+
+	do {
+		head = c->calls;
+		call->next = head;
+	} while (!__sync_bool_compare_and_swap(&c->calls, head, call));
+
+	if (!head) {
+		lapic_ipi(LAPIC_IPI_DEST_SINGLE, c->id, LAPIC_IPI_FIXED,
+			  LAPIC_VECT_IPI);
+	}
+}
+
+/**
+ * Wait for a synchronous call to complete. The calls queued on us are run
+ * meanwhile, so that two COREs calling each other do not deadlock.
+ */
+static int smp_call_wait(struct smp_call *call)
+{
+	while (!call->done) {
+		smp_call_process();
+		core_spin_hint();
+	}
+
+	return call->status;
+}
+
+/**
+ * Run a function on a set of COREs. The function is run from the IPI
+ * handler on the other COREs and with interrupts disabled on the current
+ * one, so it must not sleep.
+ * @param mask		- COREs to run the function on
+ * @param flags		- SMP_CALL_ASYNC to return without waiting
+ * @return		- The last non-zero status of the function, always
+ *			  0 for an asynchronous call
+ */
+int smp_call_many(coremask_t mask, smp_call_func_t func, void *ctx,
+		  int flags)
+{
+	int rc = 0, status;
+	boolean_t state;
+	struct smp_call *call;
+	struct smp_call *calls[sizeof(coremask_t) * 8];
+	struct core *c, *curr;
+	struct list *l;
+	core_id_t id;
+
+	memset(calls, 0, sizeof(calls));
+
+	state = local_irq_disable();
+	curr = CURR_CORE;
+
+	/* Queue the calls on all the other COREs first so that they run
+	 * in parallel with ours.
+	 */
+	LIST_FOR_EACH(l, &_running_cores) {
+		c = LIST_ENTRY(l, struct core, link);
+		if ((c == curr) || !(mask & COREMASK_BIT(c->id))) {
+			continue;
+		}
+
+		ASSERT(_smp_call_enabled);
+
+		call = smp_call_alloc();
+		call->func = func;
+		call->ctx = ctx;
+		call->flags = flags;
+		call->status = 0;
+		call->done = FALSE;
+
+		/* An asynchronous call is freed by its target, don't touch
+		 * it once it is queued.
+		 */
+		if (!FLAG_ON(flags, SMP_CALL_ASYNC)) {
+			calls[c->id] = call;
+		}
+
+		smp_call_queue(c, call);
+	}
+
+	if (mask & COREMASK_BIT(curr->id)) {
+		status = func(ctx);
+		if (status != 0) {
+			rc = status;
+		}
+	}
+
+	for (id = 0; id < sizeof(coremask_t) * 8; id++) {
+		if (!calls[id]) {
+			continue;
+		}
+
+		status = smp_call_wait(calls[id]);
+		if (status != 0) {
+			rc = status;
+		}
+		smp_call_free(calls[id]);
+	}
+
+	local_irq_restore(state);
+
+	return rc;
+}
+
+/**
+ * Run a function on a single CORE
+ * @return		- Status of the function, -1 if the CORE is not
+ *			  running
+ */
+int smp_call_single(core_id_t id, smp_call_func_t func, void *ctx, int flags)
+{
+	if ((id > _highest_core_id) || !_cores[id] ||
+	    (_cores[id]->state != CORE_RUNNING)) {
+		DEBUG(DL_INF, ("core(%d) not running.\n", id));
+		return -1;
+	}
+
+	return smp_call_many(COREMASK_BIT(id), func, ctx, flags);
+}
+
+/**
+ * Run a function on all the running COREs, the current one included
+ */
+int smp_call_all(smp_call_func_t func, void *ctx, int flags)
+{
+	return smp_call_many((coremask_t)-1, func, ctx, flags);
+}
+
+/**
+ * Handler for the IPI vector. The vector is shared with the rescheduling
+ * IPI, so there may be nothing queued.
+ */
 void smp_ipi_handler()
 {
-	ASSERT(_smp_call_enabled);
+	if (!_smp_call_enabled) {
+		return;
+	}
 
-	DEBUG(DL_DBG, ("received IPI.\n"));
+	smp_call_process();
 }
 
 void init_smp()
@@ -187,19 +468,16 @@ void init_smp()
 		goto out;
 	}
 	memset(calls, 0, cnt * sizeof(struct smp_call));
+	spinlock_init(&_smp_call_lock, "smp-call-lock");
 
 	/* Initialize each structure and add it to the pool */
 	for (i = 0; i < cnt; i++) {
-		LIST_INIT(&calls[i].link);
 		calls[i].next = _smp_call_pool;
 		_smp_call_pool = &calls[i];
 	}
 
 	_smp_call_enabled = TRUE;
 
-	/* Boot all the application COREs in the system */
-	smp_boot_cores();
-
  out:
 	return;
 }
@@ -0,0 +1,164 @@
+/*
+ * softirq.c
+ */
+#include <types.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "matrix/matrix.h"
+#include "debug.h"
+#include "bitops.h"
+#include "hal/hal.h"
+#include "hal/core.h"
+#include "proc/thread.h"
+#include "proc/sched.h"
+#include "timer.h"
+#include "softirq.h"
+
+/* Rounds of softirqs run on an interrupt exit before the rest is left to
+ * the softirq thread, so that a flood of interrupts cannot starve threads.
+ */
+#define SOFTIRQ_MAX_RESTART	8
+
+static softirq_func_t _softirq_funcs[NR_SOFTIRQS];
+
+/**
+ * Run the pending softirqs of the current CORE with interrupts enabled.
+ * Interrupts must be disabled on entry and are disabled again on return.
+ * @return		- TRUE if softirqs are still pending
+ */
+static boolean_t softirq_do(struct softirq_core *s, int max_restart)
+{
+	uint32_t pending;
+	int nr;
+
+	s->active = TRUE;
+
+	while (s->pending && (max_restart-- > 0)) {
+		pending = s->pending;
+		s->pending = 0;
+
+		local_irq_enable();
+
+		while (pending) {
+			nr = bitops_ffs(pending);
+			pending &= ~(1 << nr);
+			if (_softirq_funcs[nr]) {
+				_softirq_funcs[nr]();
+			}
+		}
+
+		local_irq_disable();
+	}
+
+	s->active = FALSE;
+
+	return s->pending != 0;
+}
+
+void softirq_register(int nr, softirq_func_t func)
+{
+	ASSERT(nr < NR_SOFTIRQS);
+	_softirq_funcs[nr] = func;
+}
+
+/**
+ * Mark a softirq pending on the current CORE. It runs on the way out of the
+ * current interrupt, or soon after if raised from a thread.
+ */
+void softirq_raise(int nr)
+{
+	boolean_t state;
+	struct softirq_core *s;
+
+	state = local_irq_disable();
+
+	s = &CURR_CORE->softirq;
+	s->pending |= (1 << nr);
+
+	/* Outside an interrupt nobody runs them on exit, the thread does */
+	if (state && !s->active && s->thread) {
+		semaphore_up(&s->sem, 1);
+	}
+
+	local_irq_restore(state);
+}
+
+/**
+ * Run the pending softirqs, called at the end of the interrupt handler.
+ * Does nothing if the interrupt came in while softirqs were being run.
+ */
+void softirq_run()
+{
+	struct softirq_core *s;
+
+	ASSERT(!local_irq_state());
+
+	s = &CURR_CORE->softirq;
+	if (!s->pending || s->active) {
+		return;
+	}
+
+	if (softirq_do(s, SOFTIRQ_MAX_RESTART) && s->thread) {
+		/* Still busy, defer the rest to the softirq thread */
+		semaphore_up(&s->sem, 1);
+	}
+}
+
+static void softirq_thread(void *ctx)
+{
+	struct softirq_core *s;
+
+	s = (struct softirq_core *)ctx;
+
+	while (TRUE) {
+		semaphore_down(&s->sem);
+
+		do {
+			local_irq_disable();
+			if (!s->active) {
+				softirq_do(s, SOFTIRQ_MAX_RESTART);
+			}
+			local_irq_enable();
+
+			/* Let the threads readied by the handlers run between
+			 * the rounds.
+			 */
+			sched_preempt();
+		} while (s->pending);
+	}
+}
+
+/* Register the bottom halves of the core kernel */
+void init_softirq()
+{
+	softirq_register(SOFTIRQ_TIMER, timer_tick);
+}
+
+void softirq_core_init(struct softirq_core *s)
+{
+	s->pending = 0;
+	s->active = FALSE;
+	semaphore_init(&s->sem, "softirq-sem", 0);
+	s->thread = NULL;
+}
+
+/**
+ * Create the softirq thread of the current CORE, the thread only runs on
+ * this CORE.
+ */
+void init_softirq_percore()
+{
+	int rc = -1;
+	char name[T_NAME_LEN];
+	struct thread *t;
+
+	snprintf(name, T_NAME_LEN - 1, "softirq-%d", CURR_CORE->id);
+	rc = thread_create(name, NULL, 0, softirq_thread, &CURR_CORE->softirq,
+			   &t);
+	ASSERT(rc == 0);
+
+	t->affinity = COREMASK_BIT(CURR_CORE->id);
+	CURR_CORE->softirq.thread = t;
+	thread_run(t);
+	thread_release(t);
+}
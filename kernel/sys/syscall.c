@@ -10,10 +10,13 @@
 #include "hal/isr.h"
 #include "mm/malloc.h"
 #include "mm/slab.h"
+#include "mm/mlayout.h"
+#include "mm/va.h"
 #include "util.h"
 #include "dirent.h"
 #include "sys/stat.h"
 #include "proc/process.h"
+#include "proc/sched.h"
 #include "div64.h"
 #include "debug.h"
 #include "fd.h"
@@ -22,6 +25,8 @@
 #include "pit.h"
 #include "platform.h"
 #include "module.h"
+#include "futex.h"
+#include "timekeeping.h"
 
 #define MAX_HOSTNAME_LEN	256
 #define NR_SYSCALLS		(sizeof(_syscalls)/sizeof(_syscalls[0]))
@@ -133,24 +138,47 @@ int sys_write(int fd, char *buf, int len)
 
 int sys_gettimeofday(struct timeval *tv, struct timezone *tz)
 {
-	struct tm t;
-	useconds_t usecs;
+	uint64_t ns;
+	uint32_t rem;
 
-	get_cmostime(&t);
-	tv->tv_sec = 0;
-	tv->tv_usec = 0;
-
-	usecs = time_to_unix(t.tm_year, t.tm_mon, t.tm_mday,
-			     t.tm_hour, t.tm_min, t.tm_sec);
-	do_div(usecs, 1000000);
-	tv->tv_sec = usecs;
-	tv->tv_usec = 0;
+	ns = ktime_get_real_ns();
+	rem = do_div(ns, NSECS_PER_SEC);
+	tv->tv_sec = ns;
+	tv->tv_usec = rem / NSECS_PER_USEC;
 	
 	return 0;
 }
 
 int sys_settimeofday(const struct timeval *tv, const struct timezone *tz)
 {
+	if (!tv || (tv->tv_sec < 0) || (tv->tv_usec < 0) ||
+	    (tv->tv_usec >= 1000000)) {
+		return -1;
+	}
+
+	ktime_set_real_ns((uint64_t)tv->tv_sec * NSECS_PER_SEC +
+			  (uint64_t)tv->tv_usec * NSECS_PER_USEC);
+
+	return 0;
+}
+
+int sys_clock_gettime(int id, struct timespec *ts)
+{
+	int rc;
+	uint64_t ns;
+
+	if (!ts) {
+		return -1;
+	}
+
+	rc = clock_gettime_ns(id, &ns);
+	if (rc != 0) {
+		return -1;
+	}
+
+	ts->tv_nsec = do_div(ns, NSECS_PER_SEC);
+	ts->tv_sec = ns;
+
 	return 0;
 }
 
@@ -376,13 +404,81 @@ int sys_getpid()
 	return process_getid();
 }
 
-int sys_sleep(uint32_t ms)
+/**
+ * Sleep until sys_time() reaches the deadline, giving up the CORE meanwhile.
+ * The sleep is cut short by a signal, thread_sleep() checks for one under
+ * the thread lock so a signal posted after the check below is not missed.
+ * @return		- 0 once the deadline passed, -1 if interrupted
+ */
+static int sleep_until(useconds_t deadline)
 {
-	timer_delay(ms);
+	useconds_t now;
+
+	while (TRUE) {
+		if (signal_pending(CURR_THREAD)) {
+			return -1;
+		}
+
+		now = sys_time();
+		if (now >= deadline) {
+			break;
+		}
+
+		thread_sleep(NULL, deadline - now, "nanosleep",
+			     THREAD_INTERRUPTIBLE);
+	}
 
 	return 0;
 }
 
+int sys_sleep(uint32_t ms)
+{
+	return sleep_until(sys_time() + (useconds_t)ms * 1000);
+}
+
+int sys_clock_nanosleep(int id, int flags, const struct timespec *req,
+			struct timespec *rem)
+{
+	int rc = -1;
+	useconds_t now, deadline, left;
+	uint64_t real;
+
+	if ((id != CLOCK_REALTIME) && (id != CLOCK_MONOTONIC)) {
+		goto out;
+	}
+
+	if (!req || (req->tv_sec < 0) || (req->tv_nsec < 0) ||
+	    (req->tv_nsec >= 1000000000)) {
+		goto out;
+	}
+
+	/* Round up, the sleep never ends before the requested time */
+	deadline = SECS2USECS(req->tv_sec) + (req->tv_nsec + 999) / 1000;
+
+	now = sys_time();
+	if (!FLAG_ON(flags, TIMER_ABSTIME)) {
+		deadline += now;
+	} else if (id == CLOCK_REALTIME) {
+		/* Move the deadline over to the clock we sleep on */
+		real = ktime_get_real_ns();
+		do_div(real, NSECS_PER_USEC);
+		deadline = deadline - (useconds_t)real + now;
+	}
+
+	rc = sleep_until(deadline);
+
+	/* Only a relative sleep reports the time it has left */
+	if ((rc != 0) && rem && !FLAG_ON(flags, TIMER_ABSTIME)) {
+		now = sys_time();
+		left = (deadline > now) ? (deadline - now) : 0;
+		rem->tv_nsec = do_div(left, 1000000) * 1000;
+		rem->tv_sec = left;
+	}
+
+ out:
+	return rc;
+}
+
 static char **alloc_args(const char *argv[])
 {
 	char **ret = NULL;
@@ -458,7 +554,7 @@ int sys_create_process(const char *path, const char *args[], int flags, int prio
 int sys_waitpid(int pid)
 {
 	int rc = -1;
-	struct process *proc;
+	struct process *proc = NULL;
 	struct semaphore s;
 	
 	if (pid < 1) {
@@ -489,6 +585,9 @@ int sys_waitpid(int pid)
 	rc = proc->status;
 
  out:
+	if (proc) {
+		process_release(proc);
+	}
 	return rc;
 }
 
@@ -626,6 +725,359 @@ int sys_ioctl(int d, int request, void *input, void *output)
 	return rc;
 }
 
+int sys_sched_setaffinity(int pid, coremask_t mask)
+{
+	int rc = -1;
+	struct process *p;
+	struct thread *t;
+	struct list *l;
+
+	p = process_lookup(pid ? pid : CURR_PROC->id);
+	if (!p) {
+		DEBUG(DL_DBG, ("pid(%d) not found in process tree.\n", pid));
+		goto out;
+	}
+	if (p == _kernel_proc) {
+		goto out;
+	}
+
+	/* Only the super user may move other processes around */
+	if ((CURR_PROC->uid != 0) && (p != CURR_PROC)) {
+		DEBUG(DL_DBG, ("uid(%d) not permitted.\n", CURR_PROC->uid));
+		goto out;
+	}
+
+	/* Setting a mask with an online CORE on a thread can't fail, so the
+	 * process and its threads never end up with different masks.
+	 */
+	if (!(mask & sched_online_cores())) {
+		goto out;
+	}
+
+	spinlock_acquire(&p->lock);
+
+	/* New threads of the process inherit the mask */
+	p->affinity = mask;
+
+	LIST_FOR_EACH(l, &p->threads) {
+		t = LIST_ENTRY(l, struct thread, owner_link);
+		rc = sched_set_affinity(t, mask);
+		ASSERT(rc == 0);
+	}
+
+	spinlock_release(&p->lock);
+	rc = 0;
+
+ out:
+	if (p) {
+		process_release(p);
+	}
+	return rc;
+}
+
+int sys_sched_getaffinity(int pid, coremask_t *mask)
+{
+	int rc = -1;
+	struct process *p;
+
+	if (!mask) {
+		goto out;
+	}
+
+	p = process_lookup(pid ? pid : CURR_PROC->id);
+	if (!p) {
+		DEBUG(DL_DBG, ("pid(%d) not found in process tree.\n", pid));
+		goto out;
+	}
+
+	*mask = p->affinity;
+	process_release(p);
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+int sys_thread_setaffinity(int tid, coremask_t mask)
+{
+	int rc = -1;
+	struct thread *t = NULL;
+
+	t = thread_lookup(tid ? tid : CURR_THREAD->id);
+	if (!t || (t->owner == _kernel_proc)) {
+		DEBUG(DL_DBG, ("tid(%d) not found in thread tree.\n", tid));
+		goto out;
+	}
+
+	/* Only the super user may move threads of other processes */
+	if ((CURR_PROC->uid != 0) && (t->owner != CURR_PROC)) {
+		DEBUG(DL_DBG, ("uid(%d) not permitted.\n", CURR_PROC->uid));
+		goto out;
+	}
+
+	rc = sched_set_affinity(t, mask);
+
+ out:
+	if (t) {
+		thread_release(t);
+	}
+	return rc;
+}
+
+int sys_thread_settimerslack(int tid, uint32_t slack)
+{
+	int rc = -1;
+	struct thread *t = NULL;
+
+	t = thread_lookup(tid ? tid : CURR_THREAD->id);
+	if (!t || (t->owner == _kernel_proc)) {
+		DEBUG(DL_DBG, ("tid(%d) not found in thread tree.\n", tid));
+		goto out;
+	}
+
+	/* Only the super user may change threads of other processes */
+	if ((CURR_PROC->uid != 0) && (t->owner != CURR_PROC)) {
+		DEBUG(DL_DBG, ("uid(%d) not permitted.\n", CURR_PROC->uid));
+		goto out;
+	}
+
+	/* The slack is read when the thread starts a sleep */
+	spinlock_acquire(&t->lock);
+	t->timer_slack = slack;
+	spinlock_release(&t->lock);
+	rc = 0;
+
+ out:
+	if (t) {
+		thread_release(t);
+	}
+	return rc;
+}
+
+int sys_thread_gettimerslack(int tid, uint32_t *slack)
+{
+	int rc = -1;
+	struct thread *t = NULL;
+
+	if (!slack) {
+		goto out;
+	}
+
+	t = thread_lookup(tid ? tid : CURR_THREAD->id);
+	if (!t) {
+		DEBUG(DL_DBG, ("tid(%d) not found in thread tree.\n", tid));
+		goto out;
+	}
+
+	*slack = (uint32_t)t->timer_slack;
+	rc = 0;
+
+ out:
+	if (t) {
+		thread_release(t);
+	}
+	return rc;
+}
+
+int sys_thread_getaffinity(int tid, coremask_t *mask)
+{
+	int rc = -1;
+	struct thread *t = NULL;
+
+	if (!mask) {
+		goto out;
+	}
+
+	t = thread_lookup(tid ? tid : CURR_THREAD->id);
+	if (!t) {
+		DEBUG(DL_DBG, ("tid(%d) not found in thread tree.\n", tid));
+		goto out;
+	}
+
+	*mask = t->affinity;
+	rc = 0;
+
+ out:
+	if (t) {
+		thread_release(t);
+	}
+	return rc;
+}
+
+int sys_sched_setscheduler(int tid, int policy, int priority)
+{
+	int rc = -1;
+	struct thread *t = NULL;
+
+	t = thread_lookup(tid ? tid : CURR_THREAD->id);
+	if (!t || (t->owner == _kernel_proc)) {
+		DEBUG(DL_DBG, ("tid(%d) not found in thread tree.\n", tid));
+		goto out;
+	}
+
+	/* Only the super user may run threads of other processes or at a
+	 * real-time priority, which starves every time sharing thread.
+	 */
+	if (CURR_PROC->uid != 0) {
+		if ((t->owner != CURR_PROC) || (policy != SCHED_OTHER)) {
+			DEBUG(DL_DBG, ("uid(%d) not permitted.\n", CURR_PROC->uid));
+			goto out;
+		}
+	}
+
+	rc = sched_set_policy(t, policy, priority);
+
+ out:
+	if (t) {
+		thread_release(t);
+	}
+	return rc;
+}
+
+int sys_sched_getscheduler(int tid, int *priority)
+{
+	int rc = -1;
+	struct thread *t = NULL;
+
+	t = thread_lookup(tid ? tid : CURR_THREAD->id);
+	if (!t) {
+		DEBUG(DL_DBG, ("tid(%d) not found in thread tree.\n", tid));
+		goto out;
+	}
+
+	if (priority) {
+		*priority = (t->policy == SCHED_OTHER) ?
+			t->priority : t->rt_priority;
+	}
+	rc = t->policy;
+
+ out:
+	if (t) {
+		thread_release(t);
+	}
+	return rc;
+}
+
+int sys_sched_core_stats(int core, struct sched_core_stats *stats)
+{
+	int rc = -1;
+	struct sched_core_stats s;
+
+	if (!stats || (core < 0)) {
+		goto out;
+	}
+
+	/* Fill a copy under the scheduler lock, the user buffer may fault */
+	rc = sched_core_stats(core, &s);
+	if (rc == 0) {
+		memcpy(stats, &s, sizeof(s));
+	}
+
+ out:
+	return rc;
+}
+
+int sys_sched_thread_stats(int tid, struct sched_thread_stats *stats)
+{
+	int rc = -1;
+	struct thread *t = NULL;
+	struct sched_thread_stats s;
+
+	if (!stats) {
+		goto out;
+	}
+
+	t = thread_lookup(tid ? tid : CURR_THREAD->id);
+	if (!t) {
+		DEBUG(DL_DBG, ("tid(%d) not found in thread tree.\n", tid));
+		goto out;
+	}
+
+	sched_thread_stats(t, &s);
+	memcpy(stats, &s, sizeof(s));
+	rc = 0;
+
+ out:
+	if (t) {
+		thread_release(t);
+	}
+	return rc;
+}
+
+int sys_thread_create(ptr_t entry, void *args, int *tidp)
+{
+	int rc = -1;
+	ptr_t ustack = 0;
+	struct thread *t = NULL;
+	struct thread_uspace_creation *info = NULL;
+
+	if (!entry || (entry >= KERNEL_KMEM_START)) {
+		DEBUG(DL_DBG, ("invalid entry(%p).\n", entry));
+		goto out;
+	}
+
+	info = kmalloc(sizeof(struct thread_uspace_creation), 0);
+	if (!info) {
+		DEBUG(DL_INF, ("allocate creation info failed.\n"));
+		goto out;
+	}
+
+	/* Give the new thread a stack of its own in our address space */
+	ustack = process_ustack_alloc(CURR_PROC);
+	if (!ustack) {
+		DEBUG(DL_DBG, ("allocate ustack failed.\n"));
+		goto out;
+	}
+
+	info->entry = entry;
+	info->esp = ustack + USTACK_SIZE;
+	info->args = (ptr_t)args;
+
+	rc = thread_create("uthread", CURR_PROC, 0, thread_uspace_wrapper,
+			   info, &t);
+	if (rc != 0) {
+		DEBUG(DL_INF, ("thread_create failed, err(%x).\n", rc));
+		goto out;
+	}
+
+	/* The stack is unmapped by thread_exit() */
+	t->ustack = (void *)ustack;
+	t->ustack_size = USTACK_SIZE;
+	rc = t->id;
+
+	if (tidp) {
+		*tidp = t->id;
+	}
+
+	thread_run(t);
+	thread_release(t);
+
+ out:
+	if (rc < 0) {
+		if (ustack) {
+			va_unmap(CURR_PROC->vas, ustack, USTACK_SIZE);
+			process_ustack_free(CURR_PROC, ustack);
+		}
+		if (info) {
+			kfree(info);
+		}
+	}
+	
+	return rc;
+}
+
+int sys_thread_exit(int status)
+{
+	CURR_THREAD->status = status;
+	thread_exit();
+	return status;
+}
+
+int sys_thread_join(int tid, int *status)
+{
+	return thread_join(tid, status);
+}
+
 /*
  * NOTE: When adding a system call, please add the following items:
  *   [1] _syscalls - the array which contains pointers to the system calls
@@ -668,6 +1120,22 @@ static void *_syscalls[] = {
 	sys_query_module,
 	sys_delete_module,
 	sys_ioctl,
+	sys_sched_setaffinity,
+	sys_sched_getaffinity,
+	sys_thread_setaffinity,
+	sys_thread_getaffinity,
+	sys_sched_setscheduler,
+	sys_sched_getscheduler,
+	sys_futex,
+	sys_thread_create,
+	sys_thread_exit,
+	sys_thread_join,
+	sys_sched_core_stats,
+	sys_sched_thread_stats,
+	sys_clock_nanosleep,
+	sys_clock_gettime,
+	sys_thread_settimerslack,
+	sys_thread_gettimerslack,
 	NULL
 };
 
@@ -678,6 +1146,9 @@ void init_syscalls()
 	/* Register our syscall handler */
 	_isr_table[SYSCALL_VECTOR] = syscall_handler;
 
+	/* Initialize the futex wait queues */
+	init_futex();
+
 	/* Initialize the hostname */
 	memset(_hostname, 0, MAX_HOSTNAME_LEN + 1);
 	strcpy(_hostname, "Matrix");
@@ -721,4 +1192,7 @@ void syscall_handler(struct registers *regs)
 		     "r"(regs->ecx), "r"(regs->ebx), "r"(location));
 	
 	regs->eax = rc;
+
+	/* Switch now if the call readied a more important thread */
+	sched_preempt();
 }
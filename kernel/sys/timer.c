@@ -7,98 +7,137 @@
 #include "hal/lapic.h"
 #include "pit.h"
 #include "timer.h"
+#include "rcu.h"
 #include "proc/thread.h"
 #include "proc/sched.h"
 
-void tmrs_clrtimer(struct list *head, struct timer *t)
-{
-	struct list *l;
-	struct timer *at;
-
-	ASSERT((head != NULL) && (t != NULL));
-	
-	t->expire_time = TIMER_NEVER;
+/* Maximum distance in ticks a timer can be queued from the wheel's tick */
+#define TIMER_MAX_TICKS	((1UL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
 
-	/* Remove the timer from the active timer list */
-	LIST_FOR_EACH(l, head) {
-		at = LIST_ENTRY(l, struct timer, link);
-		if (at == t) {
-			list_del(l);
-			break;
-		}
-	}
+/* Convert a time in microseconds to a wheel tick, rounding up so that a
+ * timer never fires before its expire time.
+ */
+static INLINE uint32_t time_to_tick(useconds_t time)
+{
+	return (uint32_t)((time + TIMER_TICK_US - 1) >> TIMER_TICK_SHIFT);
 }
 
 /**
- * Activate a timer to run the callback function at exp_time. If the timer
- * is already in use it is first removed from the timers queue. Then it is
- * put in the list of active timers with the first to expire in front. The
- * caller is responsible for scheduling a new alarm for the timer if needed.
+ * Put a timer into the slot of the wheel matching its expire tick. Timers
+ * already due go to the slot processed next, timers out of the range of the
+ * wheel are parked in the last slot and get re-queued when it cascades.
  */
-void tmrs_settimer(struct list *head, struct timer *t, useconds_t expire_time,
-		   timer_func_t callback, void *ctx)
+static void timer_wheel_enqueue(struct timer_wheel *w, struct timer *t)
 {
-	struct list *l;
-	struct timer *at;
-
-	ASSERT((head != NULL) && (t != NULL));
+	uint32_t expires, idx;
+	struct list *slot;
+	int level;
 
-	/* Clear the timer if it was already in the timer queue */
-	tmrs_clrtimer(head, t);
+	expires = t->expire_tick;
+	idx = expires - w->tick;
 
-	/* Set the timer's variables */
-	t->expire_time = expire_time + sys_time();
-	t->func = callback;
-	t->ctx = ctx;
+	if ((int32_t)idx < 0) {
+		slot = &w->tv1[w->tick & TVR_MASK];
+	} else if (idx < TVR_SIZE) {
+		slot = &w->tv1[expires & TVR_MASK];
+	} else {
+		if (idx > TIMER_MAX_TICKS) {
+			expires = w->tick + TIMER_MAX_TICKS;
+			idx = TIMER_MAX_TICKS;
+		}
 
-	/* Add the timer to the active timer list, the next timer due is in front */
-	LIST_FOR_EACH(l, head) {
-		at = LIST_ENTRY(l, struct timer, link);
-		if (expire_time < at->expire_time) {
-			break;
+		for (level = 0; level < TVN_LEVELS - 1; level++) {
+			if (idx < (1UL << (TVR_BITS + (level + 1) * TVN_BITS))) {
+				break;
+			}
 		}
+		slot = &w->tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) &
+				      TVN_MASK];
 	}
 
-	/* Keep the list ordered by due time */
-	list_add(&t->link, l->prev);
+	list_add_tail(&t->link, slot);
+	w->nr_timers++;
 }
 
-boolean_t tmrs_exptimers(struct list *head, useconds_t now)
+static INLINE void timer_wheel_dequeue(struct timer_wheel *w, struct timer *t)
 {
-	struct timer *t;
-	struct list *l, *p;
-	boolean_t preempt = FALSE;
+	list_del(&t->link);
+	w->nr_timers--;
+	t->core = NULL;
+}
 
-	ASSERT(head != NULL);
+/* Re-queue all the timers of an upper level slot into the lower levels */
+static int timer_wheel_cascade(struct timer_wheel *w, int level, int index)
+{
+	struct list *l, *p;
+	struct list *slot;
+	struct timer *t;
 
-	/* Use the current time to check the timers queue list for expired timers.
-	 * Call the callback functions for all expired timers and deactive them.
-	 * The caller is responsible for scheduling a new alarm if needed.
-	 */
-	LIST_FOR_EACH_SAFE(l, p, head) {
+	slot = &w->tvn[level][index];
+	LIST_FOR_EACH_SAFE(l, p, slot) {
 		t = LIST_ENTRY(l, struct timer, link);
-		if (t->expire_time <= now) {
-			list_del(&t->link);
-			t->func(t->ctx);
-			
-			/* If this is a schedule timer we need to do schedule */
-			if (!preempt && FLAG_ON(t->flags, TIMER_SCHED)) {
-				preempt = TRUE;
-			}
-		} else {
+		list_del(&t->link);
+		w->nr_timers--;
+		timer_wheel_enqueue(w, t);
+	}
+
+	return index;
+}
+
+/**
+ * Advance the wheel up to the tick of now and move all the timers that
+ * expired on the way to the expired list. Must be called with the timer
+ * lock of the wheel's CORE held.
+ */
+static void timer_wheel_advance(struct timer_wheel *w, uint32_t now)
+{
+	struct list *slot;
+	struct list *l;
+	int index, level;
+
+	while ((int32_t)(now - w->tick) >= 0) {
+		/* Nothing queued, fast forward over the idle period */
+		if (w->nr_timers == 0) {
+			w->tick = now + 1;
 			break;
 		}
-	}
 
-	return preempt;
+		index = w->tick & TVR_MASK;
+
+		/* The first level wrapped around, pull the timers of the next
+		 * slot of the upper levels down.
+		 */
+		if (!index) {
+			for (level = 0; level < TVN_LEVELS; level++) {
+				index = (w->tick >> (TVR_BITS + level * TVN_BITS)) &
+					TVN_MASK;
+				if (timer_wheel_cascade(w, level, index)) {
+					break;
+				}
+			}
+			index = 0;
+		}
+
+		/* Batch all the timers of this slot to the expired list */
+		slot = &w->tv1[index];
+		while (!LIST_EMPTY(slot)) {
+			l = slot->next;
+			list_del(l);
+			list_add_tail(l, &w->expired);
+		}
+
+		w->tick++;
+	}
 }
 
 void init_timer(struct timer *t, const char *name, int flags)
 {
 	ASSERT(t != NULL);
-	
+
 	LIST_INIT(&t->link);
+	t->core = NULL;
 	t->expire_time = TIMER_NEVER;
+	t->expire_tick = 0;
 	t->flags = flags;
 	t->func = NULL;
 	t->ctx = NULL;
@@ -106,33 +145,90 @@ void init_timer(struct timer *t, const char *name, int flags)
 	t->name[15] = 0;
 }
 
+/**
+ * Activate a timer to run the callback function after expire_time. If the
+ * timer is already active, it is first removed from the wheel it was queued
+ * on, which may belong to another CORE. The timer is then queued on the
+ * wheel of the current CORE.
+ */
 void set_timer(struct timer *t, useconds_t expire_time, timer_func_t callback,
 	       void *ctx)
 {
+	boolean_t state;
+	useconds_t now;
+	struct core *c;
+
 	ASSERT(t != NULL);
 
-	t->core = CURR_CORE;
+	/* Clear the timer if it was already in a timer wheel */
+	cancel_timer(t);
+
+	state = local_irq_disable();
+	c = CURR_CORE;
+
+	spinlock_acquire_noirq(&c->timer_lock);
+
+	/* An empty wheel may lag behind, bring it up to date first so the
+	 * timer lands in the right slot.
+	 */
+	now = sys_time();
+	if (!c->timers.nr_timers) {
+		c->timers.tick = (uint32_t)(now >> TIMER_TICK_SHIFT);
+	}
 
-	spinlock_acquire(&CURR_CORE->timer_lock);
-	tmrs_settimer(&CURR_CORE->timers, t, expire_time, callback, ctx);
-	spinlock_release(&CURR_CORE->timer_lock);
+	/* Set the timer's variables */
+	t->expire_time = expire_time + now;
+	t->expire_tick = time_to_tick(t->expire_time);
+	t->func = callback;
+	t->ctx = ctx;
+	t->core = c;
+
+	timer_wheel_enqueue(&c->timers, t);
+
+	spinlock_release_noirq(&c->timer_lock);
+	local_irq_restore(state);
 
 #ifdef _DEBUG_SCHED
 	DEBUG(DL_DBG, ("name(%s), expire_time(%lld).\n", t->name, t->expire_time));
 #endif	/* _DEBUG_SCHED */
 }
 
-void cancel_timer(struct timer *t)
+/**
+ * Deactivate a timer. The timer is removed from the wheel of the CORE it
+ * was armed on, which is not necessarily the current CORE. A callback that
+ * has already been picked up by timer_tick() is not waited for.
+ * @return		- TRUE if the timer was removed before it fired
+ */
+boolean_t cancel_timer(struct timer *t)
 {
+	boolean_t ret = FALSE;
+	struct core *c;
+
 	ASSERT(t != NULL);
-	
-	/* The timer pointed to by t was no longer needed, remove it from the active
-	 * timer list. Always update the next timeout time by setting it to the front
-	 * of the active timer list.
-	 */
-	spinlock_acquire(&CURR_CORE->timer_lock);
-	tmrs_clrtimer(&CURR_CORE->timers, t);
-	spinlock_release(&CURR_CORE->timer_lock);
+
+	while (TRUE) {
+		c = t->core;
+		if (!c) {
+			break;
+		}
+
+		spinlock_acquire(&c->timer_lock);
+
+		/* The timer could have fired or moved to another CORE before
+		 * we got the lock, check again.
+		 */
+		if (t->core == c) {
+			timer_wheel_dequeue(&c->timers, t);
+			t->expire_time = TIMER_NEVER;
+			spinlock_release(&c->timer_lock);
+			ret = TRUE;
+			break;
+		}
+
+		spinlock_release(&c->timer_lock);
+	}
+
+	return ret;
 }
 
 void timer_delay(uint32_t usec)
@@ -140,21 +236,60 @@ void timer_delay(uint32_t usec)
 	spin((useconds_t)usec);
 }
 
+/**
+ * Run the expired timers of the wheel of the current CORE. Runs as the timer
+ * softirq, so the callbacks run with interrupts enabled and must not sleep.
+ */
 void timer_tick()
 {
-	useconds_t now;
-	boolean_t prempt = FALSE;
+	struct timer_wheel *w;
+	struct timer *t;
+	struct list *l;
+	struct core *c;
+	timer_func_t func;
+	void *ctx;
 
-	now = sys_time();
+	c = CURR_CORE;
+	w = &c->timers;
 
-	spinlock_acquire(&CURR_CORE->timer_lock);
-	prempt = tmrs_exptimers(&CURR_CORE->timers, now);
-	spinlock_release(&CURR_CORE->timer_lock);
-	if (prempt) {
-		spinlock_acquire_noirq(&CURR_THREAD->lock);
+	spinlock_acquire(&c->timer_lock);
+	timer_wheel_advance(w, (uint32_t)(sys_time() >> TIMER_TICK_SHIFT));
 
-		/* This function should be called with interrupt disabled */
-		sched_reschedule(FALSE);
+	/* Run the expired timers with the timer lock dropped, so that the
+	 * callbacks are free to arm or cancel timers.
+	 */
+	while (!LIST_EMPTY(&w->expired)) {
+		l = w->expired.next;
+		t = LIST_ENTRY(l, struct timer, link);
+		timer_wheel_dequeue(w, t);
+		t->expire_time = TIMER_NEVER;
+		func = t->func;
+		ctx = t->ctx;
+
+		spinlock_release(&c->timer_lock);
+		func(ctx);
+		spinlock_acquire(&c->timer_lock);
 	}
+
+	spinlock_release(&c->timer_lock);
+
+	rcu_tick();
 }
 
+void timer_wheel_init(struct timer_wheel *w)
+{
+	int i, j;
+
+	w->tick = 0;
+	w->nr_timers = 0;
+
+	for (i = 0; i < TVR_SIZE; i++) {
+		LIST_INIT(&w->tv1[i]);
+	}
+	for (i = 0; i < TVN_LEVELS; i++) {
+		for (j = 0; j < TVN_SIZE; j++) {
+			LIST_INIT(&w->tvn[i][j]);
+		}
+	}
+	LIST_INIT(&w->expired);
+}
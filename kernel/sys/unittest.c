@@ -10,12 +10,18 @@
 #include "kd.h"
 #include "mutex.h"
 #include "semaphore.h"
+#include "workqueue.h"
 #include "proc/thread.h"
 #include "proc/process.h"
+#include "proc/sched.h"
 #include "rtl/bitmap.h"
 #include "rtl/fsrtl.h"
 #include "rtl/hashtable.h"
 #include "kstrdup.h"
+#include "hal/core.h"
+#include "div64.h"
+#include "pit.h"
+#include "timekeeping.h"
 
 #define NR_AVL_NODES	13
 struct avl_tree_node _avl_nodes[NR_AVL_NODES];
@@ -35,6 +41,12 @@ char *_avl_vals[NR_AVL_NODES] = {
 	"node13",
 };
 
+/* Number of round trips of the context switch benchmark */
+#define NR_CS_ROUNDS	1000
+
+static struct semaphore _cs_ping;
+static struct semaphore _cs_pong;
+
 struct word {
 	struct list link;
 	char *str;
@@ -73,6 +85,23 @@ static void unit_test_thread(void *ctx)
 	semaphore_up(sem, 1);
 }
 
+static void unit_test_work(void *ctx)
+{
+	atomic_inc((atomic_t *)ctx);
+}
+
+static void cs_bench_thread(void *ctx)
+{
+	int i;
+
+	UNUSED(ctx);
+
+	for (i = 0; i < NR_CS_ROUNDS; i++) {
+		semaphore_down(&_cs_ping);
+		semaphore_up(&_cs_pong, 1);
+	}
+}
+
 int sys_unit_test(uint32_t round)
 {
 	int i, r, rc = 0;
@@ -94,6 +123,14 @@ int sys_unit_test(uint32_t round)
 	struct word w1, w2, w3, *ht_val = NULL;
 	void *buckets = NULL;
 	struct semaphore sem;
+	struct work work;
+	struct delayed_work dwork;
+	atomic_t work_runs = 0;
+	uint64_t cycles;
+	uint64_t ns, us;
+	struct thread *t, *lt;
+	coremask_t affinity;
+	tid_t tid;
 
 	/* String function test */
 	ASSERT(strncmp(str1, str2, 4) == 0);
@@ -260,6 +297,95 @@ int sys_unit_test(uint32_t round)
 	semaphore_down(&sem);
 	DEBUG(DL_DBG, ("Woke up by unittest.\n"));
 
+	/* Thread reuse test, keep both threads on this CORE so the second one
+	 * is taken from the thread cache the first one was released to.
+	 */
+	affinity = CURR_THREAD->affinity;
+	rc = sched_set_affinity(CURR_THREAD, COREMASK_BIT(CURR_CORE->id));
+	ASSERT(rc == 0);
+	rc = thread_create("unit-test", CURR_PROC, 0, unit_test_thread, &sem, &t);
+	ASSERT(rc == 0);
+	sched_set_affinity(t, CURR_THREAD->affinity);
+	tid = t->id;
+	thread_run(t);
+	ASSERT(thread_join(tid, NULL) == 0);
+	thread_release(t);
+	semaphore_down(&sem);
+	while ((lt = thread_lookup(tid)) != NULL) {
+		thread_release(lt);
+		thread_sleep(NULL, 1000, "ut-reap", 0);
+	}
+	rc = thread_create("unit-test", CURR_PROC, 0, unit_test_thread, &sem, &t);
+	ASSERT(rc == 0);
+	ASSERT(t->ref_count == 1);
+	sched_set_affinity(t, CURR_THREAD->affinity);
+	tid = t->id;
+	lt = thread_lookup(tid);
+	ASSERT(lt == t);
+	thread_release(lt);
+	thread_run(t);
+	ASSERT(thread_join(tid, NULL) == 0);
+	thread_release(t);
+	semaphore_down(&sem);
+	sched_set_affinity(CURR_THREAD, affinity);
+	DEBUG(DL_DBG, ("thread reuse test finished.\n"));
+
+	/* Semaphore non-blocking and timed waits */
+	semaphore_init(&sem, "unit-test-sem", 1);
+	ASSERT(semaphore_trydown(&sem) == 0);
+	ASSERT(semaphore_trydown(&sem) != 0);
+	ASSERT(semaphore_down_timeout(&sem, 1000) != 0);
+	semaphore_up(&sem, 2);
+	ASSERT(semaphore_down_timeout(&sem, 1000) == 0);
+	ASSERT(semaphore_trydown(&sem) == 0);
+	DEBUG(DL_DBG, ("semaphore test finished.\n"));
+
+	/* Workqueue test, a flushed work has run and a cancelled one never runs */
+	init_work(&work, unit_test_work, (void *)&work_runs);
+	ASSERT(queue_work(&work));
+	flush_work(&work);
+	ASSERT(work_runs == 1);
+	init_delayed_work(&dwork, unit_test_work, (void *)&work_runs);
+	ASSERT(queue_delayed_work(&dwork, 1000000));
+	ASSERT(!queue_delayed_work(&dwork, 1000000));
+	ASSERT(cancel_delayed_work_sync(&dwork));
+	ASSERT(work_runs == 1);
+	DEBUG(DL_DBG, ("workqueue test finished.\n"));
+
+	/* Timekeeping test, the clocks agree and never go back */
+	ns = ktime_get_ns();
+	us = sys_time();
+	ASSERT(ktime_get_ns() >= ns);
+	do_div(ns, NSECS_PER_USEC);
+	ASSERT((us >= ns) && (us - ns < 1000));
+	ASSERT(ktime_get_real_ns() > ktime_get_ns());
+	DEBUG(DL_DBG, ("timekeeping test finished.\n"));
+
+	/* Context switch benchmark, each round trip takes two switches */
+	semaphore_init(&_cs_ping, "cs-ping-sem", 0);
+	semaphore_init(&_cs_pong, "cs-pong-sem", 0);
+	rc = thread_create("cs-bench", NULL, 0, cs_bench_thread, NULL, &t);
+	ASSERT(rc == 0);
+
+	/* Keep both threads on this CORE so only switches are measured */
+	affinity = CURR_THREAD->affinity;
+	rc = sched_set_affinity(CURR_THREAD, COREMASK_BIT(CURR_CORE->id));
+	ASSERT(rc == 0);
+	sched_set_affinity(t, CURR_THREAD->affinity);
+	thread_run(t);
+	thread_release(t);
+
+	cycles = x86_rdtsc();
+	for (i = 0; i < NR_CS_ROUNDS; i++) {
+		semaphore_up(&_cs_ping, 1);
+		semaphore_down(&_cs_pong);
+	}
+	cycles = x86_rdtsc() - cycles;
+	do_div(cycles, NR_CS_ROUNDS * 2);
+	sched_set_affinity(CURR_THREAD, affinity);
+	DEBUG(DL_DBG, ("context switch test finished, %lld cycles per switch.\n",
+		       cycles));
+
  out:
 	for (i = 0; i < 4; i++) {
 		if (obj[i]) {
@@ -0,0 +1,135 @@
+/*
+ * waitqueue.c
+ */
+#include <types.h>
+#include <stddef.h>
+#include "matrix/matrix.h"
+#include "debug.h"
+#include "proc/thread.h"
+#include "waitqueue.h"
+
+/* Most threads woken up with one round of scheduler locking */
+#define WAIT_WAKE_BATCH		16
+
+/* Put a thread on the queue, ordered by priority if the queue asks for it */
+static void wait_queue_insert(struct wait_queue *wq, struct thread *t)
+{
+	struct thread *w;
+	struct list *l;
+
+	if (!FLAG_ON(wq->flags, WAITQ_PRIORITY)) {
+		list_add_tail(&t->wait_link, &wq->threads);
+		return;
+	}
+
+	/* Insert before the first thread with a lower priority, FIFO among
+	 * the threads of the same priority.
+	 */
+	LIST_FOR_EACH(l, &wq->threads) {
+		w = LIST_ENTRY(l, struct thread, wait_link);
+		if (w->eff_priority < t->eff_priority) {
+			break;
+		}
+	}
+	list_add_tail(&t->wait_link, l);
+}
+
+/**
+ * Queue the current thread without sleeping yet, for callers that must be
+ * visible as a waiter before they go to sleep with wait_queue_sleep().
+ * Must be called with the lock of the queue held.
+ */
+void wait_queue_add(struct wait_queue *wq, int flags)
+{
+	ASSERT(LIST_EMPTY(&CURR_THREAD->wait_link));
+
+	CURR_THREAD->wait_flags = flags;
+	wait_queue_insert(wq, CURR_THREAD);
+}
+
+/**
+ * Sleep on a wait queue. Must be called with the lock of the queue held,
+ * the lock is released when the function returns.
+ * @return		- 0 if woken up, -1 if timed out or interrupted
+ */
+int wait_queue_sleep(struct wait_queue *wq, struct spinlock *lock,
+		     useconds_t timeout, int flags)
+{
+	ASSERT(spinlock_held(lock));
+
+	if (LIST_EMPTY(&CURR_THREAD->wait_link)) {
+		wait_queue_add(wq, flags);
+	}
+
+	return thread_sleep(lock, timeout, wq->name,
+			    FLAG_ON(flags, WAIT_INTERRUPTIBLE) ?
+			    THREAD_INTERRUPTIBLE : 0);
+}
+
+/**
+ * Wake up all the non-exclusive waiters and up to nr exclusive waiters.
+ * Must be called with the lock of the queue held.
+ * @return		- Number of threads woken up
+ */
+size_t wait_queue_wake(struct wait_queue *wq, size_t nr)
+{
+	struct thread *batch[WAIT_WAKE_BATCH];
+	struct thread *t;
+	struct list *l, *p;
+	size_t woken = 0, count = 0;
+
+	LIST_FOR_EACH_SAFE(l, p, &wq->threads) {
+		t = LIST_ENTRY(l, struct thread, wait_link);
+		if (FLAG_ON(t->wait_flags, WAIT_EXCLUSIVE)) {
+			if (!nr) {
+				continue;
+			}
+			nr--;
+		}
+
+		DEBUG(DL_DBG, ("waitq(%s) waking up thread(%s:%d).\n",
+			       wq->name, t->name, t->id));
+		batch[count++] = t;
+		if (count == WAIT_WAKE_BATCH) {
+			thread_wake_many(batch, count);
+			woken += count;
+			count = 0;
+		}
+	}
+
+	if (count == 1) {
+		thread_wake(batch[0]);
+	} else if (count) {
+		thread_wake_many(batch, count);
+	}
+
+	return woken + count;
+}
+
+/**
+ * Get the thread at the head of the queue, NULL if the queue is empty
+ */
+struct thread *wait_queue_first(struct wait_queue *wq)
+{
+	if (LIST_EMPTY(&wq->threads)) {
+		return NULL;
+	}
+
+	return LIST_ENTRY(wq->threads.next, struct thread, wait_link);
+}
+
+/**
+ * Reposition a waiter after its priority changed
+ */
+void wait_queue_requeue(struct wait_queue *wq, struct thread *t)
+{
+	list_del(&t->wait_link);
+	wait_queue_insert(wq, t);
+}
+
+void wait_queue_init(struct wait_queue *wq, const char *name, int flags)
+{
+	LIST_INIT(&wq->threads);
+	wq->flags = flags;
+	wq->name = name;
+}
@@ -0,0 +1,512 @@
+/*
+ * workqueue.c
+ */
+#include <types.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "matrix/matrix.h"
+#include "debug.h"
+#include "hal/hal.h"
+#include "hal/core.h"
+#include "mm/malloc.h"
+#include "proc/thread.h"
+#include "workqueue.h"
+
+/* Most worker threads a pool grows to */
+#define WORK_POOL_MAX_WORKERS	8
+
+/* Idle workers a pool keeps around, the extra ones exit */
+#define WORK_POOL_MAX_IDLE	2
+
+/* Worker thread of a pool */
+struct worker {
+	struct list link;		// Link to the workers list of the pool
+	struct work_pool *pool;		// Pool the worker belongs to
+	struct work *current;		// Work being run, only compared against
+	uint32_t current_seq;		// Sequence of the work being run
+};
+
+/* Thread waiting in flush_work() */
+struct work_flusher {
+	struct list link;		// Link to the flushers list of the pool
+	struct work *work;		// Work waited for
+	uint32_t seq;			// Sequence of the work waited for
+	struct semaphore sem;		// Upped once the work completed
+};
+
+static int worker_create(struct work_pool *pool);
+
+/* Work is waiting and every worker is busy, or blocked in a work function.
+ * Must be called with the pool lock held.
+ */
+static boolean_t work_pool_starved(struct work_pool *pool)
+{
+	return !LIST_EMPTY(&pool->works) && !pool->nr_idle &&
+		(pool->nr_workers < WORK_POOL_MAX_WORKERS);
+}
+
+/**
+ * Put a claimed work on the pending list of a pool and wake a worker.
+ * Must be called with interrupts disabled.
+ */
+static void work_insert(struct work_pool *pool, struct work *w)
+{
+	boolean_t grow;
+
+	spinlock_acquire_noirq(&pool->lock);
+	w->pool = pool;
+	w->seq++;
+	list_add_tail(&w->link, &pool->works);
+	grow = work_pool_starved(pool);
+	spinlock_release_noirq(&pool->lock);
+
+	semaphore_up(&pool->sem, 1);
+
+	/* We may be in interrupt context, let the manager create the worker */
+	if (grow) {
+		semaphore_up(&pool->grow_sem, 1);
+	}
+}
+
+/* Wake up the threads flushing the work a worker has just completed */
+static void work_wake_flushers(struct work_pool *pool, struct work *w,
+			       uint32_t seq)
+{
+	struct work_flusher *f;
+	struct list *l, *p;
+
+	LIST_FOR_EACH_SAFE(l, p, &pool->flushers) {
+		f = LIST_ENTRY(l, struct work_flusher, link);
+		if ((f->work == w) && (f->seq == seq)) {
+			list_del(&f->link);
+			semaphore_up(&f->sem, 1);
+		}
+	}
+}
+
+static void worker_thread(void *ctx)
+{
+	struct worker *wk;
+	struct work_pool *pool;
+	struct work *w;
+	work_func_t func;
+	void *arg;
+	boolean_t grow;
+
+	wk = (struct worker *)ctx;
+	pool = wk->pool;
+
+	while (TRUE) {
+		semaphore_down(&pool->sem);
+
+		spinlock_acquire(&pool->lock);
+
+		/* The work we were woken for may have been cancelled */
+		if (LIST_EMPTY(&pool->works)) {
+			spinlock_release(&pool->lock);
+			continue;
+		}
+
+		w = LIST_ENTRY(pool->works.next, struct work, link);
+		list_del(&w->link);
+		func = w->func;
+		arg = w->ctx;
+		wk->current = w;
+		wk->current_seq = w->seq;
+		pool->nr_idle--;
+
+		/* From here on the work may be queued again, even while it is
+		 * still running.
+		 */
+		w->pending = 0;
+
+		/* Work is backing up and every worker is busy, add one */
+		grow = work_pool_starved(pool);
+
+		spinlock_release(&pool->lock);
+
+		if (grow) {
+			semaphore_up(&pool->grow_sem, 1);
+		}
+
+		/* The function is free to release the work */
+		func(arg);
+
+		spinlock_acquire(&pool->lock);
+
+		wk->current = NULL;
+		pool->nr_idle++;
+		work_wake_flushers(pool, w, wk->current_seq);
+
+		/* The burst is over, let the extra workers go */
+		if ((pool->nr_idle > WORK_POOL_MAX_IDLE) &&
+		    LIST_EMPTY(&pool->works)) {
+			pool->nr_idle--;
+			pool->nr_workers--;
+			list_del(&wk->link);
+			spinlock_release(&pool->lock);
+			break;
+		}
+
+		spinlock_release(&pool->lock);
+	}
+
+	DEBUG(DL_DBG, ("worker(%s) of core(%d) exiting.\n", CURR_THREAD->name,
+		       pool->core->id));
+	kfree(wk);
+}
+
+/**
+ * Create a worker thread for a pool, the worker only runs on the CORE of
+ * the pool. The caller accounts the worker in nr_workers.
+ */
+static int worker_create(struct work_pool *pool)
+{
+	int rc = -1;
+	char name[T_NAME_LEN];
+	struct worker *wk;
+	struct thread *t;
+
+	wk = kmalloc(sizeof(struct worker), 0);
+	if (!wk) {
+		goto out;
+	}
+
+	LIST_INIT(&wk->link);
+	wk->pool = pool;
+	wk->current = NULL;
+	wk->current_seq = 0;
+
+	snprintf(name, T_NAME_LEN - 1, "kworker-%d", pool->core->id);
+	rc = thread_create(name, NULL, 0, worker_thread, wk, &t);
+	if (rc != 0) {
+		DEBUG(DL_INF, ("create worker for core(%d) failed.\n",
+			       pool->core->id));
+		kfree(wk);
+		goto out;
+	}
+
+	spinlock_acquire(&pool->lock);
+	list_add_tail(&wk->link, &pool->workers);
+	pool->nr_idle++;
+	spinlock_release(&pool->lock);
+
+	t->affinity = COREMASK_BIT(pool->core->id);
+	thread_run(t);
+	thread_release(t);
+
+ out:
+	return rc;
+}
+
+/**
+ * Manager thread of a pool. Workers are created here rather than where the
+ * work is queued, as that may be in interrupt context or with scheduler
+ * locks held. A work function that blocks does not hold up the work queued
+ * behind it this way.
+ */
+static void manager_thread(void *ctx)
+{
+	struct work_pool *pool;
+	boolean_t grow;
+
+	pool = (struct work_pool *)ctx;
+
+	while (TRUE) {
+		semaphore_down(&pool->grow_sem);
+
+		/* A worker may have become idle since we were asked */
+		spinlock_acquire(&pool->lock);
+		grow = work_pool_starved(pool);
+		if (grow) {
+			pool->nr_workers++;
+		}
+		spinlock_release(&pool->lock);
+
+		if (grow && (worker_create(pool) != 0)) {
+			spinlock_acquire(&pool->lock);
+			pool->nr_workers--;
+			spinlock_release(&pool->lock);
+		}
+	}
+}
+
+static void delayed_work_timer(void *ctx)
+{
+	struct delayed_work *dw;
+	boolean_t state;
+
+	dw = (struct delayed_work *)ctx;
+
+	state = local_irq_disable();
+	work_insert(&CURR_CORE->works, &dw->work);
+	local_irq_restore(state);
+}
+
+void init_work(struct work *w, work_func_t func, void *ctx)
+{
+	LIST_INIT(&w->link);
+	w->pool = NULL;
+	w->pending = 0;
+	w->seq = 0;
+	w->func = func;
+	w->ctx = ctx;
+}
+
+void init_delayed_work(struct delayed_work *dw, work_func_t func, void *ctx)
+{
+	init_work(&dw->work, func, ctx);
+	init_timer(&dw->timer, "dwork-tmr", 0);
+}
+
+/**
+ * Queue a work on the pool of a CORE. Can be called from any context.
+ * @return		- FALSE if the work was already pending
+ */
+boolean_t queue_work_on(struct core *c, struct work *w)
+{
+	boolean_t state;
+
+	/* Claim and insert without being interrupted, cancel_work() spins
+	 * on a claimed work until it shows up on a list.
+	 */
+	state = local_irq_disable();
+
+	if (!atomic_tas(&w->pending, 0, 1)) {
+		local_irq_restore(state);
+		return FALSE;
+	}
+
+	work_insert(&c->works, w);
+
+	local_irq_restore(state);
+
+	return TRUE;
+}
+
+/**
+ * Queue a work on the pool of the current CORE
+ */
+boolean_t queue_work(struct work *w)
+{
+	boolean_t state;
+	boolean_t ret;
+
+	state = local_irq_disable();
+	ret = queue_work_on(CURR_CORE, w);
+	local_irq_restore(state);
+
+	return ret;
+}
+
+/**
+ * Queue a work on the current CORE once delay microseconds have passed
+ * @return		- FALSE if the work was already pending
+ */
+boolean_t queue_delayed_work(struct delayed_work *dw, useconds_t delay)
+{
+	boolean_t state;
+
+	if (!delay) {
+		return queue_work(&dw->work);
+	}
+
+	state = local_irq_disable();
+
+	if (!atomic_tas(&dw->work.pending, 0, 1)) {
+		local_irq_restore(state);
+		return FALSE;
+	}
+
+	set_timer(&dw->timer, delay, delayed_work_timer, dw);
+
+	local_irq_restore(state);
+
+	return TRUE;
+}
+
+/**
+ * Wait for the last queued instance of a work to complete. Work queued
+ * again after the call is not waited for. Must not be called by the work
+ * being flushed.
+ */
+void flush_work(struct work *w)
+{
+	struct work_flusher f;
+	struct work_pool *pool;
+	struct worker *wk;
+	struct list *l;
+
+	pool = w->pool;
+	if (!pool) {
+		return;
+	}
+
+	spinlock_acquire(&pool->lock);
+
+	f.work = w;
+	if (w->pool != pool) {
+		/* Moved to another CORE meanwhile, try again there */
+		spinlock_release(&pool->lock);
+		flush_work(w);
+		return;
+	} else if (!LIST_EMPTY(&w->link)) {
+		f.seq = w->seq;
+	} else {
+		wk = NULL;
+		LIST_FOR_EACH(l, &pool->workers) {
+			wk = LIST_ENTRY(l, struct worker, link);
+			if (wk->current == w) {
+				break;
+			}
+			wk = NULL;
+		}
+
+		/* Neither pending nor running, nothing to wait for */
+		if (!wk) {
+			spinlock_release(&pool->lock);
+			return;
+		}
+		f.seq = wk->current_seq;
+	}
+
+	semaphore_init(&f.sem, "flush-sem", 0);
+	list_add_tail(&f.link, &pool->flushers);
+
+	spinlock_release(&pool->lock);
+
+	semaphore_down(&f.sem);
+}
+
+/**
+ * Run a delayed work now if its timer is still armed, and wait for it to
+ * complete
+ */
+void flush_delayed_work(struct delayed_work *dw)
+{
+	boolean_t state;
+
+	state = local_irq_disable();
+	if (cancel_timer(&dw->timer)) {
+		work_insert(&CURR_CORE->works, &dw->work);
+	}
+	local_irq_restore(state);
+
+	flush_work(&dw->work);
+}
+
+/* Take a pending work off its pool, or disarm its timer if it has one */
+static boolean_t work_cancel(struct work *w, struct timer *t)
+{
+	boolean_t ret = FALSE;
+	boolean_t state;
+	struct work_pool *pool;
+
+	state = local_irq_disable();
+
+	while (w->pending) {
+		if (t && cancel_timer(t)) {
+			w->pending = 0;
+			ret = TRUE;
+			break;
+		}
+
+		pool = w->pool;
+		if (pool) {
+			spinlock_acquire_noirq(&pool->lock);
+			if ((w->pool == pool) && !LIST_EMPTY(&w->link)) {
+				list_del(&w->link);
+				w->pending = 0;
+				ret = TRUE;
+			}
+			spinlock_release_noirq(&pool->lock);
+			if (ret) {
+				break;
+			}
+		}
+
+		/* Claimed but not on a list yet, it will be shortly */
+		core_spin_hint();
+	}
+
+	local_irq_restore(state);
+
+	return ret;
+}
+
+/**
+ * Take a work off its pool before it runs. An instance that is already
+ * running is not waited for.
+ * @return		- TRUE if the work was pending
+ */
+boolean_t cancel_work(struct work *w)
+{
+	return work_cancel(w, NULL);
+}
+
+/**
+ * Cancel a work and wait for a running instance of it to complete
+ * @return		- TRUE if the work was pending
+ */
+boolean_t cancel_work_sync(struct work *w)
+{
+	boolean_t ret;
+
+	ret = work_cancel(w, NULL);
+	flush_work(w);
+
+	return ret;
+}
+
+boolean_t cancel_delayed_work(struct delayed_work *dw)
+{
+	return work_cancel(&dw->work, &dw->timer);
+}
+
+boolean_t cancel_delayed_work_sync(struct delayed_work *dw)
+{
+	boolean_t ret;
+
+	ret = work_cancel(&dw->work, &dw->timer);
+	flush_work(&dw->work);
+
+	return ret;
+}
+
+void work_pool_init(struct work_pool *pool, struct core *c)
+{
+	spinlock_init(&pool->lock, "wpool-lock");
+	LIST_INIT(&pool->works);
+	LIST_INIT(&pool->workers);
+	LIST_INIT(&pool->flushers);
+	semaphore_init(&pool->sem, "wpool-sem", 0);
+	semaphore_init(&pool->grow_sem, "wpool-grow-sem", 0);
+	pool->nr_workers = 0;
+	pool->nr_idle = 0;
+	pool->core = c;
+}
+
+/**
+ * Start the manager and the first worker of the pool of the current CORE,
+ * the manager adds more workers as work backs up.
+ */
+void init_workqueue_percore()
+{
+	int rc = -1;
+	char name[T_NAME_LEN];
+	struct work_pool *pool;
+	struct thread *t;
+
+	pool = &CURR_CORE->works;
+
+	snprintf(name, T_NAME_LEN - 1, "kwmanager-%d", pool->core->id);
+	rc = thread_create(name, NULL, 0, manager_thread, pool, &t);
+	ASSERT(rc == 0);
+	t->affinity = COREMASK_BIT(pool->core->id);
+	thread_run(t);
+	thread_release(t);
+
+	pool->nr_workers++;
+	rc = worker_create(pool);
+	ASSERT(rc == 0);
+}
@@ -7,11 +7,14 @@
 #include "hal/hal.h"
 #include "hal/core.h"
 #include "timer.h"
+#include "hrtimer.h"
 #include "proc/process.h"
 #include "proc/sched.h"
 #include "debug.h"
 #include "div64.h"
+#include "barrier.h"
 #include "pit.h"
+#include "timekeeping.h"
 
 #define LEAPYEAR(y)	(((y) % 4) == 0 && (((y) % 100) != 0 || ((y) % 400) == 0))
 #define DAYS(y)		(LEAPYEAR(y) ? 366 : 365)
@@ -33,8 +36,65 @@ static int _days_before_month[] = {
 	31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30 + 31 + 30,
 };
 
-/* Boot CORE system time value */
-static useconds_t _sys_time_sync = 0;
+/* Divisor of the PIT input clock, the PIT interrupts HZ times a second */
+#define PIT_DIVISOR		(PIT_BASE_FREQ / HZ)
+
+/* Rounds of the TSC handshake, the one with the shortest round trip wins */
+#define TSC_SYNC_ROUNDS		16
+
+/* Longest round trip in microseconds for the handshake to be trusted */
+#define TSC_SYNC_MAX_RTT	10
+
+/* Rounds of the time warp check run once an AC has synced */
+#define TSC_WARP_ROUNDS		64
+
+/* Stages of the TSC handshake between the boot CORE and an AC */
+#define TSC_SYNC_IDLE		0	// No AC is syncing
+#define TSC_SYNC_READY		1	// AC is waiting for a TSC sample
+#define TSC_SYNC_TIME		2	// Boot CORE has saved its TSC sample
+#define TSC_SYNC_WARP_AC	3	// AC's turn of the time warp check
+#define TSC_SYNC_WARP_BOOT	4	// Boot CORE's turn of the time warp check
+
+static volatile int _tsc_sync_stage = TSC_SYNC_IDLE;
+
+/* TSC sample of the boot CORE for the handshake */
+static volatile uint64_t _tsc_sync_sample = 0;
+
+/* Last TSC cycles read by either side of the time warp check */
+static volatile uint64_t _tsc_warp_last = 0;
+
+/* TSCs of all the COREs agree, sys_time() can be read from the local TSC */
+boolean_t _tsc_stable = TRUE;
+
+/* TSCs of all the COREs agree without the per-CORE offsets */
+boolean_t _tsc_synced = TRUE;
+
+/* Lock to protect the PIT clock, a read of the counter takes three port
+ * accesses that must not interleave with another read.
+ */
+static struct spinlock _pit_lock = {
+	.value = 1,
+	.state = FALSE,
+	.name = "pit-lock"
+};
+
+/* PIT periods elapsed since the PIT was started */
+static volatile uint64_t _pit_ticks = 0;
+
+/* Last PIT clock value read, the clock never goes back */
+static uint64_t _pit_clock_last = 0;
+
+/* PIT is running and counting its periods */
+static boolean_t _pit_running = FALSE;
+
+/* PIT drives the timer events, there is no LAPIC */
+static boolean_t _pit_timer = FALSE;
+
+/* PIT cycles to TSC cycles of the boot CORE, and the TSC cycles the PIT
+ * clock counts from. Used once the TSCs are unstable.
+ */
+static struct clock_conv _pit_to_tsc;
+static uint64_t _pit_tsc_base = 0;
 
 useconds_t time_to_unix(uint32_t year, uint32_t mon, uint32_t day,
 			uint32_t hour, uint32_t min, uint32_t sec)
@@ -65,73 +125,255 @@ useconds_t time_to_unix(uint32_t year, uint32_t mon, uint32_t day,
 	return SECS2USECS(seconds);
 }
 
-useconds_t sys_time()
+/* TSC cycles since boot according to the TSC of the current CORE */
+static INLINE uint64_t tsc_local_cycles()
+{
+	return x86_rdtsc() - CURR_CORE->arch.sys_time_offset;
+}
+
+/**
+ * Get the PIT cycles since the PIT was started. The counter may wrap before
+ * the interrupt of the period is handled, the clock holds still until then
+ * rather than go back.
+ */
+static uint64_t pit_clock_cycles()
 {
-	useconds_t value;
+	uint8_t low, high;
+	uint32_t count;
+	uint64_t value;
+
+	spinlock_acquire(&_pit_lock);
+
+	/* Latch the counter of channel 0, it counts down from the divisor */
+	outportb(0x43, 0x00);
+	low = inportb(0x40);
+	high = inportb(0x40);
+	count = ((uint32_t)high << 8) | low;
 
-	value = (x86_rdtsc() - CURR_CORE->arch.sys_time_offset);
-	
-	do_div(value, CURR_CORE->arch.cycles_per_us);
+	value = _pit_ticks * PIT_DIVISOR + (PIT_DIVISOR - count);
+	if (value < _pit_clock_last) {
+		value = _pit_clock_last;
+	}
+	_pit_clock_last = value;
+
+	spinlock_release(&_pit_lock);
 
 	return value;
 }
 
+/**
+ * Get the TSC cycles since boot in the timebase of the boot CORE. All the
+ * clocks are derived from it.
+ */
+uint64_t tsc_cycles()
+{
+	if (_tsc_stable) {
+		return tsc_local_cycles();
+	}
+
+	/* The TSCs can't be trusted to agree, the COREs share the PIT */
+	return _pit_tsc_base + clock_conv(&_pit_to_tsc, pit_clock_cycles());
+}
+
+useconds_t sys_time()
+{
+	return (useconds_t)clock_conv(&_tsc_to_us, tsc_cycles());
+}
+
 static void pit_callback(struct registers *regs)
 {
-	timer_tick();
+	spinlock_acquire(&_pit_lock);
+	_pit_ticks++;
+	spinlock_release(&_pit_lock);
+
+	if (_pit_timer) {
+		hrtimer_interrupt();
+	}
+}
+
+/**
+ * Start the PIT interrupting HZ times a second, if it is not running yet.
+ * Channel 0 runs as a rate generator, its counter is read by the PIT clock.
+ */
+static void pit_start()
+{
+	if (_pit_running) {
+		return;
+	}
+
+	/* Register our timer callback first */
+	register_IRQ(IRQ0, pit_callback);
+
+	/* The value we send to the PIT is the value to divide. it's input
+	 * clock (1193182 Hz) by, to get our required frequency. Important
+	 * note that the divisor must be small enough to fit into 16-bits.
+	 */
+	outportb(0x43, 0x34);
+	outportb(0x40, (uint8_t)(PIT_DIVISOR & 0xFF));
+	outportb(0x40, (uint8_t)((PIT_DIVISOR >> 8) & 0xFF));
+
+	_pit_running = TRUE;
+}
+
+/* Stop trusting the TSCs, sys_time() goes through the PIT clock */
+static void tsc_mark_unstable(const char *reason)
+{
+	if (_tsc_stable) {
+		/* Carry on from the current time of this CORE */
+		pit_start();
+		clock_conv_init(&_pit_to_tsc, PIT_BASE_FREQ,
+				_boot_core.arch.core_freq);
+		_pit_tsc_base = tsc_local_cycles() -
+			clock_conv(&_pit_to_tsc, pit_clock_cycles());
+		leave_cs_barrier();
+
+		_tsc_stable = FALSE;
+		kprintf("tsc: %s, using the PIT clock\n", reason);
+		timekeeping_update();
+	}
+}
+
+/**
+ * Take turns with the other side in reading the time, the time must never
+ * go back when it is read on the other CORE.
+ * @return		- FALSE if the time went back
+ */
+static boolean_t tsc_warp_check(int turn, int next)
+{
+	boolean_t ret = TRUE;
+	uint64_t now;
+	int i;
+
+	for (i = 0; i < TSC_WARP_ROUNDS; i++) {
+		while (_tsc_sync_stage != turn) {
+			core_spin_hint();
+		}
+		leave_cs_barrier();
+
+		now = tsc_local_cycles();
+		if (now < _tsc_warp_last) {
+			ret = FALSE;
+		}
+		_tsc_warp_last = now;
+
+		leave_cs_barrier();
+		_tsc_sync_stage = next;
+	}
+
+	return ret;
 }
 
 void tsc_init_target()
 {
+	uint64_t t0, t1, rtt, best_rtt = (uint64_t)-1;
+	int64_t delta = 0;
+	int i;
+
 	/* Calculate the offset to subtract from the TSC when calculating the
 	 * system time. For the boot CORE, this is the current value of the TSC.
 	 */
 	if (CURR_CORE == &_boot_core) {
 		CURR_CORE->arch.sys_time_offset = x86_rdtsc();
-	} else {
-		/* Tell the boot CORE that we are in phrase TSC_SYNC1 */
-		//...
+		timekeeping_set_freq(CURR_CORE->arch.core_freq);
+		return;
+	}
+
+	/* Ask the boot CORE for a TSC sample a number of times. The sample
+	 * was taken somewhere between our reads, so half the round trip
+	 * bounds the error. Keep the round with the shortest round trip.
+	 */
+	for (i = 0; i < TSC_SYNC_ROUNDS; i++) {
+		t0 = x86_rdtsc();
+		_tsc_sync_stage = TSC_SYNC_READY;
+
+		while (_tsc_sync_stage != TSC_SYNC_TIME) {
+			core_spin_hint();
+		}
+		leave_cs_barrier();
 		
-		/* Calculate the offset we need to use */
-		CURR_CORE->arch.sys_time_offset =
-			-((_sys_time_sync * CURR_CORE->arch.cycles_per_us) -
-			  x86_rdtsc());
+		t1 = x86_rdtsc();
+		rtt = t1 - t0;
+		if (rtt < best_rtt) {
+			best_rtt = rtt;
+			delta = (int64_t)(_tsc_sync_sample - (t0 + rtt / 2));
+		}
 	}
-}
 
-void tsc_init_source()
-{
-	/* Wait for the AC to get into tsc_init_target() */
-	//...
+	/* A delta within the error of the measurement can't be told from no
+	 * delta at all. Keep the TSCs as they are then, user mode reads the
+	 * time with the offset of the boot CORE.
+	 */
+	if ((delta <= (int64_t)(best_rtt / 2)) &&
+	    (delta >= -(int64_t)(best_rtt / 2))) {
+		delta = 0;
+	} else if (_tsc_synced) {
+		_tsc_synced = FALSE;
+		timekeeping_update();
+	}
+
+	/* Our TSC plus delta reads the TSC of the boot CORE */
+	CURR_CORE->arch.sys_time_offset = _boot_core.arch.sys_time_offset - delta;
+
+	if (best_rtt > TSC_SYNC_MAX_RTT * CURR_CORE->arch.cycles_per_us) {
+		tsc_mark_unstable("handshake round trip too long");
+	}
 
-	/* Save our sys_time() value */
-	_sys_time_sync = sys_time();
+	/* Check the result, we read the time first */
+	_tsc_warp_last = 0;
+	_tsc_sync_stage = TSC_SYNC_WARP_AC;
+	if (!tsc_warp_check(TSC_SYNC_WARP_AC, TSC_SYNC_WARP_BOOT)) {
+		tsc_mark_unstable("time warp between COREs");
+	}
+
+	/* Wait for the last turn of the boot CORE and let it go on */
+	while (_tsc_sync_stage != TSC_SYNC_WARP_AC) {
+		core_spin_hint();
+	}
+	_tsc_sync_stage = TSC_SYNC_IDLE;
+
+	DEBUG(DL_DBG, ("core(%d) TSC delta(%lld) round trip(%lld).\n",
+		       CURR_CORE->id, delta, best_rtt));
 }
 
-void init_pit()
+void tsc_init_source()
 {
-	uint8_t low;
-	uint8_t high;
-	uint32_t divisor;
-
-	/* Register our timer callback first */
-	register_IRQ(IRQ0, pit_callback);
+	int i;
 
-	/* The value we send to the PIT is the value to divide. it's input
-	 * clock (1193182 Hz) by, to get our required frequency. Important
-	 * note that the divisor must be small enough to fit into 16-bits.
+	/* A TSC that is not invariant changes rate with the power state of
+	 * its CORE, so the TSCs of different COREs drift apart.
 	 */
-	divisor = PIT_BASE_FREQ / HZ;
+	if (!_core_features.invariant_tsc) {
+		tsc_mark_unstable("TSC not invariant");
+	}
 
-	/* Send the command byte */
-	outportb(0x43, 0x36);
+	for (i = 0; i < TSC_SYNC_ROUNDS; i++) {
+		/* Wait for the AC to get into tsc_init_target() */
+		while (_tsc_sync_stage != TSC_SYNC_READY) {
+			core_spin_hint();
+		}
+
+		/* Save our TSC value */
+		_tsc_sync_sample = x86_rdtsc();
+		leave_cs_barrier();
+		_tsc_sync_stage = TSC_SYNC_TIME;
+	}
+
+	/* Take our turns in the check of the AC */
+	if (!tsc_warp_check(TSC_SYNC_WARP_BOOT, TSC_SYNC_WARP_AC)) {
+		tsc_mark_unstable("time warp between COREs");
+	}
 
-	/* Divisor has to be sent byte-wise, so split here into upper/lower bytes */
-	low = (uint8_t)(divisor & 0xFF);
-	high = (uint8_t)((divisor >> 8) & 0xFF);
+	/* Wait for the AC to complete */
+	while (_tsc_sync_stage != TSC_SYNC_IDLE) {
+		core_spin_hint();
+	}
+}
 
-	outportb(0x40, low);
-	outportb(0x40, high);
+/* Use the PIT for the timer events, the LAPIC is not there */
+void init_pit()
+{
+	_pit_timer = TRUE;
+	pit_start();
 }
 
 void stop_pit()
@@ -8,6 +8,9 @@
 #define BCD2DEC(n)	(((n >> 4) & 0x0F) * 10 + (n & 0x0F))
 #define DEC2BCD(n)	(((n / 10) << 4) | (n % 10))
 
+/* An update takes under 2ms, each poll is a slow port access of about 1us */
+#define RTC_UIP_MAX_POLLS	10000
+
 static uint32_t rdrtc(int addr)
 {
 	/* Read a single CMOS register value */
@@ -18,6 +21,18 @@ static uint32_t rdrtc(int addr)
 useconds_t platform_time_from_cmos()
 {
 	uint32_t year, mon, day, hour, min, sec;
+	int i;
+
+	/* Wait for an update of the RTC to complete, the registers are not
+	 * consistent while one is in progress. A broken RTC may never clear
+	 * the flag, read it anyway rather than hang.
+	 */
+	for (i = 0; rdrtc(0x0A) & 0x80; i++) {
+		if (i >= RTC_UIP_MAX_POLLS) {
+			DEBUG(DL_WRN, ("RTC update never completed.\n"));
+			break;
+		}
+	}
 
 	sec = rdrtc(0x00);
 	min = rdrtc(0x02);
@@ -36,9 +51,9 @@ useconds_t platform_time_from_cmos()
 		sec = BCD2DEC(sec);
 	}
 
-	/* Correct the year, good until 2080 */
+	/* Correct the year, good until 2069 */
 	if (year <= 69) {
-		year += 69;
+		year += 100;
 	}
 
 	year += 1900;
@@ -0,0 +1,257 @@
+/*
+ * timekeeping.c
+ */
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "sys/time.h"
+#include "matrix/matrix.h"
+#include "matrix/shared.h"
+#include "hal/core.h"
+#include "mm/mm.h"
+#include "mm/kmem.h"
+#include "mm/mmu.h"
+#include "debug.h"
+#include "div64.h"
+#include "pit.h"
+#include "seqlock.h"
+#include "workqueue.h"
+#include "timekeeping.h"
+
+/* Interval in microseconds the realtime clock is checked against the RTC */
+#define TK_RTC_RESYNC		SECS2USECS(600)
+
+/* Drift from the RTC in nanoseconds the realtime clock is corrected for,
+ * the RTC only counts whole seconds.
+ */
+#define TK_RTC_MAX_DRIFT	(2LL * NSECS_PER_SEC)
+
+/* Realtime clock state */
+struct timekeeper {
+	struct seqlock lock;		// Protects the fields below
+	int64_t real_offset;		// Realtime minus monotonic time in ns
+	boolean_t set;			// Realtime was set, don't follow the RTC
+};
+
+/* Conversion factors from TSC cycles, set up once the TSC is calibrated */
+struct clock_conv _tsc_to_ns;
+struct clock_conv _tsc_to_us;
+
+static struct timekeeper _tk;
+static struct delayed_work _tk_resync_work;
+
+/* Page the processes read the clocks from, see matrix/shared.h */
+static struct time_page *_time_page = NULL;
+static phys_addr_t _time_page_phys;
+
+/**
+ * Compute the factors to convert cycles counted at from_freq to a unit
+ * counted at to_freq, both in the same unit. Use the largest shift the
+ * multiplier fits 32 bits with, for the best precision.
+ */
+void clock_conv_init(struct clock_conv *cv, uint32_t from_freq,
+		     uint64_t to_freq)
+{
+	uint64_t tmp = 0;
+	uint32_t shift;
+
+	for (shift = 63; shift > 0; shift--) {
+		if ((to_freq << shift) >> shift != to_freq) {
+			continue;
+		}
+
+		tmp = (to_freq << shift) + from_freq / 2;
+		do_div(tmp, from_freq);
+		if (!(tmp >> 32)) {
+			break;
+		}
+	}
+
+	cv->mult = (uint32_t)tmp;
+	cv->shift = shift;
+}
+
+/**
+ * Set up the conversion of TSC cycles, called once the boot CORE knows
+ * its frequency
+ */
+void timekeeping_set_freq(uint64_t freq)
+{
+	uint32_t khz;
+
+	do_div(freq, 1000);
+	khz = (uint32_t)freq;
+	if (!khz) {
+		khz = 7000;	// Same value the cycles per us fall back to
+	}
+
+	clock_conv_init(&_tsc_to_ns, khz, NSECS_PER_SEC / 1000);
+	clock_conv_init(&_tsc_to_us, khz, 1000);
+}
+
+/**
+ * Copy the clock state to the time page, must be called with the lock of
+ * the timekeeper held. The page has a sequence of its own as user mode
+ * can't see the timekeeper.
+ */
+static void tk_update_page()
+{
+	struct time_page *tp = _time_page;
+
+	tp->seq++;
+	leave_cs_barrier();
+
+	/* User mode reads the TSC of whatever CORE it runs on, so the TSCs
+	 * must agree without the per-CORE offsets.
+	 */
+	tp->tsc_stable = _tsc_stable && _tsc_synced;
+	tp->tsc_base = _boot_core.arch.sys_time_offset;
+	tp->tsc_mult = _tsc_to_ns.mult;
+	tp->tsc_shift = _tsc_to_ns.shift;
+	tp->real_offset = _tk.real_offset;
+
+	leave_cs_barrier();
+	tp->seq++;
+}
+
+/**
+ * Publish a change of the TSC state to the time page
+ */
+void timekeeping_update()
+{
+	if (!_time_page) {
+		return;		// Picked up by init_timekeeping()
+	}
+
+	write_seqlock(&_tk.lock);
+	tk_update_page();
+	write_sequnlock(&_tk.lock);
+}
+
+/**
+ * Map the time page read-only into a user MMU context
+ */
+int timekeeping_map_page(struct mmu_ctx *ctx)
+{
+	return mmu_map(ctx, SHARED_TIME_PAGE, _time_page_phys, 0);
+}
+
+/**
+ * Get the monotonic time, the time since boot in nanoseconds
+ */
+uint64_t ktime_get_ns()
+{
+	return clock_conv(&_tsc_to_ns, tsc_cycles());
+}
+
+/**
+ * Get the realtime, the time since the Epoch in nanoseconds
+ */
+uint64_t ktime_get_real_ns()
+{
+	uint32_t seq;
+	int64_t offset;
+
+	do {
+		seq = read_seqbegin(&_tk.lock);
+		offset = _tk.real_offset;
+	} while (read_seqretry(&_tk.lock, seq));
+
+	return ktime_get_ns() + offset;
+}
+
+/**
+ * Set the realtime, it no longer follows the RTC afterwards
+ */
+void ktime_set_real_ns(uint64_t ns)
+{
+	write_seqlock(&_tk.lock);
+	_tk.real_offset = ns - ktime_get_ns();
+	_tk.set = TRUE;
+	tk_update_page();
+	write_sequnlock(&_tk.lock);
+}
+
+int clock_gettime_ns(clockid_t id, uint64_t *ns)
+{
+	int rc = 0;
+
+	switch (id) {
+	case CLOCK_REALTIME:
+		*ns = ktime_get_real_ns();
+		break;
+	case CLOCK_MONOTONIC:
+		*ns = ktime_get_ns();
+		break;
+	default:
+		rc = EINVAL;
+		break;
+	}
+
+	return rc;
+}
+
+/* Realtime according to the RTC, in nanoseconds */
+static uint64_t rtc_real_ns()
+{
+	useconds_t usecs;
+
+	usecs = platform_time_from_cmos();
+
+	return (uint64_t)usecs * NSECS_PER_USEC;
+}
+
+/**
+ * Correct the drift of the realtime clock from the RTC. Only the realtime
+ * offset moves, the monotonic time is never stepped.
+ */
+static void tk_resync(void *ctx)
+{
+	int64_t drift;
+	uint64_t rtc;
+
+	UNUSED(ctx);
+
+	rtc = rtc_real_ns();
+
+	write_seqlock(&_tk.lock);
+	if (!_tk.set) {
+		drift = (int64_t)(rtc - ktime_get_ns()) - _tk.real_offset;
+		if ((drift > TK_RTC_MAX_DRIFT) || (drift < -TK_RTC_MAX_DRIFT)) {
+			_tk.real_offset += drift;
+			DEBUG(DL_INF, ("realtime drifted(%lld) from RTC.\n", drift));
+			tk_update_page();
+		}
+	}
+	write_sequnlock(&_tk.lock);
+
+	queue_delayed_work(&_tk_resync_work, TK_RTC_RESYNC);
+}
+
+/**
+ * Start the realtime clock from the RTC, it is read again only to correct
+ * the drift every TK_RTC_RESYNC
+ */
+void init_timekeeping()
+{
+	struct page *p;
+
+	seqlock_init(&_tk.lock, "tk-lock");
+	_tk.real_offset = rtc_real_ns() - ktime_get_ns();
+	_tk.set = FALSE;
+
+	/* Set up the time page every process gets mapped */
+	_time_page = kmem_alloc(PAGE_SIZE, MM_ALIGN);
+	if (!_time_page) {
+		PANIC("Failed to allocate the time page");
+	}
+	memset(_time_page, 0, PAGE_SIZE);
+	p = mmu_get_page(&_kernel_mmu_ctx, (ptr_t)_time_page, FALSE, 0);
+	ASSERT(p != NULL);
+	_time_page_phys = p->frame * PAGE_SIZE;
+	timekeeping_update();
+
+	init_delayed_work(&_tk_resync_work, tk_resync, NULL);
+	queue_delayed_work(&_tk_resync_work, TK_RTC_RESYNC);
+}
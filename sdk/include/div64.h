@@ -1,6 +1,8 @@
 #ifndef __DIV64_H__
 #define __DIV64_H__
 
+#include "matrix/matrix.h"
+
 #if BITS_PER_LONG == 64
 
 #define do_div(n, base) ({		\
@@ -32,4 +34,29 @@ extern uint32_t __div64_32(uint64_t *dividend, uint32_t divisor);
 
 #endif	/* BITS_PER_LONG */
 
+/* Compute (a * mul) >> shift without losing the high bits of the product.
+ * For a shift below 32 the high half of the product is shifted left, which
+ * only overflows if the result does not fit in 64 bits anyway. Shared by
+ * the kernel and the sdk so both convert TSC cycles alike.
+ */
+static INLINE uint64_t mul_u64_u32_shr(uint64_t a, uint32_t mul, uint32_t shift)
+{
+	uint32_t ah, al;
+	uint64_t ret;
+
+	al = (uint32_t)a;
+	ah = (uint32_t)(a >> 32);
+
+	ret = ((uint64_t)al * mul) >> shift;
+	if (ah) {
+		if (shift >= 32) {
+			ret += ((uint64_t)ah * mul) >> (shift - 32);
+		} else {
+			ret += ((uint64_t)ah * mul) << (32 - shift);
+		}
+	}
+
+	return ret;
+}
+
 #endif	/* __DIV64_H__ */
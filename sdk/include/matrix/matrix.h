@@ -10,6 +10,8 @@
 
 #define STATIC_ASSERT(expr)	typedef char assert_type[(expr) ? 1 : -1];
 
+#define UNUSED(_x)		((void)(_x))
+
 #define FLAG_ON(_x, _f)		((_x) & (_f))
 
 #define IS_FLAG_ON(_x, _f)	(((_x) & (_f)) ? 1 : 0)
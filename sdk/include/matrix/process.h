@@ -1,6 +1,16 @@
 #ifndef __MTX_PROCESS_H__
 #define __MTX_PROCESS_H__
 
+/* Layout of the user stacks. The stack of the main thread is at USTACK_BOTTOM,
+ * the stacks of the other threads of a process are placed in the slots below
+ * it. A slot is twice the size of a stack, the unmapped half above each stack
+ * catches the overflow of the stack in the next slot up.
+ */
+#define USTACK_BOTTOM		0x30000000
+#define USTACK_SIZE		0x4000
+#define USTACK_SLOT_SIZE	(USTACK_SIZE * 2)
+#define USTACK_SLOTS		32
+
 struct process_args {
 	size_t size;		// Total length of all args
 	char **argv;		// Arguments array
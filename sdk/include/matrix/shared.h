@@ -0,0 +1,34 @@
+#ifndef __MTX_SHARED_H__
+#define __MTX_SHARED_H__
+
+#include <types.h>
+
+/* Read-only pages the kernel maps into every process, right below the kernel
+ * memory pool. The time page is the same for all the processes, the process
+ * page is private to each of them.
+ */
+#define SHARED_TIME_PAGE	0xBFFFE000
+#define SHARED_PROC_PAGE	0xBFFFF000
+
+/* Timekeeping parameters to read the clocks without a system call. The
+ * sequence is odd while the kernel updates the page, a reader retries if it
+ * changed while the page was read.
+ *
+ *   monotonic ns = ((rdtsc - tsc_base) * tsc_mult) >> tsc_shift
+ *   realtime ns  = monotonic ns + real_offset
+ */
+struct time_page {
+	volatile uint32_t seq;		// Bumped before and after each update
+	uint32_t tsc_stable;		// Non-zero if the TSC may be read directly
+	uint64_t tsc_base;		// TSC value the monotonic time counts from
+	uint32_t tsc_mult;		// TSC cycles to nanoseconds multiplier
+	uint32_t tsc_shift;		// Right shift applied to the product
+	int64_t real_offset;		// Realtime minus monotonic time in ns
+};
+
+/* Facts about the process that never change while it runs */
+struct proc_page {
+	pid_t pid;			// ID of the process
+};
+
+#endif	/* __MTX_SHARED_H__ */
@@ -0,0 +1,31 @@
+#ifndef __PTHREAD_H__
+#define __PTHREAD_H__
+
+#include <types.h>
+
+/* Maximum number of thread-specific data keys */
+#define PTHREAD_KEYS_MAX	16
+
+/* Control block of a thread, lives until the thread is joined */
+struct pthread {
+	tid_t tid;				// Kernel thread ID
+	void *(*start)(void *);			// Start routine
+	void *arg;				// Argument to the start routine
+	void *retval;				// Value returned by the thread
+	void *specific[PTHREAD_KEYS_MAX];	// Thread-specific data
+	int used;				// Control block is allocated
+};
+typedef struct pthread *pthread_t;
+
+typedef int pthread_key_t;
+
+extern int pthread_create(pthread_t *thread, void *(*start)(void *), void *arg);
+extern int pthread_join(pthread_t thread, void **retval);
+extern void pthread_exit(void *retval);
+extern pthread_t pthread_self();
+
+extern int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
+extern int pthread_setspecific(pthread_key_t key, const void *value);
+extern void *pthread_getspecific(pthread_key_t key);
+
+#endif	/* __PTHREAD_H__ */
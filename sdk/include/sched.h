@@ -0,0 +1,57 @@
+#ifndef __LIBC_SCHED_H__
+#define __LIBC_SCHED_H__
+
+#include <types.h>
+
+/* Scheduling policies */
+#define SCHED_OTHER		0	// Time sharing
+#define SCHED_FIFO		1	// Real-time, first in first out
+#define SCHED_RR		2	// Real-time, round robin
+
+/* Range of the priorities within a scheduling policy */
+#define SCHED_PRIORITY_MIN	0
+#define SCHED_PRIORITY_MAX	31
+
+/* Scheduler statistics of a CORE, times are in microseconds */
+struct sched_core_stats {
+	uint64_t idle_time;		// Time spent in the idle thread
+	uint64_t run_delay;		// Time the threads run here waited to run
+	uint32_t nr_switches;		// Number of thread switches
+	uint32_t nr_running;		// Current number of runnable threads
+	uint32_t max_queue_depth;	// Most runnable threads seen at a switch
+	uint32_t avg_queue_depth;	// Average runnable threads at a switch
+};
+
+/* Scheduler statistics of a thread, times are in microseconds */
+struct sched_thread_stats {
+	uint64_t run_delay;		// Time spent ready waiting for a CORE
+	uint64_t run_time;		// Time spent running on a CORE
+	uint32_t nr_vol_switches;	// Switches away because the thread blocked
+	uint32_t nr_invol_switches;	// Switches away because it was preempted
+	uint32_t core;			// CORE the thread runs or last ran on
+};
+
+#ifndef __KERNEL__
+
+/* Pid or tid 0 refers to the calling process or thread */
+extern int sched_setaffinity(pid_t pid, coremask_t mask);
+extern int sched_getaffinity(pid_t pid, coremask_t *mask);
+extern int thread_setaffinity(tid_t tid, coremask_t mask);
+extern int thread_getaffinity(tid_t tid, coremask_t *mask);
+extern int sched_setscheduler(tid_t tid, int policy, int priority);
+extern int sched_getscheduler(tid_t tid, int *priority);
+extern int sched_core_stats(int core, struct sched_core_stats *stats);
+extern int sched_thread_stats(tid_t tid, struct sched_thread_stats *stats);
+
+/* Nanoseconds a sleep of the thread may overrun, so wakeups can be batched */
+extern int thread_settimerslack(tid_t tid, uint32_t slack);
+extern int thread_gettimerslack(tid_t tid, uint32_t *slack);
+
+/* Threads of the calling process, the entry must call thread_exit() */
+extern int thread_create(void (*entry)(void *), void *arg, tid_t *tid);
+extern void thread_exit(int status);
+extern int thread_join(tid_t tid, int *status);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* __LIBC_SCHED_H__ */
@@ -0,0 +1,35 @@
+#ifndef __SYNC_H__
+#define __SYNC_H__
+
+#include <types.h>
+
+/* User space mutex built on futex. The uncontended lock and unlock are a
+ * single atomic instruction and never enter the kernel.
+ */
+struct mutex {
+	int value;		// 0 unlocked, 1 locked, 2 locked with waiters
+};
+typedef struct mutex mutex_t;
+
+#define MUTEX_INITIALIZER	{ 0 }
+
+/* Condition variable, waiters sleep on the sequence number */
+struct cond {
+	int seq;		// Bumped by each signal or broadcast
+	struct mutex *mutex;	// Mutex the waiters use
+};
+typedef struct cond cond_t;
+
+#define COND_INITIALIZER	{ 0, NULL }
+
+extern void mutex_init(struct mutex *m);
+extern void mutex_lock(struct mutex *m);
+extern int mutex_trylock(struct mutex *m);
+extern void mutex_unlock(struct mutex *m);
+
+extern void cond_init(struct cond *c);
+extern void cond_wait(struct cond *c, struct mutex *m);
+extern void cond_signal(struct cond *c);
+extern void cond_broadcast(struct cond *c);
+
+#endif	/* __SYNC_H__ */
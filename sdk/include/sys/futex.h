@@ -0,0 +1,23 @@
+#ifndef __SYS_FUTEX_H__
+#define __SYS_FUTEX_H__
+
+#include <types.h>
+
+/* Futex operations */
+#define FUTEX_WAIT	0	// Sleep if *uaddr still equals val
+#define FUTEX_WAKE	1	// Wake up to val waiters of uaddr
+#define FUTEX_REQUEUE	2	// Wake val waiters, move up to val2 to uaddr2
+
+#ifndef __KERNEL__
+
+/* For FUTEX_WAIT arg points to a timeout in microseconds or is NULL, for
+ * FUTEX_REQUEUE it is the futex the remaining waiters are moved to.
+ * FUTEX_WAIT returns 0 once woken up, which may be spurious. FUTEX_WAKE and
+ * FUTEX_REQUEUE return the number of waiters woken up or moved. All the
+ * operations return -1 on error.
+ */
+extern int futex(int *uaddr, int op, int val, void *arg, int val2);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* __SYS_FUTEX_H__ */
@@ -33,8 +33,26 @@ struct timezone {
 	int tz_dsttime;		/* type of DST correction */
 };
 
+struct timespec {
+	time_t tv_sec;		/* seconds */
+	long tv_nsec;		/* nanoseconds */
+};
+
+typedef int clockid_t;
+
+/* Clocks */
+#define CLOCK_REALTIME		0	/* Wall clock time */
+#define CLOCK_MONOTONIC		1	/* Time since boot, never set */
+
+/* Flags for clock_nanosleep */
+#define TIMER_ABSTIME		1	/* The time is absolute */
+
 int gettimeofday(struct timeval *tv, struct timezone *tz);
 int settimeofday(const struct timeval *tv, const struct timezone *tz);
+int clock_gettime(clockid_t id, struct timespec *ts);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int clock_nanosleep(clockid_t id, int flags, const struct timespec *req,
+		    struct timespec *rem);
 struct tm *localtime(const time_t *tp);
 size_t strftime(char *s, size_t max, const char *fmt, const struct tm *tm);
 
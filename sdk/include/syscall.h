@@ -89,6 +89,22 @@ DECL_SYSCALL1(create_module, int);
 DECL_SYSCALL2(query_module, const char *, void *);
 DECL_SYSCALL1(delete_module, const char *);
 DECL_SYSCALL4(ioctl, int, int, void *, void *);
+DECL_SYSCALL2(sched_setaffinity, pid_t, coremask_t);
+DECL_SYSCALL2(sched_getaffinity, pid_t, coremask_t *);
+DECL_SYSCALL2(thread_setaffinity, tid_t, coremask_t);
+DECL_SYSCALL2(thread_getaffinity, tid_t, coremask_t *);
+DECL_SYSCALL3(sched_setscheduler, tid_t, int, int);
+DECL_SYSCALL2(sched_getscheduler, tid_t, int *);
+DECL_SYSCALL5(futex, int *, int, int, void *, int);
+DECL_SYSCALL3(thread_create, void *, void *, tid_t *);
+DECL_SYSCALL1(thread_exit, int);
+DECL_SYSCALL2(thread_join, tid_t, int *);
+DECL_SYSCALL2(sched_core_stats, int, void *);
+DECL_SYSCALL2(sched_thread_stats, tid_t, void *);
+DECL_SYSCALL4(clock_nanosleep, int, int, const void *, void *);
+DECL_SYSCALL2(clock_gettime, int, void *);
+DECL_SYSCALL2(thread_settimerslack, tid_t, uint32_t);
+DECL_SYSCALL2(thread_gettimerslack, tid_t, uint32_t *);
 /* System call declaration end */
 
 #endif	/* __SYSCALL_H__ */
@@ -41,6 +41,11 @@ typedef uint32_t gid_t;
 typedef int pid_t;
 typedef int tid_t;
 
+/* Bitmask of COREs, bit n stands for the CORE with ID n */
+typedef uint32_t coremask_t;
+#define COREMASK_ALL	((coremask_t)~0)
+#define COREMASK_BIT(id)	((coremask_t)1 << (id))
+
 /* Ptr type definition */
 typedef unsigned long ptr_t;
 
@@ -9,8 +9,9 @@ extern int chdir(const char *path);
 extern int gethostname(char *name, size_t len);
 extern int close(int fd);
 extern int getuid();
-extern int setudi(uid_t uid);
+extern int setuid(uid_t uid);
 extern int getgid();
 extern int setgid(gid_t gid);
+extern int getpid();
 
 #endif	/* __UNISTD_H__ */
@@ -0,0 +1,91 @@
+/*
+ * clock.c
+ */
+
+#include <types.h>
+#include <stddef.h>
+#include <syscall.h>
+#include <div64.h>
+#include <sys/time.h>
+#include "matrix/matrix.h"
+#include "matrix/shared.h"
+
+#define NSECS_PER_USEC		1000
+#define NSECS_PER_SEC		1000000000
+
+static INLINE uint64_t rdtsc()
+{
+	uint32_t high, low;
+
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * Read a clock from the time page the kernel maps into every process
+ * @return		- 0 on success, -1 if the clock must be read with a
+ *			  system call
+ */
+static int clock_read_page(clockid_t id, uint64_t *ns)
+{
+	struct time_page *tp = (struct time_page *)SHARED_TIME_PAGE;
+	uint32_t seq;
+	uint64_t cycles;
+	int64_t offset;
+
+	if ((id != CLOCK_REALTIME) && (id != CLOCK_MONOTONIC)) {
+		return -1;
+	}
+
+	do {
+		while ((seq = tp->seq) & 1) {
+			;
+		}
+		asm volatile("" ::: "memory");
+
+		if (!tp->tsc_stable) {
+			return -1;
+		}
+		cycles = rdtsc() - tp->tsc_base;
+		*ns = mul_u64_u32_shr(cycles, tp->tsc_mult, tp->tsc_shift);
+		offset = tp->real_offset;
+
+		asm volatile("" ::: "memory");
+	} while (tp->seq != seq);
+
+	if (id == CLOCK_REALTIME) {
+		*ns += offset;
+	}
+
+	return 0;
+}
+
+int gettimeofday(struct timeval *tv, struct timezone *tz)
+{
+	uint64_t ns;
+	uint32_t rem;
+
+	if (!tv || clock_read_page(CLOCK_REALTIME, &ns) != 0) {
+		return mtx_gettimeofday(tv, tz);
+	}
+
+	rem = do_div(ns, NSECS_PER_SEC);
+	tv->tv_sec = ns;
+	tv->tv_usec = rem / NSECS_PER_USEC;
+
+	return 0;
+}
+
+int clock_gettime(clockid_t id, struct timespec *ts)
+{
+	uint64_t ns;
+
+	if (!ts || clock_read_page(id, &ns) != 0) {
+		return mtx_clock_gettime(id, ts);
+	}
+
+	ts->tv_nsec = do_div(ns, NSECS_PER_SEC);
+	ts->tv_sec = ns;
+
+	return 0;
+}
@@ -1,8 +1,11 @@
 #include <types.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "matrix/process.h"
 
+int errno = 0;
+
 extern int main(int argc, char **argv);
 
 void libc_main(struct process_args *args)
@@ -0,0 +1,167 @@
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sync.h>
+#include <pthread.h>
+#include <matrix/process.h>
+
+/* The stack of every thread is aligned to USTACK_SIZE and the kernel puts
+ * the argument of the thread entry on its top word. We pass the control
+ * block as the argument, so a thread finds its own control block from any
+ * address on its stack.
+ */
+#define PTHREAD_STACK_TOP(addr)	\
+	(((ptr_t)(addr) & ~(USTACK_SIZE - 1)) + USTACK_SIZE)
+
+static struct pthread _pthread_main;
+static struct pthread _pthreads[USTACK_SLOTS];
+static struct mutex _pthread_lock = MUTEX_INITIALIZER;
+
+static void (*_pthread_dtors[PTHREAD_KEYS_MAX])(void *);
+static int _pthread_nr_keys = 0;
+
+static void pthread_start(void *ctx)
+{
+	struct pthread *self = (struct pthread *)ctx;
+
+	pthread_exit(self->start(self->arg));
+}
+
+pthread_t pthread_self()
+{
+	ptr_t top;
+
+	top = PTHREAD_STACK_TOP(&top);
+	if (top == (USTACK_BOTTOM + USTACK_SIZE)) {
+		return &_pthread_main;
+	}
+
+	return *((struct pthread **)top - 1);
+}
+
+int pthread_create(pthread_t *thread, void *(*start)(void *), void *arg)
+{
+	int i, rc;
+	struct pthread *t = NULL;
+
+	if (!thread || !start) {
+		return EINVAL;
+	}
+
+	mutex_lock(&_pthread_lock);
+	for (i = 0; i < USTACK_SLOTS; i++) {
+		if (!_pthreads[i].used) {
+			t = &_pthreads[i];
+			memset(t, 0, sizeof(*t));
+			t->used = 1;
+			break;
+		}
+	}
+	mutex_unlock(&_pthread_lock);
+
+	if (!t) {
+		return EAGAIN;
+	}
+
+	t->start = start;
+	t->arg = arg;
+
+	/* The kernel fills in the tid before the thread starts to run */
+	rc = thread_create(pthread_start, t, &t->tid);
+	if (rc < 0) {
+		t->used = 0;
+		return EAGAIN;
+	}
+
+	*thread = t;
+
+	return 0;
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+	if (!thread || (thread == &_pthread_main)) {
+		return EINVAL;
+	}
+
+	if (thread_join(thread->tid, NULL) != 0) {
+		return EINVAL;
+	}
+
+	if (retval) {
+		*retval = thread->retval;
+	}
+
+	mutex_lock(&_pthread_lock);
+	thread->used = 0;
+	mutex_unlock(&_pthread_lock);
+
+	return 0;
+}
+
+/**
+ * Terminate the calling thread. Exiting the main thread terminates the
+ * whole process.
+ */
+void pthread_exit(void *retval)
+{
+	struct pthread *self;
+	void *value;
+	int i;
+
+	self = pthread_self();
+	self->retval = retval;
+
+	/* Run the destructors of the thread-specific data */
+	for (i = 0; i < _pthread_nr_keys; i++) {
+		value = self->specific[i];
+		if (value && _pthread_dtors[i]) {
+			self->specific[i] = NULL;
+			_pthread_dtors[i](value);
+		}
+	}
+
+	if (self == &_pthread_main) {
+		exit((int)retval);
+	}
+
+	thread_exit(0);
+}
+
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *))
+{
+	int rc = EAGAIN;
+
+	mutex_lock(&_pthread_lock);
+	if (_pthread_nr_keys < PTHREAD_KEYS_MAX) {
+		_pthread_dtors[_pthread_nr_keys] = destructor;
+		*key = _pthread_nr_keys++;
+		rc = 0;
+	}
+	mutex_unlock(&_pthread_lock);
+
+	return rc;
+}
+
+int pthread_setspecific(pthread_key_t key, const void *value)
+{
+	if ((key < 0) || (key >= _pthread_nr_keys)) {
+		return EINVAL;
+	}
+
+	pthread_self()->specific[key] = (void *)value;
+
+	return 0;
+}
+
+void *pthread_getspecific(pthread_key_t key)
+{
+	if ((key < 0) || (key >= _pthread_nr_keys)) {
+		return NULL;
+	}
+
+	return pthread_self()->specific[key];
+}
@@ -0,0 +1,111 @@
+#include <types.h>
+#include <stddef.h>
+#include <matrix/matrix.h>
+#include <sys/futex.h>
+#include <sync.h>
+
+static INLINE int atomic_cmpxchg(int *var, int test, int val)
+{
+	asm volatile("lock cmpxchgl %2, %1"
+		     : "+a"(test), "+m"(*var)
+		     : "r"(val)
+		     : "memory");
+	return test;
+}
+
+static INLINE int atomic_xchg(int *var, int val)
+{
+	asm volatile("xchgl %0, %1" : "+r"(val), "+m"(*var) :: "memory");
+	return val;
+}
+
+static INLINE int atomic_add(int *var, int val)
+{
+	asm volatile("lock xaddl %0, %1" : "+r"(val), "+m"(*var) :: "memory");
+	return val;
+}
+
+void mutex_init(struct mutex *m)
+{
+	m->value = 0;
+}
+
+void mutex_lock(struct mutex *m)
+{
+	int c;
+
+	c = atomic_cmpxchg(&m->value, 0, 1);
+	if (c == 0) {
+		return;
+	}
+
+	/* Contended, mark that there are waiters and sleep until we get
+	 * the lock in the contended state.
+	 */
+	if (c != 2) {
+		c = atomic_xchg(&m->value, 2);
+	}
+	while (c != 0) {
+		futex(&m->value, FUTEX_WAIT, 2, NULL, 0);
+		c = atomic_xchg(&m->value, 2);
+	}
+}
+
+int mutex_trylock(struct mutex *m)
+{
+	return (atomic_cmpxchg(&m->value, 0, 1) == 0) ? 0 : -1;
+}
+
+void mutex_unlock(struct mutex *m)
+{
+	/* Only enter the kernel if someone may be waiting */
+	if (atomic_add(&m->value, -1) != 1) {
+		m->value = 0;
+		futex(&m->value, FUTEX_WAKE, 1, NULL, 0);
+	}
+}
+
+void cond_init(struct cond *c)
+{
+	c->seq = 0;
+	c->mutex = NULL;
+}
+
+void cond_wait(struct cond *c, struct mutex *m)
+{
+	int seq;
+
+	seq = c->seq;
+	c->mutex = m;
+
+	mutex_unlock(m);
+	futex(&c->seq, FUTEX_WAIT, seq, NULL, 0);
+
+	/* We may have been requeued to the mutex by a broadcast, take it in
+	 * the contended state so the waiters behind us get woken up too.
+	 */
+	while (atomic_xchg(&m->value, 2) != 0) {
+		futex(&m->value, FUTEX_WAIT, 2, NULL, 0);
+	}
+}
+
+void cond_signal(struct cond *c)
+{
+	atomic_add(&c->seq, 1);
+	futex(&c->seq, FUTEX_WAKE, 1, NULL, 0);
+}
+
+void cond_broadcast(struct cond *c)
+{
+	struct mutex *m = c->mutex;
+
+	atomic_add(&c->seq, 1);
+	if (!m) {
+		return;
+	}
+
+	/* Wake one waiter and move the rest onto the mutex instead of
+	 * waking them all to fight over it.
+	 */
+	futex(&c->seq, FUTEX_REQUEUE, 1, &m->value, 0x7FFFFFFF);
+}
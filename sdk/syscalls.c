@@ -3,10 +3,13 @@
  */
 
 #include <types.h>
+#include <errno.h>
 #include <syscall.h>
 #include <dirent.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sched.h>
+#include "matrix/shared.h"
 
 /* Definition of the system calls */
 DEFN_SYSCALL0(null, 0)
@@ -44,6 +47,22 @@ DEFN_SYSCALL1(create_module, 31, int)
 DEFN_SYSCALL2(query_module, 32, const char *, void *)
 DEFN_SYSCALL1(delete_module, 33, const char *)
 DEFN_SYSCALL4(ioctl, 34, int, int, void *, void *)
+DEFN_SYSCALL2(sched_setaffinity, 35, pid_t, coremask_t)
+DEFN_SYSCALL2(sched_getaffinity, 36, pid_t, coremask_t *)
+DEFN_SYSCALL2(thread_setaffinity, 37, tid_t, coremask_t)
+DEFN_SYSCALL2(thread_getaffinity, 38, tid_t, coremask_t *)
+DEFN_SYSCALL3(sched_setscheduler, 39, tid_t, int, int)
+DEFN_SYSCALL2(sched_getscheduler, 40, tid_t, int *)
+DEFN_SYSCALL5(futex, 41, int *, int, int, void *, int)
+DEFN_SYSCALL3(thread_create, 42, void *, void *, tid_t *)
+DEFN_SYSCALL1(thread_exit, 43, int)
+DEFN_SYSCALL2(thread_join, 44, tid_t, int *)
+DEFN_SYSCALL2(sched_core_stats, 45, int, void *)
+DEFN_SYSCALL2(sched_thread_stats, 46, tid_t, void *)
+DEFN_SYSCALL4(clock_nanosleep, 47, int, int, const void *, void *)
+DEFN_SYSCALL2(clock_gettime, 48, int, void *)
+DEFN_SYSCALL2(thread_settimerslack, 49, tid_t, uint32_t)
+DEFN_SYSCALL2(thread_gettimerslack, 50, tid_t, uint32_t *)
 
 int null()
 {
@@ -75,11 +94,6 @@ int exit(int val)
 	return mtx_exit(val);
 }
 
-int gettimeofday(struct timeval *tv, struct timezone *tz)
-{
-	return mtx_gettimeofday(tv, tz);
-}
-
 int settimeofday(const struct timeval *tv, const struct timezone *tz)
 {
 	return mtx_settimeofday(tv, tz);
@@ -142,7 +156,7 @@ int setgid(gid_t gid)
 
 int getpid()
 {
-	return mtx_getpid();
+	return ((struct proc_page *)SHARED_PROC_PAGE)->pid;
 }
 
 int sleep(int ms)
@@ -150,6 +164,36 @@ int sleep(int ms)
 	return mtx_sleep(ms);
 }
 
+/* The system call fails only if a signal interrupted a valid request */
+int clock_nanosleep(clockid_t id, int flags, const struct timespec *req,
+		    struct timespec *rem)
+{
+	if (((id != CLOCK_REALTIME) && (id != CLOCK_MONOTONIC)) || !req ||
+	    (req->tv_sec < 0) || (req->tv_nsec < 0) ||
+	    (req->tv_nsec >= 1000000000)) {
+		return EINVAL;
+	}
+
+	if (mtx_clock_nanosleep(id, flags, req, rem) != 0) {
+		return EINTR;
+	}
+
+	return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+	int rc;
+
+	rc = clock_nanosleep(CLOCK_MONOTONIC, 0, req, rem);
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
 int create_process(const char *path, const char *args[], int flags, int priority)
 {
 	return mtx_create_process(path, args, flags, priority);
@@ -227,3 +271,73 @@ int ioctl(int d, int request, void *input, void *output)
 {
 	return mtx_ioctl(d, request, input, output);
 }
+
+int sched_setaffinity(pid_t pid, coremask_t mask)
+{
+	return mtx_sched_setaffinity(pid, mask);
+}
+
+int sched_getaffinity(pid_t pid, coremask_t *mask)
+{
+	return mtx_sched_getaffinity(pid, mask);
+}
+
+int thread_setaffinity(tid_t tid, coremask_t mask)
+{
+	return mtx_thread_setaffinity(tid, mask);
+}
+
+int thread_getaffinity(tid_t tid, coremask_t *mask)
+{
+	return mtx_thread_getaffinity(tid, mask);
+}
+
+int sched_setscheduler(tid_t tid, int policy, int priority)
+{
+	return mtx_sched_setscheduler(tid, policy, priority);
+}
+
+int sched_getscheduler(tid_t tid, int *priority)
+{
+	return mtx_sched_getscheduler(tid, priority);
+}
+
+int sched_core_stats(int core, struct sched_core_stats *stats)
+{
+	return mtx_sched_core_stats(core, stats);
+}
+
+int sched_thread_stats(tid_t tid, struct sched_thread_stats *stats)
+{
+	return mtx_sched_thread_stats(tid, stats);
+}
+
+int futex(int *uaddr, int op, int val, void *arg, int val2)
+{
+	return mtx_futex(uaddr, op, val, arg, val2);
+}
+
+int thread_create(void (*entry)(void *), void *arg, tid_t *tid)
+{
+	return mtx_thread_create(entry, arg, tid);
+}
+
+void thread_exit(int status)
+{
+	mtx_thread_exit(status);
+}
+
+int thread_join(tid_t tid, int *status)
+{
+	return mtx_thread_join(tid, status);
+}
+
+int thread_settimerslack(tid_t tid, uint32_t slack)
+{
+	return mtx_thread_settimerslack(tid, slack);
+}
+
+int thread_gettimerslack(tid_t tid, uint32_t *slack)
+{
+	return mtx_thread_gettimerslack(tid, slack);
+}
@@ -5,6 +5,11 @@
 #include <syscall.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sched.h>
+#include <sync.h>
+#include <sys/futex.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 static void usage();
 static void echo_test();
@@ -17,6 +22,14 @@ static void clear_test();
 static void lsmod_test();
 static void null_dev_test();
 static void multi_processes_test();
+static void nanosleep_test();
+static void shared_page_test();
+static void pthread_test();
+static void sched_stats_test();
+static void affinity_test();
+static void sched_policy_test();
+static void futex_test();
+
 static void shutdown_test();
 
 int main(int argc, char **argv)
@@ -68,6 +81,20 @@ int main(int argc, char **argv)
 
 	multi_processes_test();
 
+	affinity_test();
+
+	sched_policy_test();
+
+	sched_stats_test();
+
+	futex_test();
+
+	nanosleep_test();
+
+	shared_page_test();
+
+	pthread_test();
+
 	clear_test();
 
 	shutdown_test();
@@ -406,3 +433,351 @@ void usage()
 	       "Example: unit_test -n 100\n"
 	       );
 }
+
+static int _futex_test_word = 0;
+static volatile int _futex_test_waiting = 0;
+
+static void *futex_test_thread(void *arg)
+{
+	int rc = 0;
+
+	_futex_test_waiting = 1;
+	while (_futex_test_word == 0) {
+		rc = futex(&_futex_test_word, FUTEX_WAIT, 0, NULL, 0);
+	}
+
+	return (void *)rc;
+}
+
+void futex_test()
+{
+	int rc;
+	void *ret;
+	pthread_t thread;
+	useconds_t timeout = 1000;
+	struct timespec ts;
+
+	printf("unit_test futex:\n");
+
+	/* Waiting on a stale value returns at once */
+	rc = futex(&_futex_test_word, FUTEX_WAIT, 1, NULL, 0);
+	if (rc != -1) {
+		printf("futex wait on stale value returned(%d).\n", rc);
+	}
+
+	rc = futex(&_futex_test_word, FUTEX_WAIT, 0, &timeout, 0);
+	if (rc != -1) {
+		printf("futex wait with timeout returned(%d).\n", rc);
+	}
+
+	rc = pthread_create(&thread, futex_test_thread, NULL);
+	if (rc != 0) {
+		printf("pthread_create failed, err(%d).\n", rc);
+		goto out;
+	}
+
+	/* Give the thread the time to go to sleep on the futex */
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	do {
+		nanosleep(&ts, NULL);
+	} while (!_futex_test_waiting);
+
+	_futex_test_word = 1;
+	rc = futex(&_futex_test_word, FUTEX_WAKE, 1, NULL, 0);
+	if (rc != 1) {
+		printf("futex wake woke(%d) waiters.\n", rc);
+	}
+
+	rc = pthread_join(thread, &ret);
+	if ((rc != 0) || ((int)ret != 0)) {
+		printf("futex waiter failed, err(%d), ret(%d).\n", rc, (int)ret);
+	}
+
+	rc = futex(&_futex_test_word, FUTEX_WAKE, 1, NULL, 0);
+	if (rc != 0) {
+		printf("futex wake without waiters woke(%d).\n", rc);
+	}
+
+ out:
+	return;
+}
+
+void sched_policy_test()
+{
+	int rc, prio;
+	uid_t uid;
+
+	printf("unit_test scheduling policy:\n");
+
+	/* Real-time policies are for the super user only */
+	uid = getuid();
+	if (uid != 0) {
+		rc = sched_setscheduler(0, SCHED_FIFO, 10);
+		if (rc != -1) {
+			printf("uid(%d) set a real-time policy.\n", uid);
+		}
+		setuid(0);
+	}
+
+	rc = sched_setscheduler(0, SCHED_FIFO, 10);
+	if (rc != 0) {
+		printf("set scheduler failed, err(%d).\n", rc);
+		goto out;
+	}
+
+	rc = sched_getscheduler(0, &prio);
+	if ((rc != SCHED_FIFO) || (prio != 10)) {
+		printf("get scheduler failed, policy(%d), priority(%d).\n",
+		       rc, prio);
+	}
+
+	/* Back to the time sharing class */
+	rc = sched_setscheduler(0, SCHED_OTHER, 16);
+	if (rc != 0) {
+		printf("restore scheduler failed, err(%d).\n", rc);
+	}
+
+ out:
+	setuid(uid);
+	return;
+}
+
+/* Give up the CORE for a moment and check where the thread came back */
+static int affinity_test_core(int core)
+{
+	int rc;
+	struct timespec ts;
+	struct sched_thread_stats stats;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000;
+	nanosleep(&ts, NULL);
+
+	rc = sched_thread_stats(0, &stats);
+	if (rc != 0) {
+		printf("get thread statistics failed, err(%d).\n", rc);
+	} else if (stats.core != core) {
+		printf("thread pinned to core(%d) ran on core(%d).\n", core,
+		       stats.core);
+		rc = -1;
+	}
+
+	return rc;
+}
+
+void affinity_test()
+{
+	int rc;
+	coremask_t mask, saved;
+
+	printf("unit_test affinity:\n");
+
+	rc = sched_getaffinity(0, &saved);
+	if (rc != 0) {
+		printf("get process affinity failed, err(%d).\n", rc);
+		goto out;
+	}
+
+	/* Pin the current thread to the boot CORE */
+	rc = thread_setaffinity(0, 1);
+	if (rc != 0) {
+		printf("set thread affinity failed, err(%d).\n", rc);
+		goto out;
+	}
+
+	rc = thread_getaffinity(0, &mask);
+	if ((rc != 0) || (mask != 1)) {
+		printf("get thread affinity failed, err(%d), mask(%x).\n",
+		       rc, mask);
+		goto out;
+	}
+	affinity_test_core(0);
+
+	/* Move to the second CORE if there is one */
+	if (thread_setaffinity(0, 2) == 0) {
+		affinity_test_core(1);
+	}
+
+	/* A mask without an online CORE is refused */
+	rc = thread_setaffinity(0, 0);
+	if (rc != -1) {
+		printf("set empty thread affinity returned(%d).\n", rc);
+	}
+
+	rc = sched_setaffinity(0, saved);
+	if (rc != 0) {
+		printf("restore process affinity failed, err(%d).\n", rc);
+	}
+
+ out:
+	return;
+}
+
+void sched_stats_test()
+{
+	int rc;
+	struct sched_core_stats cs;
+	struct sched_thread_stats ts;
+
+	printf("unit_test scheduler statistics:\n");
+
+	rc = sched_core_stats(0, &cs);
+	if (rc != 0) {
+		printf("get core statistics failed, err(%d).\n", rc);
+	} else if (cs.nr_switches == 0) {
+		printf("core(0) never switched threads.\n");
+	}
+
+	rc = sched_thread_stats(0, &ts);
+	if (rc != 0) {
+		printf("get thread statistics failed, err(%d).\n", rc);
+	} else {
+		printf("run time(%lld), run delay(%lld), switches(%d/%d).\n",
+		       ts.run_time, ts.run_delay, ts.nr_vol_switches,
+		       ts.nr_invol_switches);
+	}
+}
+
+#define NR_PTHREADS	4
+
+static pthread_key_t _pthread_test_key;
+static mutex_t _pthread_test_lock = MUTEX_INITIALIZER;
+static int _pthread_test_count = 0;
+
+static void *pthread_test_thread(void *arg)
+{
+	int i;
+
+	pthread_setspecific(_pthread_test_key, arg);
+
+	for (i = 0; i < 1000; i++) {
+		mutex_lock(&_pthread_test_lock);
+		_pthread_test_count++;
+		mutex_unlock(&_pthread_test_lock);
+	}
+
+	return pthread_getspecific(_pthread_test_key);
+}
+
+void pthread_test()
+{
+	int i, rc;
+	void *ret;
+	pthread_t threads[NR_PTHREADS];
+
+	printf("unit_test pthread:\n");
+
+	rc = pthread_key_create(&_pthread_test_key, NULL);
+	if (rc != 0) {
+		printf("pthread_key_create failed, err(%d).\n", rc);
+		return;
+	}
+
+	for (i = 0; i < NR_PTHREADS; i++) {
+		rc = pthread_create(&threads[i], pthread_test_thread,
+				    (void *)(i + 1));
+		if (rc != 0) {
+			printf("pthread_create failed, err(%d).\n", rc);
+			break;
+		}
+	}
+
+	while (i-- > 0) {
+		rc = pthread_join(threads[i], &ret);
+		if ((rc != 0) || ((int)ret != (i + 1))) {
+			printf("pthread_join(%d) failed, err(%d), ret(%d).\n",
+			       i, rc, (int)ret);
+		}
+	}
+
+	if (_pthread_test_count != NR_PTHREADS * 1000) {
+		printf("pthread count mismatch(%d).\n", _pthread_test_count);
+	}
+}
+
+void nanosleep_test()
+{
+	int rc;
+	struct timespec ts, start, end;
+	long long elapsed;
+	uint32_t slack, saved = 50000;
+
+	printf("unit_test nanosleep:\n");
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000000;
+	rc = nanosleep(&ts, NULL);
+	if ((rc != -1) || (errno != EINVAL)) {
+		printf("nanosleep with invalid nsec returned(%d), errno(%d).\n",
+		       rc, errno);
+	}
+
+	ts.tv_nsec = 0;
+	rc = clock_nanosleep(-1, 0, &ts, NULL);
+	if (rc != EINVAL) {
+		printf("clock_nanosleep with invalid clock returned(%d).\n", rc);
+	}
+
+	/* Sleep without slack, the sleep is still never cut short */
+	thread_gettimerslack(0, &saved);
+	rc = thread_settimerslack(0, 0);
+	if ((rc != 0) || (thread_gettimerslack(0, &slack) != 0) ||
+	    (slack != 0)) {
+		printf("set timer slack failed, err(%d).\n", rc);
+	}
+
+	ts.tv_nsec = 10000000;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = nanosleep(&ts, NULL);
+	if (rc != 0) {
+		printf("nanosleep for 10ms failed(%d).\n", rc);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* The monotonic clock is read from the time page */
+	elapsed = (long long)(end.tv_sec - start.tv_sec) * 1000000000 +
+		(end.tv_nsec - start.tv_nsec);
+	if (elapsed < 10000000) {
+		printf("nanosleep for 10ms woke up after %lldns.\n", elapsed);
+	}
+
+	thread_settimerslack(0, saved);
+}
+
+void shared_page_test()
+{
+	int i, rc, pid;
+	struct timespec before, page, after;
+	long long ns_before, ns_page, ns_after;
+
+	printf("unit_test shared page:\n");
+
+	/* getpid() reads the process page */
+	pid = getpid();
+	if (pid != mtx_getpid()) {
+		printf("getpid from page(%d), syscall(%d).\n", pid, mtx_getpid());
+	}
+
+	/* clock_gettime() reads the time page when the TSC allows it, either
+	 * way the time must lie between the times the kernel returns.
+	 */
+	for (i = 0; i < 100; i++) {
+		rc = mtx_clock_gettime(CLOCK_MONOTONIC, &before);
+		rc |= clock_gettime(CLOCK_MONOTONIC, &page);
+		rc |= mtx_clock_gettime(CLOCK_MONOTONIC, &after);
+		if (rc != 0) {
+			printf("clock_gettime failed, err(%d).\n", rc);
+			break;
+		}
+
+		ns_before = (long long)before.tv_sec * 1000000000 + before.tv_nsec;
+		ns_page = (long long)page.tv_sec * 1000000000 + page.tv_nsec;
+		ns_after = (long long)after.tv_sec * 1000000000 + after.tv_nsec;
+		if ((ns_page < ns_before) || (ns_page > ns_after)) {
+			printf("clock_gettime from page(%lld) not in [%lld, %lld].\n",
+			       ns_page, ns_before, ns_after);
+			break;
+		}
+	}
+}